@@ -6,8 +6,13 @@
 // a synchronization point for disk blocks used by multiple processes.
 //
 // Interface:
-// * To get a buffer for a particular disk block, call bread.
-// * After changing buffer data, call bwrite to write it to disk.
+// * To get a buffer for a particular disk block, call bread for
+//     a single sector or bread_blk for a run of them, at most a
+//     page long. A given sector must always be read with the same
+//     run: the cache does not notice overlapping buffers.
+// * After changing buffer data, call bdirty to have it written
+//     back later, or bwrite to write it to disk now.
+// * bflush and bsync write back dirty buffers before returning.
 // * When done with the buffer, call brelse.
 // * Do not use the buffer after calling brelse.
 // * Only one process at a time can use a buffer,
@@ -24,84 +29,350 @@
 #include "include/sdcard.h"
 #include "include/printf.h"
 #include "include/disk.h"
+#include "include/kalloc.h"
+#include "include/sysinfo.h"
+#include "include/proc.h"
+#include "include/timer.h"
+#include "include/string.h"
 
-struct {
+// The buffers are spread over NBUCKET hash chains by (dev,
+// sectorno), each with its own lock, so that lookups of
+// different blocks don't serialise. Each chain is kept in LRU
+// order. A miss reuses the least recently used free buffer of
+// its own chain, or else steals one from another chain; the
+// chains are scanned clock-wise, from where the last steal left
+// off. Only stealing takes bcache.lock.
+//
+// Buffers are sized by the run of sectors they hold: single
+// sectors are carved BPP to a page, together with their headers;
+// a longer run gets a page of its own and a header from
+// bhdr_cache. Misses take new pages from kalloc() while the cache
+// is smaller than its share of the memory free at boot and
+// memory is plentiful, or when every buffer of the size is in
+// use; otherwise they reuse a free buffer of the same size. When
+// kreclaimd asks, idle pages go back, down to NBUF buffers.
+#define NBUCKET 13
+#define BCACHE_SHARE 16   // 1/BCACHE_SHARE of free memory at boot
+
+struct bufpage {
+  struct bufpage *next;
+  struct buf buf[];       // BPP headers, then their sectors
+};
+
+#define BPP ((PGSIZE - sizeof(struct bufpage)) / (sizeof(struct buf) + BSIZE))
+
+// Dirty buffers are written back by kflushd once they have been
+// dirty for BDIRTY_EXPIRE, so that repeated changes to a block
+// cost one write. A dirty buffer holds a reference of its own,
+// which keeps it from being reused or shrunk away before it is
+// clean. Past a quarter of the cache dirty, kflushd writes back
+// everything; past half, bdirty() writes through.
+#define BDIRTY_EXPIRE   (5 * CLOCK_FREQ)
+#define BFLUSH_INTERVAL CLOCK_FREQ
+#define BFLUSH_BATCH    16
+
+// Blocks queued by breadahead() for kreadahead to read in. When
+// the queue is full, further requests are dropped.
+#define RA_QUEUE        32
+#define RA_BATCH        8
+
+static struct {
   struct spinlock lock;
-  struct buf buf[NBUF];
+  struct {
+    uint dev;
+    uint sectorno;
+    uint nsec;
+  } req[RA_QUEUE];
+  uint head;              // next to read
+  uint tail;              // next free slot
+} raq;
 
-  // Linked list of all buffers, through prev/next.
-  // Sorted by how recently the buffer was used.
+struct bucket {
+  struct spinlock lock;
   // head.next is most recent, head.prev is least.
   struct buf head;
+};
+
+struct {
+  struct spinlock lock;   // serialises steals, growing and shrinking
+  struct bucket bucket[NBUCKET];
+  int hand;               // next chain to steal from
+  struct buf *bufs;       // every buffer, through link
+  struct bufpage *pages;  // pages of single-sector buffers
+  uint64 nbuf;
+  uint64 npage;           // pages held, headers and data
+  uint64 target;          // grow on misses up to this many pages
+  uint64 hit;             // counters, updated atomically
+  uint64 miss;
+  uint64 evict;           // cached blocks dropped for others
+  uint64 ra;              // blocks read ahead
+  uint64 ndirty;
+  struct shrinker shrinker;
 } bcache;
 
+static struct kmem_cache bhdr_cache;
+static struct kmem_cache blkreq_cache;  // for bstart()
+
+static inline struct bucket *
+bhash(uint dev, uint sectorno)
+{
+  return &bcache.bucket[(dev * 31 + sectorno) % NBUCKET];
+}
+
+static void
+bunlink(struct buf *b)
+{
+  b->next->prev = b->prev;
+  b->prev->next = b->next;
+}
+
+// Insert b at the most recently used end of bk.
+static void
+bpush(struct bucket *bk, struct buf *b)
+{
+  b->next = bk->head.next;
+  b->prev = &bk->head;
+  bk->head.next->prev = b;
+  bk->head.next = b;
+}
+
+// Insert b at the least recently used end of bk.
+static void
+bappend(struct bucket *bk, struct buf *b)
+{
+  b->prev = bk->head.prev;
+  b->next = &bk->head;
+  bk->head.prev->next = b;
+  bk->head.prev = b;
+}
+
+static void
+binitbuf(struct buf *b, uint nsec, uchar *data)
+{
+  b->valid = 0;
+  b->dirty = 0;
+  b->refcnt = 0;
+  b->sectorno = ~0;
+  b->dev = ~0;
+  b->nsec = nsec;
+  b->data = data;
+  initsleeplock(&b->lock, "buffer");
+  b->link = bcache.bufs;
+  bcache.bufs = b;
+  bcache.nbuf++;
+}
+
+// Add buffers of nsec sectors: a page of single sectors, or one
+// longer buffer. One is returned, unlinked, for the caller; the
+// rest are dealt out over the chains as free. Caller holds
+// bcache.lock.
+static struct buf*
+bgrow(uint nsec)
+{
+  struct bufpage *pg;
+  struct buf *b;
+  struct bucket *bk;
+  uchar *data;
+
+  if(nsec > 1){
+    if((b = kmem_cache_alloc(&bhdr_cache)) == 0)
+      return 0;
+    if((data = kalloc()) == 0){
+      kmem_cache_free(&bhdr_cache, b);
+      return 0;
+    }
+    binitbuf(b, nsec, data);
+    bcache.npage++;
+    return b;
+  }
+
+  if((pg = kalloc()) == 0)
+    return 0;
+  pg->next = bcache.pages;
+  bcache.pages = pg;
+  bcache.npage++;
+  data = (uchar*)&pg->buf[BPP];
+  for(b = pg->buf; b < pg->buf+BPP; b++, data += BSIZE){
+    binitbuf(b, 1, data);
+    if(b == pg->buf)
+      continue;
+    bk = &bcache.bucket[bcache.nbuf % NBUCKET];
+    acquire(&bk->lock);
+    bappend(bk, b);
+    release(&bk->lock);
+  }
+  return pg->buf;
+}
+
+static uint64 bshrink(struct shrinker *s, uint64 want);
+
+// Start with a page of single sectors; the rest is added on
+// demand, once a file system has said how long its blocks are.
 void
 binit(void)
 {
   struct buf *b;
+  struct bucket *bk;
 
-  initlock(&bcache.lock, "bcache");
-
-  // Create linked list of buffers
-  bcache.head.prev = &bcache.head;
-  bcache.head.next = &bcache.head;
-  for(b = bcache.buf; b < bcache.buf+NBUF; b++){
-    b->refcnt = 0;
-    b->sectorno = ~0;
-    b->dev = ~0;
-    b->next = bcache.head.next;
-    b->prev = &bcache.head;
-    initsleeplock(&b->lock, "buffer");
-    bcache.head.next->prev = b;
-    bcache.head.next = b;
+  initlock_kind(&bcache.lock, "bcache", SPIN_QUEUED);
+  for(bk = bcache.bucket; bk < bcache.bucket+NBUCKET; bk++){
+    initlock(&bk->lock, "bcache.bucket");
+    bk->head.prev = &bk->head;
+    bk->head.next = &bk->head;
   }
+  kmem_cache_init(&bhdr_cache, "bhdr", sizeof(struct buf));
+  kmem_cache_init(&blkreq_cache, "blkreq", sizeof(struct blkreq));
+  bcache.hand = 0;
+  bcache.bufs = 0;
+  bcache.pages = 0;
+  bcache.nbuf = 0;
+  bcache.npage = 0;
+  bcache.hit = bcache.miss = bcache.evict = bcache.ra = 0;
+  initlock(&raq.lock, "bcache.ra");
+  raq.head = raq.tail = 0;
+  bcache.ndirty = 0;
+
+  bcache.target = freemem_amount() / BCACHE_SHARE / PGSIZE;
+  acquire(&bcache.lock);
+  if((b = bgrow(1)) == 0)
+    panic("binit");
+  bk = &bcache.bucket[0];
+  acquire(&bk->lock);
+  bappend(bk, b);
+  release(&bk->lock);
+  release(&bcache.lock);
+
+  bcache.shrinker.shrink = bshrink;
+  register_shrinker(&bcache.shrinker);
   #ifdef DEBUG
-  printf("binit\n");
+  printf("binit: %d buffers\n", bcache.nbuf);
   #endif
 }
 
-// Look through buffer cache for block on device dev.
-// If not found, allocate a buffer.
-// In either case, return locked buffer.
+// Find the block in bk, or claim a free buffer of bk of the
+// right size for it. Caller holds bk->lock. Returns 0 if
+// neither is possible.
 static struct buf*
-bget(uint dev, uint sectorno)
+blookup(struct bucket *bk, uint dev, uint sectorno, uint nsec)
 {
   struct buf *b;
 
-  acquire(&bcache.lock);
-
-  // Is the block already cached?
-  for(b = bcache.head.next; b != &bcache.head; b = b->next){
+  for(b = bk->head.next; b != &bk->head; b = b->next){
     if(b->dev == dev && b->sectorno == sectorno){
+      if(b->nsec != nsec)
+        panic("bget: size");
       b->refcnt++;
-      release(&bcache.lock);
-      acquiresleep(&b->lock);
+      __sync_fetch_and_add(&bcache.hit, 1);
       return b;
     }
   }
-
-  // Not cached.
-  // Recycle the least recently used (LRU) unused buffer.
-  for(b = bcache.head.prev; b != &bcache.head; b = b->prev){
-    if(b->refcnt == 0) {
+  for(b = bk->head.prev; b != &bk->head; b = b->prev){
+    if(b->refcnt == 0 && b->nsec == nsec) {
+      __sync_fetch_and_add(&bcache.miss, 1);
+      if(b->valid)
+        __sync_fetch_and_add(&bcache.evict, 1);
       b->dev = dev;
       b->sectorno = sectorno;
       b->valid = 0;
       b->refcnt = 1;
-      release(&bcache.lock);
-      acquiresleep(&b->lock);
       return b;
     }
   }
-  panic("bget: no buffers");
+  return 0;
 }
 
-// Return a locked buf with the contents of the indicated block.
-struct buf* 
-bread(uint dev, uint sectorno) {
+// Take the least recently used free buffer of nsec sectors from
+// some other chain than bk. Caller holds bcache.lock.
+static struct buf*
+bsteal(struct bucket *bk, uint nsec)
+{
+  struct buf *b;
+  struct bucket *victim;
+
+  for(int i = 0; i < NBUCKET; i++){
+    victim = &bcache.bucket[bcache.hand];
+    bcache.hand = (bcache.hand + 1) % NBUCKET;
+    if(victim == bk)
+      continue;
+    acquire(&victim->lock);
+    for(b = victim->head.prev; b != &victim->head; b = b->prev){
+      if(b->refcnt == 0 && b->nsec == nsec){
+        bunlink(b);
+        release(&victim->lock);
+        if(b->valid)
+          __sync_fetch_and_add(&bcache.evict, 1);
+        return b;
+      }
+    }
+    release(&victim->lock);
+  }
+  return 0;
+}
+
+// Look through buffer cache for block on device dev.
+// If not found, allocate a buffer.
+// In either case, return locked buffer; with nowait, only if
+// its lock is free, else 0.
+static struct buf*
+bget(uint dev, uint sectorno, uint nsec, int nowait)
+{
+  struct buf *b, *nb;
+  struct bucket *bk = bhash(dev, sectorno);
+
+  if(nsec == 0 || nsec > PGSIZE / BSIZE)
+    panic("bget: nsec");
+  acquire(&bk->lock);
+  b = blookup(bk, dev, sectorno, nsec);
+  release(&bk->lock);
+  if(b)
+    goto found;
+
+  // Not cached, and no free buffer in our chain: take a new one
+  // while memory allows, else steal one; if every buffer is in
+  // use, grow anyway.
+  acquire(&bcache.lock);
+  nb = 0;
+  if(bcache.npage < bcache.target && kmem_plenty())
+    nb = bgrow(nsec);
+  if(nb == 0 && (nb = bsteal(bk, nsec)) == 0 && (nb = bgrow(nsec)) == 0)
+    panic("bget: no buffers");
+  acquire(&bk->lock);
+  // The chain was unlocked meanwhile: someone may have
+  // brought the block in, or freed a buffer here.
+  if((b = blookup(bk, dev, sectorno, nsec)) != 0){
+    nb->dev = ~0;
+    nb->sectorno = ~0;
+    nb->refcnt = 0;
+    bappend(bk, nb);   // it holds nothing: reuse it first
+  } else {
+    __sync_fetch_and_add(&bcache.miss, 1);
+    b = nb;
+    b->dev = dev;
+    b->sectorno = sectorno;
+    b->valid = 0;
+    b->refcnt = 1;
+    bpush(bk, b);
+  }
+  release(&bk->lock);
+  release(&bcache.lock);
+
+found:
+  if(!nowait)
+    acquiresleep(&b->lock);
+  else if(!tryacquiresleep(&b->lock)){
+    bunpin(b);
+    return 0;
+  }
+  return b;
+}
+
+// Return a locked buf with the contents of the nsec sectors
+// from sectorno on.
+struct buf*
+bread_blk(uint dev, uint sectorno, uint nsec) {
   struct buf *b;
 
-  b = bget(dev, sectorno);
+  b = bget(dev, sectorno, nsec, 0);
   if (!b->valid) {
     disk_read(b);
     b->valid = 1;
@@ -110,12 +381,110 @@ bread(uint dev, uint sectorno) {
   return b;
 }
 
+// Return a locked buf with the contents of the indicated sector.
+struct buf* 
+bread(uint dev, uint sectorno) {
+  return bread_blk(dev, sectorno, 1);
+}
+
+// Return a locked buf for the nsec sectors from sectorno on,
+// zero-filled instead of read: for blocks about to be
+// overwritten as a whole.
+struct buf*
+bget_zero(uint dev, uint sectorno, uint nsec) {
+  struct buf *b;
+
+  b = bget(dev, sectorno, nsec, 0);
+  memset(b->data, 0, nsec * BSIZE);
+  b->valid = 1;
+  return b;
+}
+
+// Start reading or writing the whole of b, which the caller
+// holds locked. Returns the request to bwait() for, or 0 if
+// there was no memory for one and the I/O is already done.
+static struct blkreq*
+bstart(struct buf *b, int op)
+{
+  struct blkreq *r;
+
+  if((r = kmem_cache_alloc(&blkreq_cache)) == 0){
+    if(op == BLK_READ)
+      disk_read(b);
+    else
+      disk_write(b);
+    return 0;
+  }
+  disk_req_buf(r, b, op);
+  disk_submit(r);
+  return r;
+}
+
+static void
+bwait(struct blkreq *r)
+{
+  if(r == 0)
+    return;
+  disk_wait(r);
+  if(r->status != 0)
+    panic("bwait");
+  kmem_cache_free(&blkreq_cache, r);
+}
+
+// b's dirty contents reached the disk: drop its dirty
+// reference. Caller holds b->lock.
+static void
+bwritten(struct buf *b)
+{
+  b->dirty = 0;
+  __sync_fetch_and_sub(&bcache.ndirty, 1);
+  bunpin(b);
+}
+
+// Write a dirty b to disk. Caller holds b->lock.
+static void
+bclean(struct buf *b)
+{
+  disk_write(b);
+  bwritten(b);
+}
+
 // Write b's contents to disk.  Must be locked.
 void 
 bwrite(struct buf *b) {
   if(!holdingsleep(&b->lock))
     panic("bwrite");
-  disk_write(b);
+  if(b->dirty)
+    bclean(b);
+  else
+    disk_write(b);
+}
+
+// Mark b's contents as changed, to be written back later.
+// Must be locked.
+void
+bdirty(struct buf *b)
+{
+  struct bucket *bk;
+  uint64 n;
+
+  if(!holdingsleep(&b->lock))
+    panic("bdirty");
+  if(b->dirty)
+    return;
+  if(bcache.ndirty >= bcache.nbuf / 2){
+    disk_write(b);
+    return;
+  }
+  bk = bhash(b->dev, b->sectorno);
+  acquire(&bk->lock);
+  b->refcnt++;
+  b->dirty = 1;
+  release(&bk->lock);
+  b->dirtied = r_time();
+  n = __sync_add_and_fetch(&bcache.ndirty, 1);
+  if(n == bcache.nbuf / 4)
+    wakeup(&bcache.ndirty);
 }
 
 // Release a locked buffer.
@@ -123,38 +492,351 @@ bwrite(struct buf *b) {
 void
 brelse(struct buf *b)
 {
+  struct bucket *bk;
+
   if(!holdingsleep(&b->lock))
     panic("brelse");
 
   releasesleep(&b->lock);
 
-  acquire(&bcache.lock);
+  // b can't move to another chain while we hold a reference.
+  bk = bhash(b->dev, b->sectorno);
+  acquire(&bk->lock);
   b->refcnt--;
   if (b->refcnt == 0) {
     // no one is waiting for it.
-    b->next->prev = b->prev;
-    b->prev->next = b->next;
-    b->next = bcache.head.next;
-    b->prev = &bcache.head;
-    bcache.head.next->prev = b;
-    bcache.head.next = b;
+    bunlink(b);
+    bpush(bk, b);
   }
   
-  release(&bcache.lock);
+  release(&bk->lock);
 }
 
 void
 bpin(struct buf *b) {
-  acquire(&bcache.lock);
+  struct bucket *bk = bhash(b->dev, b->sectorno);
+
+  acquire(&bk->lock);
   b->refcnt++;
-  release(&bcache.lock);
+  release(&bk->lock);
 }
 
 void
 bunpin(struct buf *b) {
-  acquire(&bcache.lock);
+  struct bucket *bk = bhash(b->dev, b->sectorno);
+
+  acquire(&bk->lock);
   b->refcnt--;
+  release(&bk->lock);
+}
+
+// Give back idle pages, keeping at least NBUF buffers: longer
+// buffers first, then pages of single sectors that are idle as a
+// whole. Holding bcache.lock and every chain lock, in order,
+// nobody can find or claim a buffer meanwhile.
+static uint64
+bshrink(struct shrinker *s, uint64 want)
+{
+  struct bufpage **pp, *pg, *freepg = 0;
+  struct buf **bp, *b, *freebuf = 0;
+  uint64 n = 0, nvalid;
+
+  acquire(&bcache.lock);
+  for(int i = 0; i < NBUCKET; i++)
+    acquire(&bcache.bucket[i].lock);
+
+  for(bp = &bcache.bufs; (b = *bp) != 0 && n < want && bcache.nbuf > NBUF; ){
+    if(b->nsec == 1 || b->refcnt != 0){
+      bp = &b->link;
+      continue;
+    }
+    bunlink(b);
+    *bp = b->link;
+    b->next = freebuf;
+    freebuf = b;
+    bcache.nbuf--;
+    bcache.npage--;
+    __sync_fetch_and_add(&bcache.evict, b->valid);
+    n++;
+  }
+
+  pp = &bcache.pages;
+  while((pg = *pp) != 0 && n < want && bcache.nbuf >= NBUF + BPP){
+    nvalid = 0;
+    for(b = pg->buf; b < pg->buf+BPP; b++){
+      if(b->refcnt != 0)
+        break;
+      nvalid += b->valid;
+    }
+    if(b < pg->buf+BPP){
+      pp = &pg->next;
+      continue;
+    }
+    for(b = pg->buf; b < pg->buf+BPP; b++){
+      bunlink(b);
+      b->nsec = 0;      // off bcache.bufs below
+    }
+    *pp = pg->next;
+    pg->next = freepg;
+    freepg = pg;
+    bcache.nbuf -= BPP;
+    bcache.npage--;
+    __sync_fetch_and_add(&bcache.evict, nvalid);
+    n++;
+  }
+  if(freepg){
+    for(bp = &bcache.bufs; (b = *bp) != 0; ){
+      if(b->nsec == 0)
+        *bp = b->link;
+      else
+        bp = &b->link;
+    }
+  }
+
+  for(int i = NBUCKET - 1; i >= 0; i--)
+    release(&bcache.bucket[i].lock);
   release(&bcache.lock);
+
+  while((b = freebuf) != 0){
+    freebuf = b->next;
+    kfree(b->data);
+    kmem_cache_free(&bhdr_cache, b);
+  }
+  while((pg = freepg) != 0){
+    freepg = pg->next;
+    kfree(pg);
+  }
+  return n;
+}
+
+void
+bcache_stat(struct bcachestat *st)
+{
+  st->nbuf = bcache.nbuf;
+  st->hit = bcache.hit;
+  st->miss = bcache.miss;
+  st->evict = bcache.evict;
+  st->ra = bcache.ra;
+}
+
+// Write back the dirty buffers of dev (or of every device, for
+// ANYDEV) overlapping sectors [lo, hi) that were dirtied before the
+// given time. They are picked up BFLUSH_BATCH at a time, with
+// an extra reference each, and their writes are all queued, in
+// sector order and with the disk plugged so that neighbours go
+// out merged, before waiting for any.
+static void
+bwriteback(uint dev, uint lo, uint hi, uint64 before)
+{
+  struct buf *v[BFLUSH_BATCH], *b;
+  struct blkreq *rq[BFLUSH_BATCH];
+  char writing[BFLUSH_BATCH];
+  struct bucket *bk;
+  int n, i, j, skipped;
+
+  do {
+    n = 0;
+    acquire(&bcache.lock);    // keeps the buffers from going away
+    for(b = bcache.bufs; b && n < BFLUSH_BATCH; b = b->link){
+      if(!b->dirty || (dev != ANYDEV && b->dev != dev) ||
+         b->sectorno + b->nsec <= lo || b->sectorno >= hi || b->dirtied >= before)
+        continue;
+      // a dirty buffer can't change identity, but b may have
+      // been cleaned and reused since the unlocked look.
+      bk = bhash(b->dev, b->sectorno);
+      acquire(&bk->lock);
+      if(b->dirty && bhash(b->dev, b->sectorno) == bk){
+        b->refcnt++;
+        v[n++] = b;
+      }
+      release(&bk->lock);
+    }
+    release(&bcache.lock);
+
+    for(i = 1; i < n; i++){
+      b = v[i];
+      for(j = i; j > 0 && (v[j-1]->dev > b->dev ||
+          (v[j-1]->dev == b->dev && v[j-1]->sectorno > b->sectorno)); j--)
+        v[j] = v[j-1];
+      v[j] = b;
+    }
+    // Only the first lock is waited for: waiting for one while
+    // holding others could deadlock with a process that holds
+    // it and wants one of ours. Skipped buffers stay dirty and
+    // are picked up again on the next pass.
+    skipped = 0;
+    if(n > 0)
+      acquiresleep(&v[0]->lock);
+    disk_plug();
+    for(i = 0; i < n; i++){
+      writing[i] = 0;
+      if(i > 0 && !tryacquiresleep(&v[i]->lock)){
+        bunpin(v[i]);
+        v[i] = 0;
+        skipped++;
+        continue;
+      }
+      if(v[i]->dirty){
+        rq[i] = bstart(v[i], BLK_WRITE);
+        writing[i] = 1;
+      }
+    }
+    disk_unplug();
+    for(i = 0; i < n; i++){
+      if(v[i] == 0)
+        continue;
+      if(writing[i]){
+        bwait(rq[i]);
+        bwritten(v[i]);
+      }
+      brelse(v[i]);
+    }
+  } while(n == BFLUSH_BATCH || skipped);
+}
+
+// Write back the dirty buffers overlapping sectors
+// [sectorno, sectorno+n) of dev. The caller must not hold any of them.
+void
+bflush(uint dev, uint sectorno, uint n)
+{
+  bwriteback(dev, sectorno, sectorno + n, ~0UL);
+}
+
+// Write back every dirty buffer and flush the disks' caches.
+void
+bsync(void)
+{
+  bwriteback(ANYDEV, 0, ~0U, ~0UL);
+  disk_flush(ANYDEV);
+}
+
+static struct hrtimer bflush_timer;
+
+static void
+bflush_poll(struct hrtimer *t)
+{
+  if(bcache.ndirty)
+    wakeup(&bcache.ndirty);
+}
+
+static void
+kflushd(void *arg)
+{
+  uint64 now;
+
+  acquire(&bcache.lock);
+  for(;;){
+    sleep(&bcache.ndirty, &bcache.lock);
+    release(&bcache.lock);
+    now = r_time();
+    if(bcache.ndirty >= bcache.nbuf / 4)
+      bwriteback(ANYDEV, 0, ~0U, ~0UL);
+    else if(now > BDIRTY_EXPIRE)
+      bwriteback(ANYDEV, 0, ~0U, now - BDIRTY_EXPIRE);
+    acquire(&bcache.lock);
+  }
+}
+
+// Whether the block is cached, or being read in.
+static int
+bcached(uint dev, uint sectorno)
+{
+  struct bucket *bk = bhash(dev, sectorno);
+  struct buf *b;
+
+  acquire(&bk->lock);
+  for(b = bk->head.next; b != &bk->head; b = b->next){
+    if(b->dev == dev && b->sectorno == sectorno)
+      break;
+  }
+  release(&bk->lock);
+  return b != &bk->head;
 }
 
+// Have the nsec sectors from sectorno on read into the cache in
+// the background, unless they are already there. Must not be
+// called with a spinlock held.
+void
+breadahead(uint dev, uint sectorno, uint nsec)
+{
+  uint i;
+
+  if(bcached(dev, sectorno))
+    return;
+  acquire(&raq.lock);
+  for(i = raq.head; i != raq.tail; i++){
+    if(raq.req[i % RA_QUEUE].dev == dev && raq.req[i % RA_QUEUE].sectorno == sectorno)
+      break;
+  }
+  if(i != raq.tail || raq.tail - raq.head == RA_QUEUE){
+    release(&raq.lock);
+    return;
+  }
+  raq.req[raq.tail % RA_QUEUE].dev = dev;
+  raq.req[raq.tail % RA_QUEUE].sectorno = sectorno;
+  raq.req[raq.tail % RA_QUEUE].nsec = nsec;
+  raq.tail++;
+  release(&raq.lock);
+  wakeup(&raq);
+}
 
+// Takes up to RA_BATCH queued blocks at a time and has all their
+// reads in flight at once. Blocks someone else holds are left to
+// them: kreadahead never waits for a buffer lock.
+static void
+kreadahead(void *arg)
+{
+  struct buf *b[RA_BATCH];
+  struct blkreq *rq[RA_BATCH];
+  uint dev[RA_BATCH], sectorno[RA_BATCH], nsec[RA_BATCH];
+  int n, i;
+
+  acquire(&raq.lock);
+  for(;;){
+    while(raq.head == raq.tail)
+      sleep(&raq, &raq.lock);
+    for(n = 0; n < RA_BATCH && raq.head != raq.tail; n++, raq.head++){
+      dev[n] = raq.req[raq.head % RA_QUEUE].dev;
+      sectorno[n] = raq.req[raq.head % RA_QUEUE].sectorno;
+      nsec[n] = raq.req[raq.head % RA_QUEUE].nsec;
+    }
+    release(&raq.lock);
+
+    disk_plug();
+    for(i = 0; i < n; i++){
+      b[i] = 0;
+      if(bcached(dev[i], sectorno[i]) ||
+         (b[i] = bget(dev[i], sectorno[i], nsec[i], 1)) == 0)
+        continue;
+      if(b[i]->valid){
+        brelse(b[i]);
+        b[i] = 0;
+        continue;
+      }
+      rq[i] = bstart(b[i], BLK_READ);
+    }
+    disk_unplug();
+    for(i = 0; i < n; i++){
+      if(b[i] == 0)
+        continue;
+      bwait(rq[i]);
+      b[i]->valid = 1;
+      brelse(b[i]);
+      __sync_fetch_and_add(&bcache.ra, 1);
+    }
+    acquire(&raq.lock);
+  }
+}
+
+// Start the write-back and readahead daemons, once the scheduler
+// can run them.
+void
+bio_daemons_init(void)
+{
+  if(kthread_create(kflushd, 0, "kflushd") == NULL ||
+     kthread_create(kreadahead, 0, "kreadahead") == NULL)
+    panic("bio_daemons_init");
+  hrtimer_init(&bflush_timer, bflush_poll, 0);
+  bflush_timer.period = BFLUSH_INTERVAL;
+  hrtimer_start(&bflush_timer, r_time() + BFLUSH_INTERVAL);
+}
@@ -2,48 +2,472 @@
 #include "include/param.h"
 #include "include/memlayout.h"
 #include "include/riscv.h"
+#include "include/spinlock.h"
+#include "include/proc.h"
+#include "include/printf.h"
+#include "include/timer.h"
+#include "include/string.h"
 
 #include "include/buf.h"
+#include "include/disk.h"
 
 #ifndef QEMU
 #include "include/sdcard.h"
 #include "include/dmac.h"
 #else
 #include "include/virtio.h"
-#endif 
+#endif
+
+// How long a request may wait in the queue before it goes ahead
+// of the elevator order.
+#define BLK_READ_EXPIRE   (CLOCK_FREQ / 20)     // 50ms
+#define BLK_WRITE_EXPIRE  (CLOCK_FREQ / 2)      // 500ms
+
+#define NMERGED           8     // merged requests in flight, per disk
+
+// A whole disk's requests. How much may be in flight at its
+// driver is the driver's to say: a virtio request takes one
+// descriptor, or one per segment plus two, out of those of its
+// queues; keeping within them, virtio_disk_submit() never sleeps,
+// so requests can be sent from the completion interrupt. The SD
+// card driver does one request at a time, in the process that
+// sends it.
+struct blkqueue {
+  struct spinlock lock;
+  struct blkdev *dev;
+  struct blkreq *queue;         // sorted by sectorno
+  int inflight;                 // slots in use
+  int force;                    // send all queued, plugged or not
+  int running;                  // someone is in blk_run()'s loop
+  uint last;                    // where the elevator is
+  // requests made of several queued ones, with the originals
+  // on private, linked by next.
+  struct blkreq merged[NMERGED];
+  char mused[NMERGED];
+};
+
+static struct blkqueue blkq[NDISK];
+static int plugged;
+
+static struct {
+  struct spinlock lock;
+  struct blkdev dev[NBLKDEV];
+  int ndev;
+  int ndisk;
+} blkdevs;
+
+// Waiters for requests sleep on them under this lock, which
+// blk_done() takes to mark them done.
+static struct spinlock blk_lock;
+
+#ifndef QEMU
+// The SD card driver is synchronous: r is done on return.
+static void sdcard_submit(struct blkreq *r)
+{
+    uint sec = r->sectorno;
+
+    for (int i = 0; i < r->nseg; i++) {
+        for (uint off = 0; off < r->seg[i].len; off += BSIZE, sec++) {
+            if (r->op == BLK_READ)
+                sdcard_read_sector(r->seg[i].addr + off, sec);
+            else if (r->op == BLK_WRITE)
+                sdcard_write_sector(r->seg[i].addr + off, sec);
+        }
+    }
+    disk_complete(r, 0);
+}
+
+static int sdcard_cost(struct blkreq *r)
+{
+    return 1;
+}
+#endif
+
+#ifdef RAMDISK
+extern uchar ramdisk_start[], ramdisk_end[];
+#endif
 
 void disk_init(void)
 {
+    initlock(&blk_lock, "blkreq");
+    initlock(&blkdevs.lock, "blkdevs");
+    #ifdef RAMDISK
+    ramdisk_register("ram0", ramdisk_start, (ramdisk_end - ramdisk_start) / BSIZE);
+    #endif
     #ifdef QEMU
     virtio_disk_init();
-	#else 
+	#else
 	sdcard_init();
+    disk_register("sd0", ~0U, sdcard_submit, sdcard_cost, 1, 0);
     #endif
+    if (blkdevs.ndisk == 0)
+        panic("disk_init: no disks");
 }
 
-void disk_read(struct buf *b)
+static int blkdev_add_locked(char *name, uint disk, uint start, uint nsec)
+{
+    struct blkdev *d;
+
+    if (blkdevs.ndev == NBLKDEV)
+        return -1;
+    d = &blkdevs.dev[blkdevs.ndev];
+    safestrcpy(d->name, name, sizeof(d->name));
+    d->disk = disk;
+    d->start = start;
+    d->nsec = nsec;
+    return blkdevs.ndev++;
+}
+
+// Called by a driver for each disk it finds; returns the disk's
+// device number, or -1 if there is no room.
+int disk_register(char *name, uint nsec, void (*submit)(struct blkreq *),
+                  int (*cost)(struct blkreq *), int slots, void *private)
+{
+    struct blkqueue *q;
+    struct blkdev *d;
+    int dev = -1;
+
+    acquire(&blkdevs.lock);
+    if (blkdevs.ndisk < NDISK &&
+        (dev = blkdev_add_locked(name, blkdevs.ndev, 0, nsec)) >= 0) {
+        d = &blkdevs.dev[dev];
+        d->submit = submit;
+        d->cost = cost;
+        d->slots = slots;
+        d->private = private;
+        q = &blkq[blkdevs.ndisk++];
+        initlock(&q->lock, "blkq");
+        q->dev = d;
+        d->q = q;
+    }
+    release(&blkdevs.lock);
+    if (dev >= 0)
+        printf("%s: %d sectors\n", name, nsec);
+    return dev;
+}
+
+// Add a device for sectors [start, start+nsec) of a disk.
+int blkdev_add(char *name, uint disk, uint start, uint nsec)
+{
+    int dev;
+
+    acquire(&blkdevs.lock);
+    dev = blkdev_add_locked(name, disk, start, nsec);
+    release(&blkdevs.lock);
+    if (dev >= 0)
+        printf("%s: %d sectors from %d\n", name, nsec, start);
+    return dev;
+}
+
+// The device numbered dev, or 0 if there is none.
+struct blkdev *blkdev_get(uint dev)
+{
+    if (dev >= blkdevs.ndev)
+        return 0;
+    return &blkdevs.dev[dev];
+}
+
+int blkdev_find(char *name)
+{
+    for (int i = 0; i < blkdevs.ndev; i++) {
+        if (strncmp(blkdevs.dev[i].name, name, sizeof(blkdevs.dev[i].name)) == 0)
+            return i;
+    }
+    return -1;
+}
+
+// Look for partitions on the disks. Needs the buffer cache and a
+// process to sleep in.
+void disk_probe(void)
+{
+    int n = blkdevs.ndisk;
+
+    for (int i = 0; i < n; i++)
+        part_scan(blkq[i].dev - blkdevs.dev);
+}
+
+// Make r a request to read or write the whole of b.
+void disk_req_buf(struct blkreq *r, struct buf *b, int op)
+{
+    r->op = op;
+    r->dev = b->dev;
+    r->sectorno = b->sectorno;
+    r->nseg = 1;
+    r->seg[0].addr = b->data;
+    r->seg[0].len = b->nsec * BSIZE;
+    r->end = 0;
+    r->private = b;
+}
+
+static uint blk_nsec(struct blkreq *r)
+{
+    uint n = 0;
+    for (int i = 0; i < r->nseg; i++)
+        n += r->seg[i].len / BSIZE;
+    return n;
+}
+
+// Whether r's segments added to m's make a request that costs at
+// most room at d's driver. m and r together fit in a blkreq.
+static int blk_fits(struct blkdev *d, struct blkreq *m, struct blkreq *r, int room)
+{
+    struct blkreq t = *m;
+
+    for (int i = 0; i < r->nseg; i++)
+        t.seg[t.nseg++] = r->seg[i];
+    return d->cost(&t) <= room;
+}
+
+// Take the next request to send off the queue: the one past its
+// deadline longest, else the next one up from where the elevator
+// is, wrapping around at the end. Requests that follow it on the
+// disk, for the same op, are merged into it while they fit, in
+// segments and in the room slots left at the driver. Returns 0,
+// and takes nothing, if the pick itself doesn't fit in room.
+// Caller holds q->lock; the queue is not empty.
+static struct blkreq *blk_next(struct blkqueue *q, int room)
+{
+    struct blkdev *d = q->dev;
+    struct blkreq **pp, *r, *pick = 0, *m, *tail;
+    uint64 now = r_time();
+    uint end;
+    int i, k;
+
+    for (r = q->queue; r; r = r->next) {
+        if (r->deadline <= now && (pick == 0 || r->deadline < pick->deadline))
+            pick = r;
+    }
+    if (pick == 0) {
+        for (r = q->queue; r && r->sectorno < q->last; r = r->next)
+            ;
+        pick = r ? r : q->queue;
+    }
+    if (d->cost(pick) > room)
+        return 0;
+    for (pp = &q->queue; *pp != pick; pp = &(*pp)->next)
+        ;
+    *pp = pick->next;
+    pick->next = 0;
+
+    end = pick->sectorno + blk_nsec(pick);
+    for (k = 0; k < NMERGED && q->mused[k]; k++)
+        ;
+    m = 0;
+    tail = pick;
+    while (pick->op != BLK_FLUSH && k < NMERGED && (r = *pp) != 0 &&
+           r->op == pick->op && r->sectorno == end &&
+           (m ? m->nseg : pick->nseg) + r->nseg <= BLKREQ_MAXSEG &&
+           blk_fits(d, m ? m : pick, r, room)) {
+        if (m == 0) {
+            m = &q->merged[k];
+            q->mused[k] = 1;
+            *m = *pick;
+            m->end = 0;
+            m->private = pick;
+        }
+        *pp = r->next;
+        r->next = 0;
+        tail->next = r;
+        tail = r;
+        for (i = 0; i < r->nseg; i++)
+            m->seg[m->nseg++] = r->seg[i];
+        end += blk_nsec(r);
+    }
+    q->last = end;
+    return m ? m : pick;
+}
+
+// Send q's queued requests to the driver while there is room,
+// unless plugged; force sends what is queued now regardless. One
+// process or interrupt at a time runs the loop, and the others
+// leave it their work; the SD card's requests complete inside it.
+static void blk_run(struct blkqueue *q, int force)
+{
+    struct blkdev *d = q->dev;
+    struct blkreq *r;
+
+    acquire(&q->lock);
+    if (force && q->queue)
+        q->force = 1;
+    if (q->running) {
+        release(&q->lock);
+        return;
+    }
+    q->running = 1;
+    while (q->queue && (q->force || !plugged) &&
+           (r = blk_next(q, d->slots - q->inflight)) != 0) {
+        q->inflight += d->cost(r);
+        release(&q->lock);
+        d->submit(r);
+        acquire(&q->lock);
+    }
+    if (q->queue == 0)
+        q->force = 0;
+    q->running = 0;
+    release(&q->lock);
+}
+
+static void blk_done(struct blkreq *r, int status)
+{
+    void (*end)(struct blkreq *) = r->end;
+
+    r->status = status;
+    acquire(&blk_lock);
+    r->done = 1;
+    if (end == 0)
+        wakeup(r);
+    release(&blk_lock);
+    if (end)
+        end(r);
+}
+
+// Queue r for its disk's driver.
+void disk_submit(struct blkreq *r)
+{
+    struct blkreq **pp;
+    struct blkdev *d;
+    struct blkqueue *q;
+
+    if (r->nseg < 0 || r->nseg > BLKREQ_MAXSEG || (r->op == BLK_FLUSH) != (r->nseg == 0))
+        panic("disk_submit");
+    if ((d = blkdev_get(r->dev)) == 0)
+        panic("disk_submit: dev");
+    r->done = 0;
+    r->status = 0;
+    r->dev = d->disk;
+    if (r->op != BLK_FLUSH) {
+        if (d->nsec != ~0U && (r->sectorno >= d->nsec ||
+                               blk_nsec(r) > d->nsec - r->sectorno)) {
+            blk_done(r, -1);
+            return;
+        }
+        r->sectorno += d->start;
+    }
+    q = blkdevs.dev[d->disk].q;
+    r->deadline = r_time() + (r->op == BLK_READ ? BLK_READ_EXPIRE : BLK_WRITE_EXPIRE);
+    acquire(&q->lock);
+    for (pp = &q->queue; *pp && (*pp)->sectorno <= r->sectorno; pp = &(*pp)->next)
+        ;
+    r->next = *pp;
+    *pp = r;
+    release(&q->lock);
+    blk_run(q, 0);
+}
+
+void disk_plug(void)
+{
+    __sync_fetch_and_add(&plugged, 1);
+}
+
+void disk_unplug(void)
+{
+    if (__sync_sub_and_fetch(&plugged, 1) < 0)
+        panic("disk_unplug");
+    for (int i = 0; i < blkdevs.ndisk; i++)
+        blk_run(&blkq[i], 0);
+}
+
+// Called by the drivers once r is finished.
+void disk_complete(struct blkreq *r, int status)
+{
+    struct blkqueue *q = blkdevs.dev[r->dev].q;
+    struct blkreq *o, *next;
+    int cost = q->dev->cost(r);
+
+    if (r >= q->merged && r < q->merged + NMERGED) {
+        for (o = r->private; o; o = next) {
+            next = o->next;
+            blk_done(o, status);
+        }
+        acquire(&q->lock);
+        q->mused[r - q->merged] = 0;
+        release(&q->lock);
+    } else {
+        blk_done(r, status);
+    }
+    acquire(&q->lock);
+    q->inflight -= cost;
+    release(&q->lock);
+    blk_run(q, 0);
+}
+
+// Wait for a request submitted without end().
+void disk_wait(struct blkreq *r)
+{
+    blk_run(blkdevs.dev[r->dev].q, 1);
+    acquire(&blk_lock);
+    while (!r->done)
+        sleep(r, &blk_lock);
+    release(&blk_lock);
+}
+
+// Wait for r, spinning on the driver for up to DISKPOLL
+// microseconds first: a synchronous request is often done sooner
+// than a sleep and a wakeup would take.
+static void blk_poll(struct blkreq *r)
 {
     #ifdef QEMU
-	virtio_disk_rw(b, 0);
-    #else 
-	sdcard_read_sector(b->data, b->sectorno);
-	#endif
+    if (DISKPOLL > 0 && !r->done) {
+        uint64 until = r_time() + (uint64)DISKPOLL * CLOCK_FREQ / 1000000;
+
+        blk_run(blkdevs.dev[r->dev].q, 1);
+        virtio_disk_polling(1);
+        while (!*(volatile int *)&r->done && r_time() < until)
+            virtio_disk_poll();
+        virtio_disk_polling(0);
+    }
+    #endif
+    disk_wait(r);
+}
+
+void disk_read(struct buf *b)
+{
+    struct blkreq r;
+
+    disk_req_buf(&r, b, BLK_READ);
+    disk_submit(&r);
+    blk_poll(&r);
+    if (r.status != 0)
+        panic("disk_read");
 }
 
 void disk_write(struct buf *b)
 {
-    #ifdef QEMU
-	virtio_disk_rw(b, 1);
-    #else 
-	sdcard_write_sector(b->data, b->sectorno);
-	#endif
+    struct blkreq r;
+
+    disk_req_buf(&r, b, BLK_WRITE);
+    disk_submit(&r);
+    blk_poll(&r);
+    if (r.status != 0)
+        panic("disk_write");
+}
+
+// Make completed writes to dev's disk (or every disk, for ANYDEV)
+// durable. The SD card has no volatile cache to flush; its
+// request completes at once.
+void disk_flush(uint dev)
+{
+    struct blkreq r;
+
+    if (dev == ANYDEV) {
+        for (int i = 0; i < blkdevs.ndisk; i++)
+            disk_flush(blkq[i].dev - blkdevs.dev);
+        return;
+    }
+    r.op = BLK_FLUSH;
+    r.dev = dev;
+    r.sectorno = 0;
+    r.nseg = 0;
+    r.end = 0;
+    disk_submit(&r);
+    blk_poll(&r);
 }
 
-void disk_intr(void)
+void disk_intr(int irq)
 {
     #ifdef QEMU
-    virtio_disk_intr();
-    #else 
+    virtio_disk_intr(irq);
+    #else
     dmac_intr(DMAC_CHANNEL0);
     #endif
 }
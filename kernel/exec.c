@@ -8,6 +8,7 @@
 #include "include/proc.h"
 #include "include/elf.h"
 #include "include/fat32.h"
+#include "include/file.h"
 #include "include/kalloc.h"
 #include "include/vm.h"
 #include "include/printf.h"
@@ -26,6 +27,9 @@ loadseg(pagetable_t pagetable, uint64 va, struct dirent *ep, uint offset, uint s
     panic("loadseg: va must be page aligned");
 
   for(i = 0; i < sz; i += PGSIZE){
+    // keep the next RA_MAX of the segment coming in behind us.
+    if(i % RA_MAX == 0)
+      ereadahead(ep, offset + i + PGSIZE, RA_MAX < sz - i ? RA_MAX : sz - i);
     pa = walkaddr(pagetable, va + i);
     if(pa == NULL)
       panic("loadseg: address should exist");
@@ -49,19 +53,21 @@ int exec(char *path, char **argv)
   struct elfhdr elf;
   struct dirent *ep;
   struct proghdr ph;
-  pagetable_t pagetable = 0, oldpagetable;
-  pagetable_t kpagetable = 0, oldkpagetable;
+  pagetable_t pagetable, kpagetable;
+  struct mm *mm;
   struct proc *p = myproc();
 
-  // Make a copy of p->kpt without old user space, 
-  // but with the same kstack we are using now, which can't be changed
-  if ((kpagetable = (pagetable_t)kalloc()) == NULL) {
+  // only the thread-group leader may replace the image; its pid
+  // is the one the parent knows.
+  if(p->pid != p->tgid)
     return -1;
-  }
-  memmove(kpagetable, p->kpagetable, PGSIZE);
-  for (int i = 0; i < PX(2, MAXUVA); i++) {
-    kpagetable[i] = 0;
-  }
+
+  // A fresh address space; mm_move() later moves the kstack
+  // we are using now into it, at the same address.
+  if((mm = mm_alloc()) == NULL)
+    return -1;
+  pagetable = mm->pagetable;
+  kpagetable = mm->kpagetable;
 
   if((ep = ename(path)) == NULL) {
     #ifdef DEBUG
@@ -76,8 +82,6 @@ int exec(char *path, char **argv)
     goto bad;
   if(elf.magic != ELF_MAGIC)
     goto bad;
-  if((pagetable = proc_pagetable(p)) == NULL)
-    goto bad;
 
   // Load program into memory.
   for(i=0, off=elf.phoff; i<elf.phnum; i++, off+=sizeof(ph)){
@@ -103,7 +107,6 @@ int exec(char *path, char **argv)
   ep = 0;
 
   p = myproc();
-  uint64 oldsz = p->sz;
 
   // Allocate two pages at the next page boundary.
   // Use the second as the user stack.
@@ -138,50 +141,39 @@ int exec(char *path, char **argv)
   if(copyout(pagetable, sp, (char *)ustack, (argc+1)*sizeof(uint64)) < 0)
     goto bad;
 
-  // arguments to user main(argc, argv)
-  // argc is returned via the system call return
-  // value, which goes in a0.
-  p->trapframe->a1 = sp;
-
   // Save program name for debugging.
   for(last=s=path; *s; s++)
     if(*s == '/')
       last = s+1;
   safestrcpy(p->name, last, sizeof(p->name));
     
-  // Commit to the user image.
-  oldpagetable = p->pagetable;
-  oldkpagetable = p->kpagetable;
-  p->pagetable = pagetable;
-  p->kpagetable = kpagetable;
-  p->sz = sz;
+  // Commit to the user image. The other threads die on their
+  // way back to user space; the old mappings (and mmaps) go
+  // away with the last of them.
+  mm->sz = sz;
+  if(mm_move(p, mm) < 0)
+    goto bad;
+  mm_put(mm);
+  kill_other_threads(p);
+  p->clear_child_tid = 0;
   p->trapframe->epc = elf.entry;  // initial program counter = main
   p->trapframe->sp = sp; // initial stack pointer
+  p->trapframe->tp = 0;  // no thread pointer until a thread library sets one
+  fp_reset(p);
 
-  for(int i = 0; i < NVMA; ++i) {
-    if(p->vma[i].valid) {
-      if(p->vma[i].vm_file) {
-        fileclose(p->vma[i].vm_file);
-        p->vma[i].vm_file = NULL;
-      }
-      p->vma[i].valid = 0;
-    }
-  }
+  // arguments to user main(argc, argv)
+  // argc is returned via the system call return
+  // value, which goes in a0.
+  p->trapframe->a1 = sp;
 
-  proc_freepagetable(oldpagetable, oldsz);
-  w_satp(MAKE_SATP(p->kpagetable));
-  sfence_vma();
-  kvmfree(oldkpagetable, 0);
   return argc; // this ends up in a0, the first argument to main(argc, argv)
 
  bad:
   #ifdef DEBUG
   printf("[exec] reach bad\n");
   #endif
-  if(pagetable)
-    proc_freepagetable(pagetable, sz);
-  if(kpagetable)
-    kvmfree(kpagetable, 0);
+  mm->sz = sz;
+  mm_put(mm);
   if(ep){
     eunlock(ep);
     eput(ep);
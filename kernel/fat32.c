@@ -4,11 +4,15 @@
 #include "include/spinlock.h"
 #include "include/sleeplock.h"
 #include "include/buf.h"
+#include "include/disk.h"
 #include "include/proc.h"
 #include "include/stat.h"
 #include "include/fat32.h"
 #include "include/string.h"
 #include "include/printf.h"
+#include "include/kalloc.h"
+#include "include/timer.h"
+#include "include/intr.h"
 
 /* fields that start with "_" are something we don't use */
 
@@ -44,10 +48,13 @@ union dentry {
 };
 
 static struct {
+    uint    dev;                /* the block device the volume is on */
     uint32  first_data_sec;
     uint32  data_sec_cnt;
     uint32  data_clus_cnt;
     uint32  byts_per_clus;
+    uint32  sec_per_blk;        /* data is cached a cluster, or a page, at a time */
+    uint32  byts_per_blk;
 
     struct {
         uint16  byts_per_sec;
@@ -58,6 +65,7 @@ static struct {
         uint32  tot_sec;            /* total count of sectors including all regions */
         uint32  fat_sz;             /* count of sectors for a FAT region */
         uint32  root_clus;
+        uint16  fs_info;            /* sector of the FSInfo structure */
     } bpb;
 
 } fat;
@@ -69,6 +77,32 @@ static struct entry_cache {
 
 static struct dirent root;
 
+static void fat_cache_init(void);
+static void clus_init(uint32 fsi_sec);
+
+/**
+ * Find the volume: the first block device, whole disk or
+ * partition, that starts with a FAT32 boot sector.
+ */
+static struct buf *find_volume(void)
+{
+    struct blkdev *d;
+    struct buf *b;
+
+    disk_probe();
+    for (uint dev = 0; (d = blkdev_get(dev)) != 0; dev++) {
+        b = bread(dev, 0);
+        if (strncmp((char const*)(b->data + 82), "FAT32", 5) == 0) {
+            printf("fat32: volume on %s\n", d->name);
+            fat.dev = dev;
+            return b;
+        }
+        brelse(b);
+    }
+    panic("not FAT32 volume");
+    return 0;
+}
+
 /**
  * Read the Boot Parameter Block.
  * @return  0       if success
@@ -79,9 +113,7 @@ int fat32_init()
     #ifdef DEBUG
     printf("[fat32_init] enter!\n");
     #endif
-    struct buf *b = bread(0, 0);
-    if (strncmp((char const*)(b->data + 82), "FAT32", 5))
-        panic("not FAT32 volume");
+    struct buf *b = find_volume();
     // fat.bpb.byts_per_sec = *(uint16 *)(b->data + 11);
     memmove(&fat.bpb.byts_per_sec, b->data + 11, 2);            // avoid misaligned load on k210
     fat.bpb.sec_per_clus = *(b->data + 13);
@@ -91,10 +123,15 @@ int fat32_init()
     fat.bpb.tot_sec = *(uint32 *)(b->data + 32);
     fat.bpb.fat_sz = *(uint32 *)(b->data + 36);
     fat.bpb.root_clus = *(uint32 *)(b->data + 44);
+    fat.bpb.fs_info = *(uint16 *)(b->data + 48);
     fat.first_data_sec = fat.bpb.rsvd_sec_cnt + fat.bpb.fat_cnt * fat.bpb.fat_sz;
     fat.data_sec_cnt = fat.bpb.tot_sec - fat.first_data_sec;
     fat.data_clus_cnt = fat.data_sec_cnt / fat.bpb.sec_per_clus;
     fat.byts_per_clus = fat.bpb.sec_per_clus * fat.bpb.byts_per_sec;
+    fat.sec_per_blk = fat.bpb.sec_per_clus;
+    if (fat.sec_per_blk > PGSIZE / BSIZE)
+        fat.sec_per_blk = PGSIZE / BSIZE;
+    fat.byts_per_blk = fat.sec_per_blk * BSIZE;
     brelse(b);
 
     #ifdef DEBUG
@@ -109,16 +146,19 @@ int fat32_init()
     // make sure that byts_per_sec has the same value with BSIZE 
     if (BSIZE != fat.bpb.byts_per_sec) 
         panic("byts_per_sec != BSIZE");
-    initlock(&ecache.lock, "ecache");
+    fat_cache_init();
+    clus_init(fat.bpb.fs_info);
+    initlock_kind(&ecache.lock, "ecache", SPIN_QUEUED);
     memset(&root, 0, sizeof(root));
     initsleeplock(&root.lock, "entry");
     root.attribute = (ATTR_DIRECTORY | ATTR_SYSTEM);
+    root.dev = fat.dev;
     root.first_clus = root.cur_clus = fat.bpb.root_clus;
     root.valid = 1;
     root.prev = &root;
     root.next = &root;
     for(struct dirent *de = ecache.entries; de < ecache.entries + ENTRY_CACHE_NUM; de++) {
-        de->dev = 0;
+        de->dev = fat.dev;
         de->valid = 0;
         de->ref = 0;
         de->dirty = 0;
@@ -159,6 +199,216 @@ static inline uint32 fat_offset_of_clus(uint32 cluster)
     return (cluster << 2) % fat.bpb.byts_per_sec;
 }
 
+/**
+ * The FAT cache: FAT #1 as an array of cluster entries, a page
+ * (FAT_PER_PAGE entries, SEC_PER_FATPAGE sectors) at a time,
+ * read in when first used and given back to kreclaimd when it
+ * has gone unused and is clean. Changes only mark the sectors
+ * dirty; kfatd, esync() and fat32_sync() copy the dirty sectors
+ * into every FAT, through the buffer cache, which writes them
+ * back in its own time.
+ *
+ * The entries are read and written under lock. A page is only
+ * read in, flushed or freed under iolock, so a page can't come
+ * or go while iolock is held. When there is no memory for a
+ * page, its entries are read and written in the buffer cache.
+ */
+#define FAT_PER_PAGE        (PGSIZE / sizeof(uint32))
+#define SEC_PER_FATPAGE     (PGSIZE / BSIZE)
+#define FATPAGE_PER_DIR     (PGSIZE / sizeof(struct fatpage))
+#define FATFLUSH_INTERVAL   (5 * CLOCK_FREQ)
+
+struct fatpage {
+    uint32  *ent;               /* the entries, or 0 if not cached */
+    uint8   dirty;              /* a bit per sector changed since the flush */
+    uint8   used;               /* used since the shrinker last looked */
+};
+
+static struct {
+    struct spinlock lock;
+    struct sleeplock iolock;
+    struct fatpage *dir[PGSIZE / sizeof(struct fatpage *)];
+    uint32  npage;              /* pages the FAT takes */
+    uint32  ndirty;             /* dirty sectors */
+    uint32  hand;               /* where the shrinker goes on from */
+    struct shrinker shrinker;
+} fatc;
+
+static inline struct fatpage *fat_slot(uint32 pg)
+{
+    return &fatc.dir[pg / FATPAGE_PER_DIR][pg % FATPAGE_PER_DIR];
+}
+
+/**
+ * Read page pg of FAT #1 into the cache. Caller holds iolock.
+ * @return  1       if success
+ *          0       if out of memory
+ */
+static int fat_load(uint32 pg)
+{
+    uint32 *ent;
+    struct buf *b;
+    uint32 sec = pg * SEC_PER_FATPAGE;
+
+    if ((ent = kalloc()) == 0)
+        return 0;
+    memset(ent, 0, PGSIZE);
+    for (int i = 0; i < SEC_PER_FATPAGE && sec + i < fat.bpb.fat_sz; i++) {
+        b = bread(fat.dev, fat.bpb.rsvd_sec_cnt + sec + i);
+        memmove((char *)ent + i * BSIZE, b->data, BSIZE);
+        brelse(b);
+    }
+    acquire(&fatc.lock);
+    fat_slot(pg)->ent = ent;
+    fat_slot(pg)->dirty = 0;
+    release(&fatc.lock);
+    return 1;
+}
+
+/**
+ * Get the entries of page pg of the FAT, reading it in if need be.
+ * @return  the entries, with fatc.lock held;
+ *          or 0, with fatc.iolock held, if there was no memory for them
+ */
+static uint32 *fat_page(uint32 pg)
+{
+    struct fatpage *p = fat_slot(pg);
+
+    for (;;) {
+        acquire(&fatc.lock);
+        if (p->ent) {
+            p->used = 1;
+            return p->ent;
+        }
+        release(&fatc.lock);
+        acquiresleep(&fatc.iolock);
+        if (p->ent == 0 && !fat_load(pg))
+            return 0;
+        releasesleep(&fatc.iolock);
+    }
+}
+
+/**
+ * Note that the entry of the cluster has changed. Caller holds fatc.lock.
+ */
+static inline void fat_dirty(uint32 cluster)
+{
+    struct fatpage *p = fat_slot(cluster / FAT_PER_PAGE);
+    uint8 bit = 1 << (cluster % FAT_PER_PAGE * sizeof(uint32) / BSIZE);
+
+    if (!(p->dirty & bit)) {
+        p->dirty |= bit;
+        fatc.ndirty++;
+    }
+}
+
+/**
+ * Write the entry of the cluster in every FAT in the buffer cache,
+ * for a page not in the FAT cache. Caller holds iolock.
+ */
+static void fat_put(uint32 cluster, uint32 content)
+{
+    struct buf *b;
+
+    for (uint8 i = 1; i <= fat.bpb.fat_cnt; i++) {
+        b = bread(fat.dev, fat_sec_of_clus(cluster, i));
+        *(uint32 *)(b->data + fat_offset_of_clus(cluster)) = content;
+        bdirty(b);
+        brelse(b);
+    }
+}
+
+/**
+ * Copy the dirty sectors of the FAT cache into every FAT in the buffer cache.
+ */
+static void fat_flush(void)
+{
+    struct fatpage *p;
+    struct buf *b;
+    uint8 dirty;
+    uint32 sec;
+
+    acquiresleep(&fatc.iolock);
+    for (uint32 pg = 0; pg < fatc.npage && fatc.ndirty; pg++) {
+        p = fat_slot(pg);
+        if ((dirty = p->dirty) == 0)
+            continue;
+        for (int i = 0; i < SEC_PER_FATPAGE; i++) {
+            if (!(dirty & (1 << i)))
+                continue;
+            sec = fat.bpb.rsvd_sec_cnt + pg * SEC_PER_FATPAGE + i;
+            for (uint8 j = 0; j < fat.bpb.fat_cnt; j++) {
+                b = bget_zero(fat.dev, sec + j * fat.bpb.fat_sz, 1);
+                acquire(&fatc.lock);
+                if (j == 0) {
+                    // later changes dirty it again
+                    p->dirty &= ~(1 << i);
+                    fatc.ndirty--;
+                }
+                memmove(b->data, (char *)p->ent + i * BSIZE, BSIZE);
+                release(&fatc.lock);
+                bdirty(b);
+                brelse(b);
+            }
+        }
+    }
+    releasesleep(&fatc.iolock);
+}
+
+/**
+ * Give back clean pages of the FAT cache that weren't used since last time.
+ */
+static uint64 fat_shrink(struct shrinker *s, uint64 want)
+{
+    struct fatpage *p;
+    uint64 n = 0;
+
+    acquiresleep(&fatc.iolock);
+    acquire(&fatc.lock);
+    for (uint32 i = 0; i < fatc.npage && n < want; i++) {
+        p = fat_slot(fatc.hand);
+        fatc.hand = (fatc.hand + 1) % fatc.npage;
+        if (p->ent == 0 || p->dirty)
+            continue;
+        if (p->used) {
+            p->used = 0;
+            continue;
+        }
+        kfree(p->ent);
+        p->ent = 0;
+        n++;
+    }
+    release(&fatc.lock);
+    releasesleep(&fatc.iolock);
+    return n;
+}
+
+static void kfatd(void *arg)
+{
+    for (;;) {
+        hrtimer_sleep_until(r_time() + FATFLUSH_INTERVAL);
+        if (fatc.ndirty)
+            fat_flush();
+    }
+}
+
+static void fat_cache_init(void)
+{
+    fatc.npage = (fat.data_clus_cnt + 2 + FAT_PER_PAGE - 1) / FAT_PER_PAGE;
+    if (fatc.npage > NELEM(fatc.dir) * FATPAGE_PER_DIR)
+        panic("fat cache: FAT too large");
+    for (uint32 i = 0; i * FATPAGE_PER_DIR < fatc.npage; i++) {
+        if ((fatc.dir[i] = kzalloc()) == 0)
+            panic("fat cache: kzalloc");
+    }
+    initlock(&fatc.lock, "fatc");
+    initsleeplock(&fatc.iolock, "fatio");
+    fatc.shrinker.shrink = fat_shrink;
+    register_shrinker(&fatc.shrinker);
+    if (kthread_create(kfatd, 0, "kfatd") == NULL)
+        panic("fat cache: kfatd");
+}
+
 /**
  * Read the FAT table content corresponded to the given cluster number.
  * @param   cluster     the number of cluster which you want to read its content in FAT table
@@ -171,11 +421,17 @@ static uint32 read_fat(uint32 cluster)
     if (cluster > fat.data_clus_cnt + 1) {     // because cluster number starts at 2, not 0
         return 0;
     }
-    uint32 fat_sec = fat_sec_of_clus(cluster, 1);
-    // here should be a cache layer for FAT table, but not implemented yet.
-    struct buf *b = bread(0, fat_sec);
-    uint32 next_clus = *(uint32 *)(b->data + fat_offset_of_clus(cluster));
+    uint32 next_clus;
+    uint32 *ent = fat_page(cluster / FAT_PER_PAGE);
+    if (ent) {
+        next_clus = ent[cluster % FAT_PER_PAGE];
+        release(&fatc.lock);
+        return next_clus;
+    }
+    struct buf *b = bread(fat.dev, fat_sec_of_clus(cluster, 1));
+    next_clus = *(uint32 *)(b->data + fat_offset_of_clus(cluster));
     brelse(b);
+    releasesleep(&fatc.iolock);
     return next_clus;
 }
 
@@ -189,53 +445,241 @@ static int write_fat(uint32 cluster, uint32 content)
     if (cluster > fat.data_clus_cnt + 1) {
         return -1;
     }
-    uint32 fat_sec = fat_sec_of_clus(cluster, 1);
-    struct buf *b = bread(0, fat_sec);
-    uint off = fat_offset_of_clus(cluster);
-    *(uint32 *)(b->data + off) = content;
-    bwrite(b);
-    brelse(b);
+    uint32 *ent = fat_page(cluster / FAT_PER_PAGE);
+    if (ent) {
+        ent[cluster % FAT_PER_PAGE] = content;
+        fat_dirty(cluster);
+        release(&fatc.lock);
+        return 0;
+    }
+    fat_put(cluster, content);
+    releasesleep(&fatc.iolock);
     return 0;
 }
 
-static void zero_clus(uint32 cluster)
+/**
+ * The cluster allocator: a bitmap of the data clusters, a bit set
+ * for each one in use, built from the FAT at mount. Each CPU keeps
+ * a few free clusters reserved, taken from the bitmap a run at a
+ * time, so that alloc_clus() mostly takes neither the allocator's
+ * lock nor another CPU's. The search for free clusters goes on from
+ * where the last one left off, starting from the FSInfo sector's
+ * next-free hint; the free count and the hint are written back to
+ * FSInfo by fat32_sync().
+ */
+#define CLUS_PER_MAP        (PGSIZE * 8)
+#define MAP_PER_DIR         (PGSIZE / sizeof(uint64 *))
+#define CLUS_POOL           8       /* clusters a CPU keeps reserved */
+
+#define FSI_LEAD_SIG        0x41615252
+#define FSI_STRUC_SIG       0x61417272
+
+static struct {
+    struct spinlock lock;
+    uint64  **dir[(NELEM(fatc.dir) * FATPAGE_PER_DIR * FAT_PER_PAGE) / (CLUS_PER_MAP * MAP_PER_DIR)];
+    uint32  nfree;              /* free clusters not in any CPU's pool */
+    uint32  next;               /* where to look for a free cluster from */
+    uint32  fsi_sec;            /* the FSInfo sector, or 0 if there is none */
+    int     fsi_dirty;
+
+    struct {
+        struct spinlock lock;
+        int     n;
+        uint32  clus[CLUS_POOL];    /* taken from the top */
+    } cpu[NCPU];
+} clus;
+
+/**
+ * The bitmap word that has the bit of the cluster.
+ */
+static inline uint64 *clus_word(uint32 cluster)
 {
-    uint32 sec = first_sec_of_clus(cluster);
-    struct buf *b;
-    for (int i = 0; i < fat.bpb.sec_per_clus; i++) {
-        b = bread(0, sec++);
-        memset(b->data, 0, BSIZE);
-        bwrite(b);
-        brelse(b);
+    uint32 pg = cluster / CLUS_PER_MAP;
+    return &clus.dir[pg / MAP_PER_DIR][pg % MAP_PER_DIR][cluster % CLUS_PER_MAP / 64];
+}
+
+/**
+ * Take a free cluster off the bitmap. Caller holds clus.lock.
+ * @return  the cluster, or 0 if there are none
+ */
+static uint32 clus_find(void)
+{
+    uint32 nword = (fat.data_clus_cnt + 2 + 63) / 64;
+    uint32 w = clus.next / 64 % nword;
+    uint64 *p;
+    int bit;
+
+    if (clus.nfree == 0)
+        return 0;
+    for (uint32 i = 0; i < nword; i++, w = (w + 1) % nword) {
+        p = clus_word(w * 64);
+        if (*p == ~0UL)
+            continue;
+        for (bit = 0; *p & (1UL << bit); bit++)
+            ;
+        *p |= 1UL << bit;
+        clus.nfree--;
+        clus.next = w * 64 + bit + 1;
+        if (clus.next >= fat.data_clus_cnt + 2)
+            clus.next = 2;      // wrap, and keep FSInfo's hint in range
+        clus.fsi_dirty = 1;
+        return w * 64 + bit;
     }
+    panic("clus_find");
 }
 
-static uint32 alloc_clus(uint8 dev)
+/**
+ * Reserve a free cluster for the caller.
+ * @return  the cluster, or 0 if the volume is full
+ */
+static uint32 clus_get(void)
 {
-    // should we keep a free cluster list? instead of searching fat every time.
-    struct buf *b;
-    uint32 sec = fat.bpb.rsvd_sec_cnt;
+    uint32 c = 0;
+    int id, i, n;
+
+    push_off();
+    id = cpuid();
+    acquire(&clus.cpu[id].lock);
+    if (clus.cpu[id].n == 0) {
+        uint32 run[CLUS_POOL];
+        acquire(&clus.lock);
+        for (n = 0; n < CLUS_POOL && (run[n] = clus_find()) != 0; n++)
+            ;
+        release(&clus.lock);
+        for (i = 0; i < n; i++)     // lowest first
+            clus.cpu[id].clus[n - 1 - i] = run[i];
+        clus.cpu[id].n = n;
+    }
+    if (clus.cpu[id].n > 0)
+        c = clus.cpu[id].clus[--clus.cpu[id].n];
+    release(&clus.cpu[id].lock);
+
+    // the last few may be in the other CPUs' pools
+    for (i = 0; i < NCPU && c == 0; i++) {
+        acquire(&clus.cpu[i].lock);
+        if (clus.cpu[i].n > 0)
+            c = clus.cpu[i].clus[--clus.cpu[i].n];
+        release(&clus.cpu[i].lock);
+    }
+    pop_off();
+    return c;
+}
+
+/**
+ * Give a cluster, already free in the FAT, back to the bitmap.
+ */
+static void clus_put(uint32 cluster)
+{
+    acquire(&clus.lock);
+    *clus_word(cluster) &= ~(1UL << (cluster % 64));
+    clus.nfree++;
+    clus.fsi_dirty = 1;
+    release(&clus.lock);
+}
+
+/**
+ * Build the bitmap from FAT #1, and read the FSInfo sector's hints.
+ * @param   fsi_sec     the FSInfo sector the boot sector names
+ */
+static void clus_init(uint32 fsi_sec)
+{
+    uint32 end = fat.data_clus_cnt + 2;
     uint32 const ent_per_sec = fat.bpb.byts_per_sec / sizeof(uint32);
-    for (uint32 i = 0; i < fat.bpb.fat_sz; i++, sec++) {
-        b = bread(dev, sec);
-        for (uint32 j = 0; j < ent_per_sec; j++) {
-            if (((uint32 *)(b->data))[j] == 0) {
-                ((uint32 *)(b->data))[j] = FAT32_EOC + 7;
-                bwrite(b);
-                brelse(b);
-                uint32 clus = i * ent_per_sec + j;
-                zero_clus(clus);
-                return clus;
+    uint32 npage = (end + CLUS_PER_MAP - 1) / CLUS_PER_MAP;
+    struct buf *b;
+
+    initlock(&clus.lock, "clus");
+    for (int i = 0; i < NCPU; i++)
+        initlock(&clus.cpu[i].lock, "clus_cpu");
+    for (uint32 pg = 0; pg < npage; pg++) {
+        if (pg % MAP_PER_DIR == 0 && (clus.dir[pg / MAP_PER_DIR] = kzalloc()) == 0)
+            panic("clus_init: kzalloc");
+        // clusters past the end stay in use
+        if ((clus.dir[pg / MAP_PER_DIR][pg % MAP_PER_DIR] = kalloc()) == 0)
+            panic("clus_init: kalloc");
+        memset(clus.dir[pg / MAP_PER_DIR][pg % MAP_PER_DIR], 0xff, PGSIZE);
+    }
+    for (uint32 i = 0; i * ent_per_sec < end; i++) {
+        b = bread(fat.dev, fat.bpb.rsvd_sec_cnt + i);
+        for (uint32 j = 0, c = i * ent_per_sec; j < ent_per_sec && c < end; j++, c++) {
+            if (c >= 2 && ((uint32 *)b->data)[j] == 0) {
+                *clus_word(c) &= ~(1UL << (c % 64));
+                clus.nfree++;
             }
         }
         brelse(b);
     }
-    panic("no clusters");
+
+    clus.next = 2;
+    if (fsi_sec == 0 || fsi_sec == 0xffff)
+        return;
+    b = bread(fat.dev, fsi_sec);
+    if (*(uint32 *)b->data == FSI_LEAD_SIG && *(uint32 *)(b->data + 484) == FSI_STRUC_SIG) {
+        uint32 free_count = *(uint32 *)(b->data + 488);
+        uint32 nxt_free = *(uint32 *)(b->data + 492);
+        clus.fsi_sec = fsi_sec;
+        if (nxt_free >= 2 && nxt_free < end)
+            clus.next = nxt_free;
+        // the count is only a hint; the FAT says otherwise
+        if (free_count != clus.nfree)
+            clus.fsi_dirty = 1;
+    }
+    brelse(b);
+}
+
+/**
+ * Write the changes to the FAT back to the buffer cache, for bsync()
+ * or bflush() to take to the disk, with the free count in FSInfo.
+ */
+void fat32_sync(void)
+{
+    uint32 free_count, nxt_free;
+    struct buf *b;
+
+    if (fatc.ndirty)
+        fat_flush();
+    if (clus.fsi_sec == 0 || !clus.fsi_dirty)
+        return;
+    acquire(&clus.lock);
+    clus.fsi_dirty = 0;
+    free_count = clus.nfree;
+    nxt_free = clus.next;
+    release(&clus.lock);
+    // reserved clusters are still free in the FAT
+    for (int i = 0; i < NCPU; i++)
+        free_count += clus.cpu[i].n;
+    b = bread(fat.dev, clus.fsi_sec);
+    *(uint32 *)(b->data + 488) = free_count;
+    *(uint32 *)(b->data + 492) = nxt_free;
+    bdirty(b);
+    brelse(b);
+}
+
+static void zero_clus(uint32 cluster)
+{
+    uint32 sec = first_sec_of_clus(cluster);
+    struct buf *b;
+    for (int i = 0; i < fat.bpb.sec_per_clus; i += fat.sec_per_blk) {
+        b = bget_zero(fat.dev, sec + i, fat.sec_per_blk);
+        bdirty(b);
+        brelse(b);
+    }
+}
+
+static uint32 alloc_clus(uint8 dev)
+{
+    uint32 clus = clus_get();
+    if (clus == 0)
+        panic("no clusters");
+    write_fat(clus, FAT32_EOC + 7);
+    zero_clus(clus);
+    return clus;
 }
 
 static void free_clus(uint32 cluster)
 {
     write_fat(cluster, 0);
+    clus_put(cluster);
 }
 
 static uint rw_clus(uint32 cluster, int write, int user, uint64 data, uint off, uint n)
@@ -244,22 +688,22 @@ static uint rw_clus(uint32 cluster, int write, int user, uint64 data, uint off,
         panic("offset out of range");
     uint tot, m;
     struct buf *bp;
-    uint sec = first_sec_of_clus(cluster) + off / fat.bpb.byts_per_sec;
-    off = off % fat.bpb.byts_per_sec;
+    uint sec = first_sec_of_clus(cluster) + off / fat.byts_per_blk * fat.sec_per_blk;
+    off = off % fat.byts_per_blk;
 
     int bad = 0;
-    for (tot = 0; tot < n; tot += m, off += m, data += m, sec++) {
-        bp = bread(0, sec);
-        m = BSIZE - off % BSIZE;
+    for (tot = 0; tot < n; tot += m, off += m, data += m, sec += fat.sec_per_blk) {
+        bp = bread_blk(fat.dev, sec, fat.sec_per_blk);
+        m = fat.byts_per_blk - off % fat.byts_per_blk;
         if (n - tot < m) {
             m = n - tot;
         }
         if (write) {
-            if ((bad = either_copyin(bp->data + (off % BSIZE), user, data, m)) != -1) {
-                bwrite(bp);
+            if ((bad = either_copyin(bp->data + (off % fat.byts_per_blk), user, data, m)) != -1) {
+                bdirty(bp);
             }
         } else {
-            bad = either_copyout(user, data, bp->data + (off % BSIZE), m);
+            bad = either_copyout(user, data, bp->data + (off % fat.byts_per_blk), m);
         }
         brelse(bp);
         if (bad == -1) {
@@ -333,6 +777,39 @@ int eread(struct dirent *entry, int user_dst, uint64 dst, uint off, uint n)
     return tot;
 }
 
+/**
+ * Queue the clusters of the file covering [off, off+n) to be read
+ * into the buffer cache in the background. The chain is walked
+ * from entry->cur_clus without moving it, so that the reader
+ * following behind doesn't have to walk it again.
+ * Caller must hold entry->lock.
+ */
+void ereadahead(struct dirent *entry, uint off, uint n)
+{
+    if (off >= entry->file_size || n == 0) {
+        return;
+    }
+    if (n > entry->file_size - off) {
+        n = entry->file_size - off;
+    }
+    uint first = off / fat.byts_per_clus, last = (off + n - 1) / fat.byts_per_clus;
+    uint32 clus = entry->cur_clus;
+    uint cnt = entry->clus_cnt;
+    if (first < cnt) {
+        clus = entry->first_clus;
+        cnt = 0;
+    }
+    for (; cnt < first && clus >= 2 && clus < FAT32_EOC; cnt++) {
+        clus = read_fat(clus);
+    }
+    for (; cnt <= last && clus >= 2 && clus < FAT32_EOC; cnt++, clus = read_fat(clus)) {
+        uint32 sec = first_sec_of_clus(clus);
+        for (int i = 0; i < fat.bpb.sec_per_clus; i += fat.sec_per_blk) {
+            breadahead(fat.dev, sec + i, fat.sec_per_blk);
+        }
+    }
+}
+
 // Caller must hold entry->lock.
 int ewrite(struct dirent *entry, int user_src, uint64 src, uint off, uint n)
 {
@@ -615,6 +1092,34 @@ void eupdate(struct dirent *entry)
     entry->dirty = 0;
 }
 
+/**
+ * Write the cached blocks of a file back to the disk: its data
+ * clusters, the FAT, and the directory holding its entry. With
+ * datasync the directory is only written if the file's size or
+ * first cluster changed.
+ * Caller must hold entry->lock, but not entry->parent->lock.
+ */
+void esync(struct dirent *entry, int datasync)
+{
+    uint32 clus;
+
+    for (clus = entry->first_clus; clus >= 2 && clus < FAT32_EOC; clus = read_fat(clus)) {
+        bflush(entry->dev, first_sec_of_clus(clus), fat.bpb.sec_per_clus);
+    }
+    fat32_sync();
+    bflush(entry->dev, fat_sec_of_clus(0, 1), fat.bpb.fat_sz * fat.bpb.fat_cnt);
+    if (entry != &root && entry->valid == 1 && (entry->dirty || !datasync)) {
+        struct dirent *dp = entry->parent;
+        elock(dp);
+        eupdate(entry);
+        for (clus = dp->first_clus; clus >= 2 && clus < FAT32_EOC; clus = read_fat(clus)) {
+            bflush(dp->dev, first_sec_of_clus(clus), fat.bpb.sec_per_clus);
+        }
+        eunlock(dp);
+    }
+    disk_flush(entry->dev);
+}
+
 // caller must hold entry->lock
 // caller must hold entry->parent->lock
 // remove the entry in its parent directory
@@ -9,6 +9,7 @@
 #include "include/spinlock.h"
 #include "include/sleeplock.h"
 #include "include/fat32.h"
+#include "include/tmpfs.h"
 #include "include/file.h"
 #include "include/pipe.h"
 #include "include/stat.h"
@@ -16,6 +17,7 @@
 #include "include/printf.h"
 #include "include/string.h"
 #include "include/vm.h"
+#include "include/kalloc.h"
 
 struct devsw devsw[NDEV];
 struct {
@@ -23,6 +25,12 @@ struct {
   struct file file[NFILE];
 } ftable;
 
+// fdtables.lock protects the ref count of every fdtable.
+struct {
+  struct spinlock lock;
+  struct kmem_cache cache;
+} fdtables;
+
 void
 fileinit(void)
 {
@@ -31,6 +39,8 @@ fileinit(void)
   for(f = ftable.file; f < ftable.file + NFILE; f++){
     memset(f, 0, sizeof(struct file));
   }
+  initlock(&fdtables.lock, "fdtables");
+  kmem_cache_init(&fdtables.cache, "fdtable", sizeof(struct fdtable));
   #ifdef DEBUG
   printf("fileinit\n");
   #endif
@@ -53,6 +63,7 @@ filealloc(void)
   for(f = ftable.file; f < ftable.file + NFILE; f++){
     if(f->ref == 0){
       f->ref = 1;
+      f->ra_next = f->ra_win = f->ra_end = 0;
       release(&ftable.lock);
       return f;
     }
@@ -97,6 +108,8 @@ fileclose(struct file *f)
     pipeclose(ff.pipe, ff.writable);
   } else if(ff.type == FD_ENTRY){
     eput(ff.ep);
+  } else if(ff.type == FD_TMPFS){
+    tput(ff.tn);
   } else if (ff.type == FD_DEVICE) {
 
   }
@@ -119,9 +132,44 @@ filestat(struct file *f, uint64 addr)
       return -1;
     return 0;
   }
+  if(f->type == FD_TMPFS){
+    tstat(f->tn, &st);
+    if(copyout2(addr, (char *)&st, sizeof(st)) < 0)
+      return -1;
+    return 0;
+  }
   return -1;
 }
 
+// Note a read of [off, off+n) from f. A read that starts where
+// the last one ended is sequential: the window grows, from RA_MIN
+// and doubling up to RA_MAX, and the part of it beyond the read
+// that isn't queued yet is read ahead. A seek closes the window.
+// Caller must hold f->ep->lock.
+void
+filereadahead(struct file *f, uint off, uint n)
+{
+  uint start, end;
+
+  if(off != f->ra_next){
+    f->ra_win = 0;
+    f->ra_end = 0;
+  } else if(f->ra_win == 0)
+    f->ra_win = RA_MIN;
+  else if(f->ra_win < RA_MAX)
+    f->ra_win *= 2;
+  f->ra_next = off + n;
+  if(f->ra_win == 0)
+    return;
+
+  start = off + n > f->ra_end ? off + n : f->ra_end;
+  end = off + n + f->ra_win;
+  if(start < end){
+    ereadahead(f->ep, start, end - start);
+    f->ra_end = end;
+  }
+}
+
 // Read from file f.
 // addr is a user virtual address.
 int
@@ -145,10 +193,18 @@ fileread(struct file *f, uint64 addr, int n)
         break;
     case FD_ENTRY:
         elock(f->ep);
-          if((r = eread(f->ep, 1, addr, f->off, n)) > 0)
+          if((r = eread(f->ep, 1, addr, f->off, n)) > 0){
+            filereadahead(f, f->off, r);
             f->off += r;
+          }
         eunlock(f->ep);
         break;
+    case FD_TMPFS:
+        tlock(f->tn);
+        if((r = tread(f->tn, 1, addr, f->off, n)) > 0)
+          f->off += r;
+        tunlock(f->tn);
+        break;
     default:
       panic("fileread");
   }
@@ -182,6 +238,15 @@ filewrite(struct file *f, uint64 addr, int n)
       ret = -1;
     }
     eunlock(f->ep);
+  } else if(f->type == FD_TMPFS){
+    tlock(f->tn);
+    if(twrite(f->tn, 1, addr, f->off, n) == n){
+      ret = n;
+      f->off += n;
+    } else {
+      ret = -1;
+    }
+    tunlock(f->tn);
   } else {
     panic("filewrite");
   }
@@ -195,12 +260,22 @@ int
 dirnext(struct file *f, uint64 addr)
 {
   // struct proc *p = myproc();
+  struct dirent de;
+  struct stat st;
 
-  if(f->readable == 0 || !(f->ep->attribute & ATTR_DIRECTORY))
+  if(f->type == FD_TMPFS){
+    if(f->readable == 0 || f->tn->type != T_DIR)
+      return -1;
+    if(!tnext(f->tn, f->off, &st))
+      return 0;
+    f->off++;
+    if(copyout2(addr, (char *)&st, sizeof(st)) < 0)
+      return -1;
+    return 1;
+  }
+  if(f->type != FD_ENTRY || f->readable == 0 || !(f->ep->attribute & ATTR_DIRECTORY))
     return -1;
 
-  struct dirent de;
-  struct stat st;
   int count = 0;
   int ret;
   elock(f->ep);
@@ -218,4 +293,83 @@ dirnext(struct file *f, uint64 addr)
     return -1;
 
   return 1;
-}
\ No newline at end of file
+}
+
+// Allocate an empty open-file table, with one reference.
+struct fdtable*
+fdtable_alloc(void)
+{
+  struct fdtable *t;
+
+  if((t = kmem_cache_alloc(&fdtables.cache)) == NULL)
+    return NULL;
+  initlock(&t->lock, "fdtable");
+  t->ref = 1;
+  memset(t->ofile, 0, sizeof(t->ofile));
+  return t;
+}
+
+// Copy a table for fork(), taking a reference on every open file.
+struct fdtable*
+fdtable_dup(struct fdtable *old)
+{
+  struct fdtable *t;
+
+  if((t = fdtable_alloc()) == NULL)
+    return NULL;
+  acquire(&old->lock);
+  for(int fd = 0; fd < NOFILE; fd++)
+    if(old->ofile[fd])
+      t->ofile[fd] = filedup(old->ofile[fd]);
+  release(&old->lock);
+  return t;
+}
+
+struct fdtable*
+fdtable_get(struct fdtable *t)
+{
+  acquire(&fdtables.lock);
+  t->ref++;
+  release(&fdtables.lock);
+  return t;
+}
+
+// Drop a reference; the last one closes all files.
+void
+fdtable_put(struct fdtable *t)
+{
+  acquire(&fdtables.lock);
+  if(t->ref > 1){
+    t->ref--;
+    release(&fdtables.lock);
+    return;
+  }
+  release(&fdtables.lock);
+
+  for(int fd = 0; fd < NOFILE; fd++){
+    if(t->ofile[fd]){
+      fileclose(t->ofile[fd]);
+      t->ofile[fd] = 0;
+    }
+  }
+  kmem_cache_free(&fdtables.cache, t);
+}
+
+// The open file at fd in the current process's table, with a
+// reference of the caller's own, so that a thread sharing the
+// table can't close it away in the meantime; fileclose() it when
+// done. 0 if fd isn't open.
+struct file*
+fget(int fd)
+{
+  struct fdtable *t = myproc()->files;
+  struct file *f = NULL;
+
+  if(fd < 0 || fd >= NOFILE)
+    return NULL;
+  acquire(&t->lock);
+  if(t->ofile[fd])
+    f = filedup(t->ofile[fd]);
+  release(&t->lock);
+  return f;
+}
@@ -0,0 +1,284 @@
+// Fast user-space locking: a thread blocks on a user memory word
+// until another one wakes it.
+//
+// Waiters are hashed by the physical address of the word, so
+// every thread or process that maps the page finds the same
+// queue. A waiter lives on the waiting thread's kernel stack; it
+// sleeps on itself, and FUTEX_REQUEUE may move it to another
+// bucket while it sleeps.
+
+#include "include/types.h"
+#include "include/param.h"
+#include "include/memlayout.h"
+#include "include/riscv.h"
+#include "include/spinlock.h"
+#include "include/sleeplock.h"
+#include "include/proc.h"
+#include "include/vm.h"
+#include "include/timer.h"
+#include "include/futex.h"
+
+#define FUTEX_HASH_SIZE 64
+
+struct futex_bucket {
+  struct spinlock lock;
+  struct futex_waiter *head;
+};
+
+struct futex_waiter {
+  uint64 key;                   // physical address of the word
+  struct futex_bucket *hb;      // bucket it is queued on
+  struct futex_waiter *next;
+  int woken;
+  int timedout;
+};
+
+static struct futex_bucket futex_hash[FUTEX_HASH_SIZE];
+
+void
+futexinit(void)
+{
+  for(int i = 0; i < FUTEX_HASH_SIZE; i++){
+    initlock(&futex_hash[i].lock, "futex");
+    futex_hash[i].head = NULL;
+  }
+}
+
+static struct futex_bucket*
+hash_bucket(uint64 key)
+{
+  return &futex_hash[(key >> 2) % FUTEX_HASH_SIZE];
+}
+
+// Translate the user address of a futex word to its physical
+// address. mm->lock must be held, so the page cannot go away.
+// Returns 0 if uaddr is misaligned or not mapped.
+static uint64
+futex_key(struct mm *mm, uint64 uaddr)
+{
+  uint64 pa;
+
+  if(uaddr % sizeof(int) != 0)
+    return 0;
+  if((pa = walkaddr(mm->pagetable, PGROUNDDOWN(uaddr))) == 0)
+    return 0;
+  return pa + (uaddr - PGROUNDDOWN(uaddr));
+}
+
+static void
+unqueue(struct futex_waiter *w)
+{
+  struct futex_waiter **pp;
+
+  for(pp = &w->hb->head; *pp; pp = &(*pp)->next){
+    if(*pp == w){
+      *pp = w->next;
+      return;
+    }
+  }
+}
+
+// Lock the bucket w is queued on. FUTEX_REQUEUE moves waiters
+// only with both buckets locked, so once we hold the bucket that
+// w->hb names, w stays there.
+static struct futex_bucket*
+lock_waiter_bucket(struct futex_waiter *w)
+{
+  struct futex_bucket *hb;
+
+  for(;;){
+    hb = *(struct futex_bucket * volatile *)&w->hb;
+    acquire(&hb->lock);
+    if(hb == w->hb)
+      return hb;
+    release(&hb->lock);
+  }
+}
+
+static void
+futex_timeout(struct hrtimer *t)
+{
+  struct futex_waiter *w = t->arg;
+  struct futex_bucket *hb = lock_waiter_bucket(w);
+
+  w->timedout = 1;
+  wakeup(w);
+  release(&hb->lock);
+}
+
+// Sleep while the word at uaddr holds val, until futex_wake()
+// or, if timeout is non-zero, until the struct timespec it
+// points to has elapsed.
+// Returns 0 when woken, -1 if the word differed, the address
+// was bad, the timeout expired or the thread was killed.
+int
+futex_wait(uint64 uaddr, int val, uint64 timeout)
+{
+  struct proc *p = myproc();
+  struct mm *mm = p->mm;
+  struct futex_waiter w;
+  struct futex_bucket *hb;
+  struct hrtimer timer;
+  struct timespec ts;
+  int ret;
+
+  if(timeout && copyin2((char *)&ts, timeout, sizeof(ts)) < 0)
+    return -1;
+
+  w.woken = 0;
+  w.timedout = 0;
+  w.next = NULL;
+
+  acquiresleep(&mm->lock);
+  if((w.key = futex_key(mm, uaddr)) == 0){
+    releasesleep(&mm->lock);
+    return -1;
+  }
+  hb = w.hb = hash_bucket(w.key);
+  acquire(&hb->lock);
+  // the bucket lock orders this check against futex_wake():
+  // a waker changes the word before taking the lock.
+  if(*(volatile int *)w.key != val){
+    release(&hb->lock);
+    releasesleep(&mm->lock);
+    return -1;
+  }
+  w.next = hb->head;
+  hb->head = &w;
+  release(&hb->lock);
+  releasesleep(&mm->lock);
+
+  // the timer callback takes the bucket lock, so arm it unlocked.
+  if(timeout){
+    hrtimer_init(&timer, futex_timeout, &w);
+    if(hrtimer_start(&timer, r_time() + ts.sec * CLOCK_FREQ +
+                     ts.usec * CLOCK_FREQ / 1000000) < 0)
+      w.timedout = 1;
+  }
+
+  hb = lock_waiter_bucket(&w);
+  while(!w.woken && !w.timedout && !p->killed){
+    sleep(&w, &hb->lock);
+    if(hb != w.hb){
+      release(&hb->lock);
+      hb = lock_waiter_bucket(&w);
+    }
+  }
+  ret = w.woken ? 0 : -1;
+  if(!w.woken)
+    unqueue(&w);
+  release(&hb->lock);
+
+  // waits for a running callback, which still uses w.
+  if(timeout)
+    hrtimer_cancel(&timer);
+  return ret;
+}
+
+// Wake at most nr waiters of one key in hb; hb->lock is held.
+static int
+wake_key(struct futex_bucket *hb, uint64 key, int nr)
+{
+  struct futex_waiter **pp, *w;
+  int n = 0;
+
+  for(pp = &hb->head; *pp && n < nr; ){
+    w = *pp;
+    if(w->key != key){
+      pp = &w->next;
+      continue;
+    }
+    *pp = w->next;
+    w->woken = 1;
+    wakeup(w);
+    n++;
+  }
+  return n;
+}
+
+// Wake at most nr threads waiting on uaddr.
+// Returns the number woken, or -1 for a bad address.
+int
+futex_wake(uint64 uaddr, int nr)
+{
+  struct mm *mm = myproc()->mm;
+  struct futex_bucket *hb;
+  uint64 key;
+  int n;
+
+  acquiresleep(&mm->lock);
+  key = futex_key(mm, uaddr);
+  releasesleep(&mm->lock);
+  if(key == 0)
+    return -1;
+
+  hb = hash_bucket(key);
+  acquire(&hb->lock);
+  n = wake_key(hb, key, nr);
+  release(&hb->lock);
+  return n;
+}
+
+// Wake at most nr_wake waiters of uaddr and move up to nr_requeue
+// of the rest to wait on uaddr2, without waking them. With cmp,
+// first check that the word at uaddr still holds val.
+// Returns the number woken plus requeued, or -1.
+int
+futex_requeue(uint64 uaddr, int nr_wake, int nr_requeue, uint64 uaddr2, int cmp, int val)
+{
+  struct mm *mm = myproc()->mm;
+  struct futex_bucket *hb1, *hb2;
+  struct futex_waiter **pp, *w;
+  uint64 key1, key2;
+  int n;
+
+  acquiresleep(&mm->lock);
+  key1 = futex_key(mm, uaddr);
+  key2 = futex_key(mm, uaddr2);
+  if(key1 == 0 || key2 == 0){
+    releasesleep(&mm->lock);
+    return -1;
+  }
+  hb1 = hash_bucket(key1);
+  hb2 = hash_bucket(key2);
+  // lock both buckets in address order.
+  if(hb1 < hb2){
+    acquire(&hb1->lock);
+    acquire(&hb2->lock);
+  } else {
+    acquire(&hb2->lock);
+    if(hb1 != hb2)
+      acquire(&hb1->lock);
+  }
+  if(cmp && *(volatile int *)key1 != val){
+    n = -1;
+    goto out;
+  }
+
+  n = wake_key(hb1, key1, nr_wake);
+  for(pp = &hb1->head; *pp && nr_requeue > 0; ){
+    w = *pp;
+    if(w->key != key1){
+      pp = &w->next;
+      continue;
+    }
+    w->key = key2;
+    if(hb1 != hb2){
+      *pp = w->next;
+      w->next = hb2->head;
+      hb2->head = w;
+      w->hb = hb2;
+    } else {
+      pp = &w->next;
+    }
+    nr_requeue--;
+    n++;
+  }
+
+out:
+  if(hb1 != hb2)
+    release(&hb1->lock);
+  release(&hb2->lock);
+  releasesleep(&mm->lock);
+  return n;
+}
@@ -7,19 +7,34 @@
 
 struct buf {
   int valid;
-  int disk;		// does disk "own" buf? 
+  int dirty;		// changed since last written; holds a reference
+  uint64 dirtied;	// r_time() when it became dirty
   uint dev;
   uint sectorno;	// sector number 
+  uint nsec;		// sectors held, at most a page's worth
   struct sleeplock lock;
   uint refcnt;
   struct buf *prev;
   struct buf *next;
-  uchar data[BSIZE];
+  struct buf *link;	// on the list of all buffers
+  uchar *data;		// nsec * BSIZE bytes
 };
 
+struct bcachestat;
+
 void            binit(void);
 struct buf*     bread(uint, uint);
+struct buf*     bread_blk(uint, uint, uint);
+struct buf*     bget_zero(uint, uint, uint);
 void            brelse(struct buf*);
 void            bwrite(struct buf*);
+void            bdirty(struct buf*);
+void            bpin(struct buf*);
+void            bunpin(struct buf*);
+void            bflush(uint, uint, uint);
+void            bsync(void);
+void            breadahead(uint, uint, uint);
+void            bio_daemons_init(void);
+void            bcache_stat(struct bcachestat*);
 
 #endif
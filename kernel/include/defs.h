@@ -28,13 +28,13 @@ void            consputc(int);
 // timer.c
 void timerinit();
 void set_next_timeout();
-void timer_tick();
+int timer_tick();
 
 // disk.c
 void            disk_init(void);
 void            disk_read(struct buf *b);
 void            disk_write(struct buf *b);
-void            disk_intr(void);
+void            disk_intr(int irq);
 
 // exec.c
 int             exec(char*, char**);
@@ -214,8 +214,9 @@ int             copyinstr(pagetable_t, char *, uint64, uint64);
 
 // virtio_disk.c
 void            virtio_disk_init(void);
-void            virtio_disk_rw(struct buf *b, int write);
-void            virtio_disk_intr(void);
+void            virtio_disk_intr(int irq);
+int             virtio_disk_poll(void);
+void            virtio_disk_polling(int on);
 
 // plic.c
 void            plicinit(void);
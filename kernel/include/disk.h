@@ -3,9 +3,92 @@
 
 #include "buf.h"
 
+#define BLK_READ    0
+#define BLK_WRITE   1
+#define BLK_FLUSH   2   // make completed writes durable
+
+#define BLKREQ_MAXSEG 8
+
+// An asynchronous disk request: nseg memory segments, read from
+// or written to consecutive sectors from sectorno on. Submit it
+// with disk_submit(), then either disk_wait() for it or let end()
+// hear of its completion. end() runs in interrupt context, or in
+// a process polling the driver, with no driver lock held; once
+// it is called (or disk_wait() returns), the request belongs to
+// its owner again.
+//
+// Submitted requests are moved to the whole disk's device and
+// sectors, and wait in the disk's queue, sorted by sector; they
+// go to the driver in elevator order, or oldest first once one
+// has waited past its deadline; runs of contiguous requests go
+// as one. Between disk_plug() and disk_unplug() requests are only
+// queued, so that a batch can be merged and sorted as a whole;
+// disk_wait() unplugs, so as not to wait forever.
+struct blkreq {
+  int op;                     // BLK_READ, BLK_WRITE or BLK_FLUSH
+  uint dev;
+  uint sectorno;
+  int nseg;
+  struct {
+    uchar *addr;              // direct-mapped kernel memory
+    uint len;                 // a multiple of BSIZE
+  } seg[BLKREQ_MAXSEG];
+  void (*end)(struct blkreq *r);
+  void *private;              // for end()
+  int status;                 // 0, or -1 on an I/O error
+  int done;
+  uint64 deadline;            // r_time() to be sent to the driver by
+  struct blkreq *next;        // on the queue, then for whoever holds it
+};
+
+// Block devices: whole disks, as their drivers register them,
+// and the partitions found on them. A device's number is its
+// index in the table; blkreq.dev, buf.dev and dirent.dev are
+// such numbers, so each device has its own sectors in the buffer
+// cache. Sectors are numbered from the start of the device.
+#define NDISK         4     // whole disks
+#define NBLKDEV       16    // disks and partitions
+#define ANYDEV        (~0U)
+
+struct blkqueue;
+
+struct blkdev {
+  char name[8];               // "vda", "vda1", "sd0"
+  int disk;                   // the whole disk's number
+  uint start;                 // first sector on the whole disk
+  uint nsec;                  // size in sectors, ~0 if unknown
+  // a whole disk's driver:
+  void (*submit)(struct blkreq *r);   // start r, on sectors of the disk
+  int (*cost)(struct blkreq *r);      // slots r takes in flight
+  int slots;                          // how many there are
+  void *private;
+  struct blkqueue *q;                 // its request queue
+};
+
+int disk_register(char *name, uint nsec, void (*submit)(struct blkreq *),
+                  int (*cost)(struct blkreq *), int slots, void *private);
+int blkdev_add(char *name, uint disk, uint start, uint nsec);
+struct blkdev *blkdev_get(uint dev);
+int blkdev_find(char *name);
+void disk_probe(void);
+
 void disk_init(void);
 void disk_read(struct buf *b);
 void disk_write(struct buf *b);
-void disk_intr(void);
+void disk_flush(uint dev);
+void disk_intr(int irq);
+
+void disk_req_buf(struct blkreq *r, struct buf *b, int op);
+void disk_submit(struct blkreq *r);
+void disk_wait(struct blkreq *r);
+void disk_plug(void);
+void disk_unplug(void);
+void disk_complete(struct blkreq *r, int status);
+
+// part.c
+void part_scan(uint disk);
+
+// ramdisk.c
+int ramdisk_register(char *name, uchar *mem, uint nsec);
 
 #endif
@@ -51,12 +51,14 @@ struct dirent {
 };
 
 int             fat32_init(void);
+void            fat32_sync(void);
 struct dirent*  dirlookup(struct dirent *entry, char *filename, uint *poff);
 char*           formatname(char *name);
 void            emake(struct dirent *dp, struct dirent *ep, uint off);
 struct dirent*  ealloc(struct dirent *dp, char *name, int attr);
 struct dirent*  edup(struct dirent *entry);
 void            eupdate(struct dirent *entry);
+void            esync(struct dirent *entry, int datasync);
 void            etrunc(struct dirent *entry);
 void            eremove(struct dirent *entry);
 void            eput(struct dirent *entry);
@@ -67,6 +69,7 @@ int             enext(struct dirent *dp, struct dirent *ep, uint off, int *count
 struct dirent*  ename(char *path);
 struct dirent*  enameparent(char *path, char *name);
 int             eread(struct dirent *entry, int user_dst, uint64 dst, uint off, uint n);
+void            ereadahead(struct dirent *entry, uint off, uint n);
 int             ewrite(struct dirent *entry, int user_src, uint64 src, uint off, uint n);
 
 #endif
\ No newline at end of file
@@ -1,15 +1,33 @@
 #ifndef __FILE_H
 #define __FILE_H
 
+#include "param.h"
+#include "spinlock.h"
+
 struct file {
-  enum { FD_NONE, FD_PIPE, FD_ENTRY, FD_DEVICE } type;
+  enum { FD_NONE, FD_PIPE, FD_ENTRY, FD_DEVICE, FD_TMPFS } type;
   int ref; // reference count
   char readable;
   char writable;
   struct pipe *pipe; // FD_PIPE
   struct dirent *ep;
-  uint off;          // FD_ENTRY
+  struct tnode *tn;  // FD_TMPFS
+  uint off;          // FD_ENTRY, FD_TMPFS
   short major;       // FD_DEVICE
+  uint ra_next;      // FD_ENTRY readahead: where a sequential read starts,
+  uint ra_win;       //   the window, in bytes,
+  uint ra_end;       //   and how far has been queued already
+};
+
+// Readahead windows of sequential readers, in bytes.
+#define RA_MIN  (8 * 1024)
+#define RA_MAX  (64 * 1024)
+
+// Open-file table of a process, shared by CLONE_FILES threads.
+struct fdtable {
+  struct spinlock lock;        // protects ofile[] slots
+  int ref;                     // procs using this table, under fdtables.lock
+  struct file *ofile[NOFILE];  // Open files
 };
 
 // #define major(dev)  ((dev) >> 16 & 0xFFFF)
@@ -31,8 +49,14 @@ void            fileclose(struct file*);
 struct file*    filedup(struct file*);
 void            fileinit(void);
 int             fileread(struct file*, uint64, int n);
+void            filereadahead(struct file*, uint off, uint n);
 int             filestat(struct file*, uint64 addr);
 int             filewrite(struct file*, uint64, int n);
 int             dirnext(struct file *f, uint64 addr);
+struct fdtable* fdtable_alloc(void);
+struct fdtable* fdtable_dup(struct fdtable*);
+struct fdtable* fdtable_get(struct fdtable*);
+void            fdtable_put(struct fdtable*);
+struct file*    fget(int fd);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,23 @@
+#ifndef __FUTEX_H
+#define __FUTEX_H
+
+#include "types.h"
+
+// futex(2) operations, as in Linux.
+#define FUTEX_WAIT            0
+#define FUTEX_WAKE            1
+#define FUTEX_REQUEUE         3
+#define FUTEX_CMP_REQUEUE     4
+
+// Accepted and ignored: every futex is keyed by physical address,
+// and timeouts are always relative.
+#define FUTEX_PRIVATE_FLAG    128
+#define FUTEX_CLOCK_REALTIME  256
+#define FUTEX_CMD_MASK        (~(FUTEX_PRIVATE_FLAG | FUTEX_CLOCK_REALTIME))
+
+void futexinit(void);
+int futex_wait(uint64 uaddr, int val, uint64 timeout);
+int futex_wake(uint64 uaddr, int nr);
+int futex_requeue(uint64 uaddr, int nr_wake, int nr_requeue, uint64 uaddr2, int cmp, int val);
+
+#endif
@@ -2,10 +2,64 @@
 #define __KALLOC_H
 
 #include "types.h"
+#include "param.h"
+#include "spinlock.h"
 
 void*           kalloc(void);
+void*           kzalloc(void);
 void            kfree(void *);
 void            kinit(void);
+void            kmem_daemons_init(void);
 uint64          freemem_amount(void);
+int             kmem_plenty(void);
+
+// Something that can give pages back to kalloc() when memory
+// runs low. shrink() returns how many of the wanted pages it
+// freed; it runs in kreclaimd, so it may sleep.
+struct shrinker {
+  uint64 (*shrink)(struct shrinker *s, uint64 want);
+  struct shrinker *next;
+};
+
+void            register_shrinker(struct shrinker *s);
+
+// Per-CPU stacks of ready-made pages of one kind (trapframes,
+// kernel stacks, page-table skeletons), so that fork/exit churn
+// skips kalloc() and whatever set-up the page needs. A page only
+// leaves for good through release(), when a hart's stack is full
+// or kreclaimd shrinks the cache.
+#define PCACHE_SIZE 4
+
+struct pcache {
+  struct shrinker shrinker;     // first: shrink() casts back
+  char *name;
+  void (*release)(void *page);
+  struct {
+    struct spinlock lock;       // only contended by the shrinker
+    int n;
+    void *page[PCACHE_SIZE];
+  } cpu[NCPU];
+};
+
+void            pcache_init(struct pcache *c, char *name, void (*release)(void *));
+void*           pcache_get(struct pcache *c);
+void            pcache_put(struct pcache *c, void *page);
+
+// A cache of equal-sized kernel objects, carved out of whole
+// pages. Freed objects go back to the cache, never to kalloc(),
+// so the memory keeps its type: a stale pointer still points at
+// an object of the same kind.
+struct kmem_cache {
+  struct spinlock lock;
+  char *name;
+  uint size;            // object size, rounded up to 8 bytes
+  void *freelist;
+  uint64 nalloc;        // objects handed out
+  uint64 npage;         // pages owned by the cache
+};
+
+void            kmem_cache_init(struct kmem_cache *c, char *name, uint size);
+void*           kmem_cache_alloc(struct kmem_cache *c);
+void            kmem_cache_free(struct kmem_cache *c, void *obj);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,29 @@
+#ifndef __LOCKSTAT_H
+#define __LOCKSTAT_H
+
+#include "types.h"
+
+// Lock contention statistics, one entry per lock name: all the
+// locks initialized with the same name add up in the same entry.
+// Times are in hardware ticks (r_time(), CLOCK_FREQ per second).
+struct lockstat {
+  char name[16];
+  uint64 sleep;         // 1 for a sleeplock, 0 for a spinlock
+  uint64 acquire;       // acquisitions
+  uint64 contended;     // acquisitions that had to wait
+  uint64 wait_total;    // time spent spinning or sleeping for it
+  uint64 wait_max;
+  uint64 hold_total;    // time it was held
+  uint64 hold_max;
+};
+
+#define NLOCKCLASS 64   // distinct lock names tracked
+
+struct lock_class;
+struct lock_class*  lock_class_get(char *name, int sleep);
+void                lockstat_acquired(struct lock_class *c, uint64 wait, int contended);
+void                lockstat_released(struct lock_class *c, uint64 hold);
+int                 lockstat_get(int i, struct lockstat *st);
+void                lockstat_reset(void);
+
+#endif
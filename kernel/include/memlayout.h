@@ -28,7 +28,7 @@
 // 02000000 -- CLINT
 // 0C000000 -- PLIC
 // 10000000 -- uart0 
-// 10001000 -- virtio disk 
+// 10001000 -- virtio mmio slots, 0x1000 apart; disks in some
 // 80000000 -- boot ROM jumps here in machine mode
 //             -kernel loads the kernel here
 // unused RAM after 80000000.
@@ -48,6 +48,8 @@
 // virtio mmio interface
 #define VIRTIO0                 0x10001000
 #define VIRTIO0_V               (VIRTIO0 + VIRT_OFFSET)
+#define NVIRTIO                 8
+#define VIRTIO_V(i)             (VIRTIO0_V + (i) * 0x1000)
 #endif
 
 // local interrupt controller, which contains the timer.
@@ -112,6 +114,8 @@
 // each surrounded by invalid guard pages.
 // #define KSTACK(p)               (TRAMPOLINE - ((p) + 1) * 2 * PGSIZE)
 #define VKSTACK                 0x3EC0000000L
+// every thread of an address space has its own kernel stack.
+#define KSTACK(slot)            (VKSTACK + (uint64)(slot) * 2 * PGSIZE)
 
 // User memory layout.
 // Address zero first:
@@ -123,6 +127,8 @@
 //   TRAPFRAME (p->trapframe, used by the trampoline)
 //   TRAMPOLINE (the same page as in the kernel)
 #define TRAPFRAME               (TRAMPOLINE - PGSIZE)
+// and its own trapframe, growing down from TRAPFRAME.
+#define TRAPFRAME_SLOT(slot)    (TRAPFRAME - (uint64)(slot) * PGSIZE)
 
 #define MAXUVA                  RUSTSBI_BASE
 
@@ -1,8 +1,11 @@
 #ifndef __PARAM_H
 #define __PARAM_H
 
-#define NPROC        50  // maximum number of processes
-#define NCPU          2  // maximum number of CPUs
+#define NPIDHASH     64  // buckets in the pid hash
+#define NTHREAD      32  // maximum threads sharing one address space
+#ifndef NCPU
+#define NCPU          8  // maximum number of CPUs (harts 0..NCPU-1), at most 64
+#endif
 #define NOFILE       16  // open files per process
 #define NFILE       100  // open files per system
 #define NINODE       50  // maximum number of active i-nodes
@@ -11,9 +14,11 @@
 #define MAXARG       32  // max exec arguments
 #define MAXOPBLOCKS  10  // max # of blocks any FS op writes
 #define LOGSIZE      (MAXOPBLOCKS*3)  // max data blocks in on-disk log
-#define NBUF         (MAXOPBLOCKS*3)  // size of disk block cache
+#define NBUF         (MAXOPBLOCKS*3)  // minimum size of disk block cache
 #define FSSIZE       1000  // size of file system in blocks
 #define MAXPATH      260   // maximum file path name
 #define INTERVAL     (390000000 / 200) // timer interrupt interval
+#define NHRTIMER     256  // maximum number of pending hrtimers
+#define DISKPOLL     20   // microseconds synchronous disk I/O spins before sleeping; 0 never
 
 #endif
\ No newline at end of file
@@ -82,9 +82,12 @@
 #ifdef QEMU     // QEMU 
 #define UART_IRQ    10 
 #define DISK_IRQ    1
+#define NDISK_IRQ   8   // one per virtio-mmio slot, from DISK_IRQ on
+#define VIRTIO_IRQ(i)   (DISK_IRQ + (i))
 #else           // k210 
 #define UART_IRQ    33
 #define DISK_IRQ    27
+#define NDISK_IRQ   1
 #endif 
 
 void plicinit(void);
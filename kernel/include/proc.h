@@ -9,6 +9,7 @@
 #include "fat32.h"
 #include "trap.h"
 #include "vm.h"
+#include "sysinfo.h"
 
 // Saved registers for kernel context switches.
 struct context {
@@ -30,43 +31,81 @@ struct context {
   uint64 s11;
 };
 
+// User floating-point registers, see fpsave() in swtch.S.
+struct fpstate {
+  uint64 f[32];
+  uint64 fcsr;
+};
+
 // Per-CPU state.
 struct cpu {
   struct proc *proc;          // The process running on this cpu, or null.
   struct context context;     // swtch() here to enter scheduler().
   int noff;                   // Depth of push_off() nesting.
   int intena;                 // Were interrupts enabled before push_off()?
+  uint64 next_tick;           // Next periodic tick (r_time()), ~0 while idle.
+  struct cpustat stat;        // Time accounting, in r_time() ticks.
+  struct proc *fpowner;       // Whose FP state the FP registers may hold.
 };
 
 extern struct cpu cpus[NCPU];
+extern volatile uint64 cpus_online;   // bit i: hart i runs the scheduler
 
-enum procstate { UNUSED, SLEEPING, RUNNABLE, RUNNING, ZOMBIE };
+enum procstate { UNUSED, USED, SLEEPING, RUNNABLE, RUNNING, ZOMBIE };
 
-// Per-process state
+// Per-process state. Allocated on demand and never freed: an
+// UNUSED proc stays on the allproc list for reuse.
 struct proc {
   struct spinlock lock;
 
+  struct proc *allnext;        // allproc list; set once, never unlinked
+  struct proc *pidnext;        // pid hash chain, or free list when UNUSED
+
   // p->lock must be held when using these:
   enum procstate state;        // Process state
-  struct proc *parent;         // Parent process
   void *chan;                  // If non-zero, sleeping on chan
   int killed;                  // If non-zero, have been killed
   int xstate;                  // Exit status to be returned to parent's wait
-  int pid;                     // Process ID
+  int pid;                     // Thread ID
+  int tgid;                    // Thread group ID, what getpid() returns
+  int autoreap;                // CLONE_THREAD: freed on exit, not by wait()
+  int group_exit;              // Killed by exit_group(); xstate holds the status
+  uint64 cpumask;              // harts it may run on, see sched_setaffinity
+
+  // wait_lock must be held when using these:
+  struct proc *parent;         // Parent process; NULL for threads
+  struct proc *children;       // First child
+  struct proc *sibling;        // Next child of the same parent
+  struct proc *group_leader;   // Thread-group leader, p itself for a process
+  struct proc *threads;        // Leader only: the other threads of the group
+  struct proc *thread_next;    // Next thread in the leader's list
 
   // these are private to the process, so p->lock need not be held.
   uint64 kstack;               // Virtual address of kernel stack
-  uint64 sz;                   // Size of process memory (bytes)
-  pagetable_t pagetable;       // User page table
-  pagetable_t kpagetable;      // Kernel page table
+  void (*kfn)(void *);         // Kernel thread: its function, or NULL
+  void *karg;                  //   and argument, see kthread_create()
+  int tslot;                   // Thread slot in mm, see KSTACK()
+  struct mm *mm;               // Address space, shared with CLONE_VM
+  struct fdtable *files;       // Open files, shared with CLONE_FILES
   struct trapframe *trapframe; // data page for trampoline.S
   struct context context;      // swtch() here to run process
-  struct file *ofile[NOFILE];  // Open files
   struct dirent *cwd;          // Current directory
+  uint64 clear_child_tid;      // CLONE_CHILD_CLEARTID: zeroed at exit
   char name[16];               // Process name (debugging)
   int tmask;                    // trace mask
 
-  struct vma vma[NVMA];
+  // time accounting, in r_time() ticks; the children's
+  // totals are only touched by the process itself in wait().
+  uint64 tstamp;               // start of the current accounting period
+  uint64 utime;                // time spent in user mode
+  uint64 stime;                // time spent in the kernel
+  uint64 cutime;               // user time of waited-for children
+  uint64 cstime;               // system time of waited-for children
+
+  // FP state is switched lazily: fp is only up to date when
+  // the registers of hart fpcpu don't hold it (see fp_save()).
+  struct fpstate fp;
+  int fpcpu;                   // Hart whose FP registers are ours, or -1
 };
 
 void            reg_info(void);
@@ -74,13 +113,14 @@ int             cpuid(void);
 void            exit(int);
 int             fork(void);
 int             growproc(int);
-pagetable_t     proc_pagetable(struct proc *);
-void            proc_freepagetable(pagetable_t, uint64);
 int             kill(int);
 struct cpu*     mycpu(void);
 struct cpu*     getmycpu(void);
 struct proc*    myproc();
 struct proc*    allocproc(void);
+struct proc*    findproc(int pid);
+struct proc*    kthread_create(void (*fn)(void *), void *arg, char *name);
+void            kthread_exit(void);
 void            freeproc(struct proc *p);
 void            procinit(void);
 void            scheduler(void) __attribute__((noreturn));
@@ -97,6 +137,17 @@ void            procdump(void);
 uint64          procnum(void);
 void            test_proc_init(int);
 
-int             clone(void);
+int             clone(uint64 flags, uint64 stack, uint64 ptid, uint64 tls, uint64 ctid);
+void            exit_group(int);
+void            kill_other_threads(struct proc *p);
+void            acct_charge(struct proc *p, int user);
+void            cpu_online(void);
+void            fp_save(struct proc *p);
+void            fp_reset(struct proc *p);
+int             fp_trap(struct proc *p);
+void            fp_userret(struct proc *p);
+int             setaffinity(int pid, uint64 mask);
+int             getaffinity(int pid, uint64 *mask);
+void            loadavg(uint64 loads[3]);
 
 #endif
\ No newline at end of file
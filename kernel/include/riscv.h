@@ -48,6 +48,11 @@ w_mepc(uint64 x)
 #define SSTATUS_UPIE (1L << 4) // User Previous Interrupt Enable
 #define SSTATUS_SIE (1L << 1)  // Supervisor Interrupt Enable
 #define SSTATUS_UIE (1L << 0)  // User Interrupt Enable
+#define SSTATUS_FS (3L << 13)  // Floating-point unit state:
+#define SSTATUS_FS_OFF     (0L << 13) // FP instructions trap
+#define SSTATUS_FS_INITIAL (1L << 13)
+#define SSTATUS_FS_CLEAN   (2L << 13) // registers match the saved copy
+#define SSTATUS_FS_DIRTY   (3L << 13) // registers modified since
 
 static inline uint64
 r_sstatus()
@@ -266,14 +271,16 @@ r_time()
 static inline void
 intr_on()
 {
-  w_sstatus(r_sstatus() | SSTATUS_SIE);
+  asm volatile("csrs sstatus, %0" : : "r" (SSTATUS_SIE));
 }
 
-// disable device interrupts
+// disable device interrupts. A single csrc: a read-modify-write
+// could be interrupted, migrate to another hart and write back
+// the old hart's sstatus.FS there.
 static inline void
 intr_off()
 {
-  w_sstatus(r_sstatus() & ~SSTATUS_SIE);
+  asm volatile("csrc sstatus, %0" : : "r" (SSTATUS_SIE));
 }
 
 // are device interrupts enabled?
@@ -90,6 +90,55 @@ static inline void sbi_remote_sfence_vma_asid(const unsigned long *hart_mask,
 	SBI_CALL_4(SBI_REMOTE_SFENCE_VMA_ASID, hart_mask, start, size, asid);
 }
 
+/* SBI v0.2 extensions: a7 = extension id, a6 = function id */
+#define SBI_EXT_BASE			0x10
+#define SBI_EXT_BASE_PROBE_EXT		3
+#define SBI_EXT_HSM			0x48534D
+#define SBI_EXT_HSM_HART_START		0
+#define SBI_EXT_HSM_HART_GET_STATUS	2
+
+#define SBI_SUCCESS			0
+#define SBI_ERR_NOT_SUPPORTED		-2
+#define SBI_ERR_ALREADY_AVAILABLE	-6
+
+struct sbiret {
+	long error;
+	long value;
+};
+
+static inline struct sbiret sbi_ecall(int ext, int fid, unsigned long arg0,
+				      unsigned long arg1, unsigned long arg2)
+{
+	struct sbiret ret;
+	register uintptr_t a0 asm ("a0") = (uintptr_t)(arg0);
+	register uintptr_t a1 asm ("a1") = (uintptr_t)(arg1);
+	register uintptr_t a2 asm ("a2") = (uintptr_t)(arg2);
+	register uintptr_t a6 asm ("a6") = (uintptr_t)(fid);
+	register uintptr_t a7 asm ("a7") = (uintptr_t)(ext);
+	asm volatile ("ecall"
+		      : "+r" (a0), "+r" (a1)
+		      : "r" (a2), "r" (a6), "r" (a7)
+		      : "memory");
+	ret.error = a0;
+	ret.value = a1;
+	return ret;
+}
+
+/* Returns non-zero if the SBI implements extension ext. */
+static inline long sbi_probe_extension(long ext)
+{
+	struct sbiret ret = sbi_ecall(SBI_EXT_BASE, SBI_EXT_BASE_PROBE_EXT, ext, 0, 0);
+	return ret.error ? 0 : ret.value;
+}
+
+/* Start hartid at the physical address start_addr, with a0 = hartid
+ * and a1 = opaque. Returns an SBI error code. */
+static inline long sbi_hart_start(unsigned long hartid, unsigned long start_addr,
+				  unsigned long opaque)
+{
+	return sbi_ecall(SBI_EXT_HSM, SBI_EXT_HSM_HART_START, hartid, start_addr, opaque).error;
+}
+
 static inline void sbi_set_extern_interrupt(unsigned long func_pointer) {
 	asm volatile("mv a6, %0" : : "r" (0x210));
 	SBI_CALL_1(0x0A000004, func_pointer);
@@ -0,0 +1,21 @@
+#ifndef __SCHED_H
+#define __SCHED_H
+
+// clone() flags, as in Linux. The low byte is the signal sent to
+// the parent on exit; there are no signals here, so it is ignored.
+#define CSIGNAL               0x000000ff
+#define CLONE_VM              0x00000100  // share the address space
+#define CLONE_FS              0x00000200  // accepted; cwd is always copied
+#define CLONE_FILES           0x00000400  // share the open-file table
+#define CLONE_SIGHAND         0x00000800  // accepted; no signal handlers
+#define CLONE_VFORK           0x00004000  // accepted; the parent does not wait
+#define CLONE_THREAD          0x00010000  // same thread group, invisible to wait()
+#define CLONE_SYSVSEM         0x00040000  // accepted
+#define CLONE_SETTLS          0x00080000  // child's tp = tls
+#define CLONE_PARENT_SETTID   0x00100000  // store child tid at ptid in the parent
+#define CLONE_CHILD_CLEARTID  0x00200000  // zero ctid in the child at exit
+#define CLONE_CHILD_SETTID    0x01000000  // store child tid at ctid in the child
+
+#define SIGCHLD               17
+
+#endif
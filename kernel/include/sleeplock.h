@@ -5,18 +5,28 @@
 #include "spinlock.h"
 
 struct spinlock;
+struct proc;
 
-// Long-term locks for processes
+// Long-term locks for processes. A waiter spins instead of
+// sleeping while the holder is running on another hart, for up
+// to SLEEPLOCK_SPIN (sleeplock.c): about what a sleep and wakeup
+// would cost.
 struct sleeplock {
   uint locked;       // Is the lock held?
   struct spinlock lk; // spinlock protecting this sleep lock
+  struct proc *owner; // Process holding lock, for spinning waiters
   
   // For debugging:
   char *name;        // Name of lock.
   int pid;           // Process holding lock
+
+  // lockstat: counters for name, and when the holder got it.
+  struct lock_class *cls;
+  uint64 tstamp;
 };
 
 void            acquiresleep(struct sleeplock*);
+int             tryacquiresleep(struct sleeplock*);
 void            releasesleep(struct sleeplock*);
 int             holdingsleep(struct sleeplock*);
 void            initsleeplock(struct sleeplock*, char*);
@@ -1,20 +1,59 @@
 #ifndef __SPINLOCK_H
 #define __SPINLOCK_H
 
+#include "types.h"
+#include "param.h"
+
 struct cpu;
 
+// How a spinlock makes waiters take turns, chosen per lock by
+// initlock_kind(). SPIN_TAS is the plain amoswap lock. The other
+// two are fair, and let each waiter spin on something that only
+// changes when it is its turn (SPIN_TICKET still shares one word
+// among the waiters; SPIN_MCS gives each its own queue node).
+#define SPIN_TAS      0
+#define SPIN_TICKET   1
+#define SPIN_MCS      2
+
+// For hot locks: tickets are cheapest with few harts, a queue
+// scales better beyond that.
+#if NCPU <= 4
+#define SPIN_QUEUED   SPIN_TICKET
+#else
+#define SPIN_QUEUED   SPIN_MCS
+#endif
+
+struct mcs_node {
+  struct mcs_node *next;  // waiter queued behind us
+  uint wait;              // set until our predecessor hands over
+  uint busy;              // node in use by this cpu
+};
+
 // Mutual exclusion lock.
 struct spinlock {
   uint locked;       // Is the lock held?
+  uint kind;         // SPIN_*
+
+  uint next;         // SPIN_TICKET: next ticket to hand out
+  uint owner;        //   ticket now being served
+  struct mcs_node *tail;   // SPIN_MCS: last waiter, or NULL
+  struct mcs_node *node;   //   the holder's queue node
 
   // For debugging:
   char *name;        // Name of lock.
   struct cpu *cpu;   // The cpu holding the lock.
+
+  // lockstat: counters for name, and when the holder got it.
+  struct lock_class *cls;
+  uint64 tstamp;
 };
 
 // Initialize a spinlock 
 void initlock(struct spinlock*, char*);
 
+// Initialize a spinlock of the given SPIN_* kind
+void initlock_kind(struct spinlock*, char*, int);
+
 // Acquire the spinlock
 // Must be used with release()
 void acquire(struct spinlock*);
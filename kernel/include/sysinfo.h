@@ -2,10 +2,36 @@
 #define __SYSINFO_H
 
 #include "types.h"
+#include "param.h"
+
+// per-hart time, in microseconds
+struct cpustat {
+  uint64 user;      // running user code
+  uint64 sys;       // running processes in the kernel
+  uint64 irq;       // handling device and timer interrupts
+  uint64 idle;      // parked in wfi
+};
+
+// buffer cache
+struct bcachestat {
+  uint64 nbuf;      // buffers currently allocated
+  uint64 hit;       // lookups found cached
+  uint64 miss;      // lookups that had to read or claim a buffer
+  uint64 evict;     // cached blocks dropped to make room
+  uint64 ra;        // blocks read ahead
+};
+
+#define FSHIFT    11              // bits of precision in loads[]
+#define FIXED_1   (1 << FSHIFT)   // 1.0 in loads[]
 
 struct sysinfo {
   uint64 freemem;   // amount of free memory (bytes)
   uint64 nproc;     // number of process
+  uint64 uptime;    // seconds since boot
+  uint64 loads[3];  // 1, 5 and 15 minute load averages, FIXED_1 == 1.0
+  uint64 ncpu;      // number of entries in cpu[]
+  struct cpustat cpu[NCPU];
+  struct bcachestat bcache;
 };
 
 
@@ -11,6 +11,9 @@
 #define SYS_read        63   // 从文件读取数据
 #define SYS_write       64   // 向文件写入数据
 #define SYS_fstat       80   // 获取文件状态
+#define SYS_sync        81   // 将所有脏缓冲写回磁盘
+#define SYS_fsync       82   // 将文件的数据与元数据写回磁盘
+#define SYS_fdatasync   83   // 将文件的数据写回磁盘
 #define SYS_pipe        59   // 创建管道
 #define SYS_dup         23   // 复制文件描述符
 #define SYS_mkdir        7   // 创建目录
@@ -28,16 +31,23 @@
 #define SYS_fork         1   // 创建子进程
 #define SYS_clone      220   // 创建子进程/线程（更灵活的fork）
 #define SYS_exec       221   // 执行新程序
-#define SYS_exit        93   // 终止当前进程
+#define SYS_exit        93   // 终止当前进程（主线程调用时终止整个进程）
+#define SYS_exit_group  94   // 终止线程组中的所有线程
 #define SYS_wait         3   // 等待子进程结束
 #define SYS_wait4      260   // 等待子进程结束（更通用的版本）
 #define SYS_kill         6   // 向进程发送信号
 #define SYS_getpid     172   // 获取当前进程ID
 #define SYS_getppid    173   // 获取父进程ID
+#define SYS_gettid     178   // 获取当前线程ID
+#define SYS_set_tid_address 96  // 设置线程退出时清零的地址
+#define SYS_futex       98   // 在用户内存字上等待/唤醒
 #define SYS_sleep       13   // 使进程休眠（秒）
 #define SYS_nanosleep  101   // 使进程休眠（纳秒）
 #define SYS_sched_yield 124  // 主动让出CPU
+#define SYS_sched_setaffinity 122  // 设置线程可运行的CPU集合
+#define SYS_sched_getaffinity 123  // 获取线程可运行的CPU集合
 #define SYS_times      153   // 获取进程的执行时间
+#define SYS_getrusage  165   // 获取进程或已回收子进程的资源使用情况
 
 
 // Memory management related (内存管理相关)
@@ -51,6 +61,7 @@
 #define SYS_gettimeofday 169 // 获取当前时间
 #define SYS_uptime      14   // 获取系统自启动以来的运行时间
 #define SYS_sysinfo     19   // 获取通用系统信息
+#define SYS_lockstat    31   // 获取/清零锁竞争统计
 #define SYS_uname      160   // 获取操作系统名称和版本等信息
 #define SYS_shutdown   210   // 关闭系统
 #define SYS_trace       18   // 用于调试，追踪系统调用
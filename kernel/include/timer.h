@@ -2,6 +2,7 @@
 #define __TIMER_H
 
 #include "types.h"
+#include "param.h"
 #include "spinlock.h"
 
 
@@ -18,15 +19,56 @@ struct timespec
     uint64 usec; // 微秒数
 };
 
+// 与 Linux 的 struct rusage 布局一致（timeval 即上面的 timespec）
+struct rusage {
+    struct timespec ru_utime; // 用户态时间
+    struct timespec ru_stime; // 系统态时间
+    long ru_maxrss;
+    long ru_ixrss;
+    long ru_idrss;
+    long ru_isrss;
+    long ru_minflt;
+    long ru_majflt;
+    long ru_nswap;
+    long ru_inblock;
+    long ru_oublock;
+    long ru_msgsnd;
+    long ru_msgrcv;
+    long ru_nsignals;
+    long ru_nvcsw;
+    long ru_nivcsw;
+};
+
+#define RUSAGE_SELF      0
+#define RUSAGE_CHILDREN (-1)
+
+
+// High-resolution timer, kept in a min-heap ordered by expiry.
+// The callback runs from the timer interrupt with the hrtimer
+// lock held: it may call wakeup() and take leaf locks, but must
+// not call back into the hrtimer API.
+struct hrtimer {
+    uint64 expires;                 // 到期时间，硬件 tick（r_time()）
+    uint64 period;                  // 非零时到期后按此周期重新入队
+    void (*fn)(struct hrtimer *);
+    void *arg;
+    int idx;                        // 在堆中的下标，-1 表示未入队
+};
 
 extern struct spinlock tickslock;
 extern uint ticks;
 
 void timerinit();
 void set_next_timeout();
-void timer_tick();
+int timer_tick();
+void timer_idle_enter();
+void timer_idle_exit();
+
+void hrtimer_init(struct hrtimer *t, void (*fn)(struct hrtimer *), void *arg);
+int hrtimer_start(struct hrtimer *t, uint64 expires);
+int hrtimer_cancel(struct hrtimer *t);
+int hrtimer_sleep_until(uint64 deadline);
 
-#endif
 
 /*
 注意区分硬件 tick 和操作系统 tick：
@@ -39,4 +81,25 @@ void timer_tick();
 */
 // #define INTERVAL     (390000000 / 200) // timer interrupt interval
 #define CLOCK_FREQ   10000000 // 10 MHz
-#define TICKS_PER_SECOND    4 // 每秒时钟中断次数
+#define TICKS_PER_SECOND    (CLOCK_FREQ / INTERVAL) // 每秒操作系统 tick 数
+#define CLK_TCK      100 // times() 返回值的单位，与 Linux 用户态的 sysconf(_SC_CLK_TCK) 一致
+#define LOAD_FREQ    (5 * CLOCK_FREQ) // 每 5 秒更新一次平均负载
+
+// 硬件 tick 换算为微秒，先除后乘以免溢出
+static inline uint64 htick_to_usec(uint64 htick) {
+    return htick / CLOCK_FREQ * 1000000 + htick % CLOCK_FREQ * 1000000 / CLOCK_FREQ;
+}
+
+static inline uint64 htick_to_clk(uint64 htick) {
+    return htick / CLOCK_FREQ * CLK_TCK + htick % CLOCK_FREQ * CLK_TCK / CLOCK_FREQ;
+}
+
+/*
+hrtimer 与 tickless idle：
+- 周期性的 INTERVAL tick 只负责时间片轮转；sleep/nanosleep 等精确超时由 hrtimer 提供，
+  到期时间直接以硬件 tick 表示，不再被量化到操作系统 tick 上
+- 每个 hart 把 sbi_set_timer 编程为 min(下一个周期 tick, 堆顶 hrtimer)
+- hart 进入 wfi 前停止周期 tick，只为堆顶 hrtimer 编程，空闲时不再被无意义地唤醒
+*/
+
+#endif
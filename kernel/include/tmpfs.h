@@ -0,0 +1,45 @@
+#ifndef __TMPFS_H
+#define __TMPFS_H
+
+#include "types.h"
+#include "sleeplock.h"
+#include "stat.h"
+#include "fat32.h"
+
+// tmpfs: files and directories that live in memory only, under
+// /tmp. A file's data is in pages found through a two-level
+// index of page pointers.
+
+#define TMPFS_DEV   (-1)    // st_dev of tmpfs files: no block device
+
+struct tnode {
+    char name[FAT32_MAX_FILENAME + 1];
+    short type;                 // T_DIR or T_FILE
+    int ref;                    // under the tmpfs lock
+    int linked;                 // still in its directory
+    struct tnode *parent;
+    struct tnode *child;        // T_DIR: its entries
+    struct tnode *next;         // the next entry of parent
+    struct sleeplock lock;      // guards size and the data
+    uint size;
+    void **index;               // pages of page pointers, or 0
+};
+
+void            tmpfs_init(void);
+char*           tmpfs_path(char *path);
+struct tnode*   tname(char *path);
+struct tnode*   tcreate(char *path, short type);
+int             tremove(char *path);
+int             trename(char *old, char *new);
+struct tnode*   tdup(struct tnode *t);
+void            tput(struct tnode *t);
+void            tlock(struct tnode *t);
+void            tunlock(struct tnode *t);
+int             tread(struct tnode *t, int user_dst, uint64 dst, uint off, uint n);
+int             twrite(struct tnode *t, int user_src, uint64 src, uint off, uint n);
+void            ttrunc(struct tnode *t);
+void            tstat(struct tnode *t, struct stat *st);
+int             tnext(struct tnode *dp, uint off, struct stat *st);
+int             tabspath(struct tnode *t, char *buf, int size);
+
+#endif
@@ -3,12 +3,15 @@
 
 #include "types.h"
 #include "buf.h"
+#include "disk.h"
 
 //
 // virtio device definitions.
 // for both the mmio interface, and virtio descriptors.
 // only tested with qemu.
-// this is the "legacy" virtio interface.
+// both the "legacy" (version 1) and the modern (version 2) mmio
+// interfaces are supported; qemu offers the modern one when run
+// with -global virtio-mmio.force-legacy=false.
 //
 // the virtio spec:
 // https://docs.oasis-open.org/virtio/virtio/v1.1/virtio-v1.1.pdf
@@ -21,18 +24,26 @@
 #define VIRTIO_MMIO_DEVICE_ID		0x008 // device type; 1 is net, 2 is disk
 #define VIRTIO_MMIO_VENDOR_ID		0x00c // 0x554d4551
 #define VIRTIO_MMIO_DEVICE_FEATURES	0x010
+#define VIRTIO_MMIO_DEVICE_FEATURES_SEL	0x014 // which 32 bits of them, modern
 #define VIRTIO_MMIO_DRIVER_FEATURES	0x020
-#define VIRTIO_MMIO_GUEST_PAGE_SIZE	0x028 // page size for PFN, write-only
+#define VIRTIO_MMIO_DRIVER_FEATURES_SEL	0x024 // modern
+#define VIRTIO_MMIO_GUEST_PAGE_SIZE	0x028 // page size for PFN, write-only, legacy
 #define VIRTIO_MMIO_QUEUE_SEL		0x030 // select queue, write-only
 #define VIRTIO_MMIO_QUEUE_NUM_MAX	0x034 // max size of current queue, read-only
 #define VIRTIO_MMIO_QUEUE_NUM		0x038 // size of current queue, write-only
-#define VIRTIO_MMIO_QUEUE_ALIGN		0x03c // used ring alignment, write-only
-#define VIRTIO_MMIO_QUEUE_PFN		0x040 // physical page number for queue, read/write
-#define VIRTIO_MMIO_QUEUE_READY		0x044 // ready bit
+#define VIRTIO_MMIO_QUEUE_ALIGN		0x03c // used ring alignment, write-only, legacy
+#define VIRTIO_MMIO_QUEUE_PFN		0x040 // physical page number for queue, legacy
+#define VIRTIO_MMIO_QUEUE_READY		0x044 // ready bit, modern
 #define VIRTIO_MMIO_QUEUE_NOTIFY	0x050 // write-only
 #define VIRTIO_MMIO_INTERRUPT_STATUS	0x060 // read-only
 #define VIRTIO_MMIO_INTERRUPT_ACK	0x064 // write-only
 #define VIRTIO_MMIO_STATUS		0x070 // read/write
+#define VIRTIO_MMIO_QUEUE_DESC_LOW	0x080 // physical address of the rings, modern
+#define VIRTIO_MMIO_QUEUE_DESC_HIGH	0x084
+#define VIRTIO_MMIO_DRIVER_DESC_LOW	0x090 // the avail ring
+#define VIRTIO_MMIO_DRIVER_DESC_HIGH	0x094
+#define VIRTIO_MMIO_DEVICE_DESC_LOW	0x0a0 // the used ring
+#define VIRTIO_MMIO_DEVICE_DESC_HIGH	0x0a4
 
 // status register bits, from qemu virtio_config.h
 #define VIRTIO_CONFIG_S_ACKNOWLEDGE	1
@@ -43,15 +54,23 @@
 // device feature bits
 #define VIRTIO_BLK_F_RO              5	/* Disk is read-only */
 #define VIRTIO_BLK_F_SCSI            7	/* Supports scsi command passthru */
+#define VIRTIO_BLK_F_FLUSH           9	/* Cache flush command support */
 #define VIRTIO_BLK_F_CONFIG_WCE     11	/* Writeback mode available in config */
 #define VIRTIO_BLK_F_MQ             12	/* support more than one vq */
 #define VIRTIO_F_ANY_LAYOUT         27
 #define VIRTIO_RING_F_INDIRECT_DESC 28
 #define VIRTIO_RING_F_EVENT_IDX     29
+#define VIRTIO_F_VERSION_1          32	/* the modern interface */
 
 // this many virtio descriptors.
-// must be a power of two.
-#define NUM 8
+// must be a power of two; the rings must fit the two pages
+// of struct vqueue.
+#define NUM 32
+
+// descriptors in a request: its header, its segments and its
+// status byte. with indirect descriptors, this many sit in a
+// table of their own and the request takes one in the ring.
+#define NDESC_REQ (BLKREQ_MAXSEG + 2)
 
 struct VRingDesc {
   uint64 addr;
@@ -61,6 +80,12 @@ struct VRingDesc {
 };
 #define VRING_DESC_F_NEXT  1 // chained with another descriptor
 #define VRING_DESC_F_WRITE 2 // device writes (vs read)
+#define VRING_DESC_F_INDIRECT 4 // addr is a table of descriptors
+
+// avail ring flags, and used ring flags. ignored in favour of
+// the event indices when VIRTIO_RING_F_EVENT_IDX is negotiated.
+#define VRING_AVAIL_F_NO_INTERRUPT 1
+#define VRING_USED_F_NO_NOTIFY     1
 
 struct VRingUsedElem {
   uint32 id;   // index of start of completed descriptor chain
@@ -70,15 +95,18 @@ struct VRingUsedElem {
 // for disk ops
 #define VIRTIO_BLK_T_IN  0 // read the disk
 #define VIRTIO_BLK_T_OUT 1 // write the disk
+#define VIRTIO_BLK_T_FLUSH 4 // flush the disk's write cache
 
 struct UsedArea {
   uint16 flags;
   uint16 id;
   struct VRingUsedElem elems[NUM];
+  uint16 avail_event; // notify when avail idx passes this, with EVENT_IDX
 };
 
 void            virtio_disk_init(void);
-void            virtio_disk_rw(struct buf *b, int write);
-void            virtio_disk_intr(void);
+void            virtio_disk_intr(int irq);
+int             virtio_disk_poll(void);
+void            virtio_disk_polling(int on);
 
 #endif
@@ -3,6 +3,7 @@
 
 #include "types.h"
 #include "riscv.h"
+#include "sleeplock.h"
 
 void            kvminit(void);
 void            kvminithart(void);
@@ -27,6 +28,8 @@ int             copyinstr(pagetable_t, char *, uint64, uint64);
 pagetable_t     proc_kpagetable(void);
 void            kvmfreeusr(pagetable_t kpt);
 void            kvmfree(pagetable_t kpagetable, int stack_free);
+void*           kstack_alloc(void);
+void            kstack_free(void *kstack);
 uint64          kwalkaddr(pagetable_t pagetable, uint64 va);
 int             copyout2(uint64 dstva, char *src, uint64 len);
 int             copyin2(char *dst, uint64 srcva, uint64 len);
@@ -54,11 +57,35 @@ struct vma {
     uint64 offset;          // 文件内的偏移量
 };
 
+// An address space, shared by the threads created with CLONE_VM.
+// Each thread owns one slot: a kernel stack at KSTACK(slot) in
+// kpagetable and its trapframe at TRAPFRAME_SLOT(slot) in pagetable.
+struct mm {
+    struct sleeplock lock;  // 修改映射（sz、vma、页表）时持有
+    int ref;                // 指向此 mm 的 proc 数，为 0 时释放页表
+    int users;              // 尚未 exit 的线程数，为 0 时释放 vma
+    uint32 slots;           // 已占用的线程槽位
+    pagetable_t pagetable;  // User page table
+    pagetable_t kpagetable; // Kernel page table
+    uint64 sz;              // Size of process memory (bytes)
+    struct vma vma[NVMA];
+};
+
 struct proc;
 
-void vma_writeback(struct proc*, struct vma*);
-void vma_free(struct proc*);
-uint64 mmap_getaddr(struct proc*, uint64);
+void mminit(void);
+struct mm* mm_alloc(void);
+struct mm* mm_dup(struct mm*);
+void mm_put(struct mm*);
+void mm_release(struct mm*);
+int mm_attach(struct mm*, struct proc*);
+void mm_detach(struct proc*, int free_kstack);
+int mm_move(struct proc*, struct mm*);
+void mm_flush_tlb(struct mm*);
+
+void vma_writeback(struct mm*, struct vma*);
+void vma_free(struct mm*);
+uint64 mmap_getaddr(struct mm*, uint64);
 
 #endif
 
@@ -1,6 +1,10 @@
 // Physical memory allocator, for user processes,
 // kernel stacks, page-table pages,
 // and pipe buffers. Allocates whole 4096-byte pages.
+// kmem_cache hands out smaller objects of one size.
+// Two kernel threads run in the background: kzerod keeps a
+// pool of pre-zeroed pages for kzalloc(), and kreclaimd asks
+// the registered shrinkers for pages when memory runs low.
 
 
 #include "include/types.h"
@@ -11,6 +15,9 @@
 #include "include/kalloc.h"
 #include "include/string.h"
 #include "include/printf.h"
+#include "include/intr.h"
+#include "include/proc.h"
+#include "include/timer.h"
 
 void freerange(void *pa_start, void *pa_end);
 
@@ -20,18 +27,30 @@ struct run {
   struct run *next;
 };
 
+#define ZERO_POOL   16    // pages kzerod keeps zeroed
+#define KMEM_LOW    32    // kreclaimd starts below this many free pages
+#define KMEM_HIGH   64    // ... and stops once this many are free
+
 struct {
   struct spinlock lock;
   struct run *freelist;
   uint64 npage;
+  struct run *zerolist;   // zeroed pages, not counted in npage
+  uint64 nzero;
+  struct shrinker *shrinkers;
 } kmem;
 
+static struct hrtimer kmem_timer;
+
 void
 kinit()
 {
-  initlock(&kmem.lock, "kmem");
+  initlock_kind(&kmem.lock, "kmem", SPIN_QUEUED);
   kmem.freelist = 0;
   kmem.npage = 0;
+  kmem.zerolist = 0;
+  kmem.nzero = 0;
+  kmem.shrinkers = 0;
   freerange(kernel_end, (void*)PHYSTOP);
   #ifdef DEBUG
   printf("kernel_end: %p, phystop: %p\n", kernel_end, (void*)PHYSTOP);
@@ -72,6 +91,21 @@ kfree(void *pa)
   release(&kmem.lock);
 }
 
+// Wake a daemon sleeping on chan. wakeup() takes every p->lock,
+// so skip it if the caller holds any spinlock: kmem_timer will
+// get the daemon going a little later.
+static void
+kmem_kick(void *chan)
+{
+  int nolocks;
+
+  push_off();
+  nolocks = mycpu()->noff == 1;
+  pop_off();
+  if(nolocks)
+    wakeup(chan);
+}
+
 // Allocate one 4096-byte page of physical memory.
 // Returns a pointer that the kernel can use.
 // Returns 0 if the memory cannot be allocated.
@@ -79,22 +113,286 @@ void *
 kalloc(void)
 {
   struct run *r;
+  uint64 n;
 
   acquire(&kmem.lock);
   r = kmem.freelist;
   if(r) {
     kmem.freelist = r->next;
     kmem.npage--;
+  } else if((r = kmem.zerolist) != 0) {
+    // better than failing.
+    kmem.zerolist = r->next;
+    kmem.nzero--;
   }
+  n = kmem.npage;
   release(&kmem.lock);
 
+  if(n < KMEM_LOW && kmem.shrinkers)
+    kmem_kick(&kmem.shrinkers);
   if(r)
     memset((char*)r, 5, PGSIZE); // fill with junk
   return (void*)r;
 }
 
+// Allocate one zeroed page, from the pool kzerod keeps filled
+// if it can. Returns 0 if the memory cannot be allocated.
+void *
+kzalloc(void)
+{
+  struct run *r;
+  uint64 n;
+
+  acquire(&kmem.lock);
+  if((r = kmem.zerolist) != 0) {
+    kmem.zerolist = r->next;
+    kmem.nzero--;
+  }
+  n = kmem.nzero;
+  release(&kmem.lock);
+
+  if(n < ZERO_POOL / 2)
+    kmem_kick(&kmem.zerolist);
+  if(r) {
+    r->next = 0;   // the rest of the page is still zero
+    return (void*)r;
+  }
+  if((r = kalloc()) != 0)
+    memset((char*)r, 0, PGSIZE);
+  return (void*)r;
+}
+
 uint64
 freemem_amount(void)
 {
-  return kmem.npage << PGSHIFT;
+  return (kmem.npage + kmem.nzero) << PGSHIFT;
+}
+
+// Whether caches may take pages without bringing kreclaimd on.
+int
+kmem_plenty(void)
+{
+  return kmem.npage >= KMEM_HIGH;
+}
+
+// Add s to the shrinkers kreclaimd calls when memory runs low.
+void
+register_shrinker(struct shrinker *s)
+{
+  acquire(&kmem.lock);
+  s->next = kmem.shrinkers;
+  kmem.shrinkers = s;
+  release(&kmem.lock);
+}
+
+static void
+kzerod(void *arg)
+{
+  struct run *r;
+
+  acquire(&kmem.lock);
+  for(;;){
+    while(kmem.nzero >= ZERO_POOL || kmem.npage <= KMEM_LOW)
+      sleep(&kmem.zerolist, &kmem.lock);
+    release(&kmem.lock);
+
+    if((r = kalloc()) != 0)
+      memset((char*)r, 0, PGSIZE);
+
+    acquire(&kmem.lock);
+    if(r){
+      r->next = kmem.zerolist;
+      kmem.zerolist = r;
+      kmem.nzero++;
+    }
+  }
+}
+
+// The zero pool is the first thing to give back.
+static uint64
+zero_shrink(struct shrinker *s, uint64 want)
+{
+  struct run *r;
+  uint64 n = 0;
+
+  acquire(&kmem.lock);
+  while(n < want && (r = kmem.zerolist) != 0){
+    kmem.zerolist = r->next;
+    kmem.nzero--;
+    r->next = kmem.freelist;
+    kmem.freelist = r;
+    kmem.npage++;
+    n++;
+  }
+  release(&kmem.lock);
+  return n;
+}
+
+static struct shrinker zero_shrinker = { zero_shrink };
+
+static void
+kreclaimd(void *arg)
+{
+  struct shrinker *s;
+
+  acquire(&kmem.lock);
+  for(;;){
+    while(kmem.npage >= KMEM_LOW)
+      sleep(&kmem.shrinkers, &kmem.lock);
+    // the list only grows, at its head.
+    s = kmem.shrinkers;
+    release(&kmem.lock);
+
+    for(; s && kmem.npage < KMEM_HIGH; s = s->next)
+      s->shrink(s, KMEM_HIGH - kmem.npage);
+
+    acquire(&kmem.lock);
+    if(kmem.npage < KMEM_LOW){
+      // nothing more to give back: wait for frees or a kick.
+      sleep(&kmem.shrinkers, &kmem.lock);
+    }
+  }
+}
+
+// Catches the kicks kmem_kick() had to skip. Runs in interrupt
+// context; see struct hrtimer.
+static void
+kmem_poll(struct hrtimer *t)
+{
+  if(kmem.nzero < ZERO_POOL / 2 && kmem.npage > KMEM_LOW)
+    wakeup(&kmem.zerolist);
+  if(kmem.npage < KMEM_LOW)
+    wakeup(&kmem.shrinkers);
+}
+
+// Start the memory daemons, once the scheduler can run them.
+void
+kmem_daemons_init(void)
+{
+  register_shrinker(&zero_shrinker);
+  if(kthread_create(kzerod, 0, "kzerod") == NULL ||
+     kthread_create(kreclaimd, 0, "kreclaimd") == NULL)
+    panic("kmem_daemons_init");
+  hrtimer_init(&kmem_timer, kmem_poll, 0);
+  kmem_timer.period = CLOCK_FREQ;
+  hrtimer_start(&kmem_timer, r_time() + CLOCK_FREQ);
+}
+
+void
+kmem_cache_init(struct kmem_cache *c, char *name, uint size)
+{
+  initlock(&c->lock, name);
+  c->name = name;
+  c->size = (size + 7) & ~7;
+  if(c->size > PGSIZE)
+    panic("kmem_cache_init");
+  c->freelist = 0;
+  c->nalloc = 0;
+  c->npage = 0;
+}
+
+// Returns an uninitialized object, or 0 if out of memory.
+void *
+kmem_cache_alloc(struct kmem_cache *c)
+{
+  struct run *r;
+  char *page;
+
+  acquire(&c->lock);
+  if(c->freelist == 0){
+    if((page = kalloc()) == 0){
+      release(&c->lock);
+      return 0;
+    }
+    c->npage++;
+    for(uint off = 0; off + c->size <= PGSIZE; off += c->size){
+      r = (struct run*)(page + off);
+      r->next = c->freelist;
+      c->freelist = r;
+    }
+  }
+  r = c->freelist;
+  c->freelist = r->next;
+  c->nalloc++;
+  release(&c->lock);
+  return (void*)r;
+}
+
+void
+kmem_cache_free(struct kmem_cache *c, void *obj)
+{
+  struct run *r = (struct run*)obj;
+
+  acquire(&c->lock);
+  r->next = c->freelist;
+  c->freelist = r;
+  c->nalloc--;
+  release(&c->lock);
+}
+
+static uint64
+pcache_shrink(struct shrinker *s, uint64 want)
+{
+  struct pcache *c = (struct pcache*)s;
+  uint64 n = 0;
+  void *page;
+
+  for(int i = 0; i < NCPU && n < want; i++){
+    for(;;){
+      acquire(&c->cpu[i].lock);
+      page = c->cpu[i].n > 0 ? c->cpu[i].page[--c->cpu[i].n] : 0;
+      release(&c->cpu[i].lock);
+      if(page == 0)
+        break;
+      c->release(page);
+      n++;
+    }
+  }
+  return n;
+}
+
+void
+pcache_init(struct pcache *c, char *name, void (*release)(void *))
+{
+  c->name = name;
+  c->release = release;
+  for(int i = 0; i < NCPU; i++){
+    initlock(&c->cpu[i].lock, name);
+    c->cpu[i].n = 0;
+  }
+  c->shrinker.shrink = pcache_shrink;
+  register_shrinker(&c->shrinker);
+}
+
+// Returns a page put back earlier on this hart, or 0 if there
+// is none: the caller then allocates and sets up a new one.
+void *
+pcache_get(struct pcache *c)
+{
+  void *page = 0;
+
+  push_off();
+  int id = cpuid();
+  acquire(&c->cpu[id].lock);
+  if(c->cpu[id].n > 0)
+    page = c->cpu[id].page[--c->cpu[id].n];
+  release(&c->cpu[id].lock);
+  pop_off();
+  return page;
+}
+
+void
+pcache_put(struct pcache *c, void *page)
+{
+  push_off();
+  int id = cpuid();
+  acquire(&c->cpu[id].lock);
+  if(c->cpu[id].n < PCACHE_SIZE){
+    c->cpu[id].page[c->cpu[id].n++] = page;
+    page = 0;
+  }
+  release(&c->cpu[id].lock);
+  pop_off();
+  if(page)
+    c->release(page);
 }
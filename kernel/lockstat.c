@@ -0,0 +1,122 @@
+// Lock contention statistics, per lock name.
+//
+// Every spinlock and sleeplock points at the lock_class for its
+// name, found or created by initlock()/initsleeplock(). acquire()
+// and release() add to it with atomics only, so this file must
+// not take any lock itself.
+
+#include "include/types.h"
+#include "include/param.h"
+#include "include/riscv.h"
+#include "include/intr.h"
+#include "include/string.h"
+#include "include/lockstat.h"
+
+struct lock_class {
+  char *name;
+  int sleep;
+  uint64 acquire;
+  uint64 contended;
+  uint64 wait_total;
+  uint64 wait_max;
+  uint64 hold_total;
+  uint64 hold_max;
+};
+
+static struct lock_class classes[NLOCKCLASS];
+static int nclass;
+// Guards nclass. A bare flag: initlock() can't use a spinlock.
+static uint classlock;
+// Names that no longer fit add up here.
+static struct lock_class other = { .name = "(other)" };
+
+struct lock_class *
+lock_class_get(char *name, int sleep)
+{
+  struct lock_class *c;
+  int i;
+
+  push_off();
+  while(__sync_lock_test_and_set(&classlock, 1) != 0)
+    ;
+  for(i = 0; i < nclass; i++){
+    c = &classes[i];
+    if(c->sleep == sleep && (c->name == name || strncmp(c->name, name, 16) == 0))
+      break;
+  }
+  if(i == nclass){
+    if(nclass < NLOCKCLASS){
+      c = &classes[nclass];
+      c->name = name;
+      c->sleep = sleep;
+      // lock-free readers must see the entry before the count.
+      __sync_synchronize();
+      nclass++;
+    } else {
+      c = &other;
+    }
+  }
+  __sync_lock_release(&classlock);
+  pop_off();
+  return c;
+}
+
+static void
+atomic_max(uint64 *p, uint64 v)
+{
+  uint64 old = __atomic_load_n(p, __ATOMIC_RELAXED);
+
+  while(v > old &&
+        !__atomic_compare_exchange_n(p, &old, v, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    ;
+}
+
+void
+lockstat_acquired(struct lock_class *c, uint64 wait, int contended)
+{
+  __atomic_fetch_add(&c->acquire, 1, __ATOMIC_RELAXED);
+  if(contended){
+    __atomic_fetch_add(&c->contended, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&c->wait_total, wait, __ATOMIC_RELAXED);
+    atomic_max(&c->wait_max, wait);
+  }
+}
+
+void
+lockstat_released(struct lock_class *c, uint64 hold)
+{
+  __atomic_fetch_add(&c->hold_total, hold, __ATOMIC_RELAXED);
+  atomic_max(&c->hold_max, hold);
+}
+
+// Fill st with the i-th class. Returns -1 past the last one.
+int
+lockstat_get(int i, struct lockstat *st)
+{
+  struct lock_class *c;
+
+  if(i < 0 || i > nclass)
+    return -1;
+  c = i < nclass ? &classes[i] : &other;
+  safestrcpy(st->name, c->name, sizeof(st->name));
+  st->sleep = c->sleep;
+  st->acquire = c->acquire;
+  st->contended = c->contended;
+  st->wait_total = c->wait_total;
+  st->wait_max = c->wait_max;
+  st->hold_total = c->hold_total;
+  st->hold_max = c->hold_max;
+  return 0;
+}
+
+// Zero all the counters. Updates racing with it may survive.
+void
+lockstat_reset(void)
+{
+  for(int i = 0; i <= nclass; i++){
+    struct lock_class *c = i < nclass ? &classes[i] : &other;
+    c->acquire = c->contended = 0;
+    c->wait_total = c->wait_max = 0;
+    c->hold_total = c->hold_max = 0;
+  }
+}
@@ -14,8 +14,10 @@
 #include "include/proc.h"
 #include "include/plic.h"
 #include "include/vm.h"
+#include "include/futex.h"
 #include "include/disk.h"
 #include "include/buf.h"
+#include "include/tmpfs.h"
 #ifndef QEMU
 #include "include/sdcard.h"
 #include "include/fpioa.h"
@@ -23,17 +25,52 @@
 #endif
 
 static inline void inithartid(unsigned long hartid) {
-  asm volatile("mv tp, %0" : : "r" (hartid & 0x1));
+  asm volatile("mv tp, %0" : : "r" (hartid));
 }
 
 volatile static int started = 0;
+// The first hart to get here initializes the kernel, whatever
+// its id: the SBI may enter us on any hart.
+volatile static int boot_hartid = -1;
+
+#ifdef QEMU
+extern char _entry[];
+#define KERNEL_ENTRY  _entry
+#else
+extern char _start[];
+#define KERNEL_ENTRY  _start
+#endif
+
+// Bring up the other harts. With the HSM extension they are
+// started at the kernel entry; otherwise, or if one refuses,
+// fall back to the legacy IPI for harts the SBI already
+// released into the kernel.
+static void
+start_harts(unsigned long self)
+{
+  unsigned long legacy = 0;
+  int hsm = sbi_probe_extension(SBI_EXT_HSM) != 0;
+
+  for(unsigned long i = 0; i < NCPU; i++) {
+    if(i == self)
+      continue;
+    if(hsm) {
+      long err = sbi_hart_start(i, (uint64)KERNEL_ENTRY, 0);
+      if(err == SBI_SUCCESS || err == SBI_ERR_ALREADY_AVAILABLE)
+        continue;
+    }
+    legacy |= 1UL << i;
+  }
+  if(legacy)
+    sbi_send_ipi(&legacy);
+}
 
 void
 main(unsigned long hartid, unsigned long dtb_pa)
 {
   inithartid(hartid);
   
-  if (hartid == 0) {
+  if (__sync_bool_compare_and_swap(&boot_hartid, -1, (int)hartid)) {
     consoleinit();
     printfinit();   // init a lock for printf 
     print_logo();
@@ -46,6 +83,8 @@ main(unsigned long hartid, unsigned long dtb_pa)
     timerinit();     // init a lock for timer
     trapinithart();  // install kernel trap vector, including interrupt handler
     procinit();
+    mminit();        // address spaces
+    futexinit();     // futex wait queues
     plicinit();
     plicinithart();
     #ifndef QEMU
@@ -55,19 +94,19 @@ main(unsigned long hartid, unsigned long dtb_pa)
     disk_init();
     binit();         // buffer cache
     fileinit();      // file table
+    tmpfs_init();    // /tmp
     userinit();      // first user process
-    printf("hart 0 init done\n");
+    kmem_daemons_init(); // kzerod, kreclaimd
+    bio_daemons_init(); // kflushd, kreadahead
+    printf("hart %d init done\n", hartid);
     
-    for(int i = 1; i < NCPU; i++) {
-      unsigned long mask = 1 << i;
-      sbi_send_ipi(&mask);
-    }
     __sync_synchronize();
     started = 1;
+    start_harts(hartid);
   }
   else
   {
-    // hart 1
+    // the other harts
     while (started == 0)
       ;
     __sync_synchronize();
@@ -77,7 +116,8 @@ main(unsigned long hartid, unsigned long dtb_pa)
     kvminithart();
     trapinithart();
     plicinithart();  // ask PLIC for device interrupts
-    printf("hart 1 init done\n");
+    printf("hart %d init done\n", hartid);
   }
+  cpu_online();
   scheduler();
 }
@@ -0,0 +1,129 @@
+// Partition tables: the MBR's four primary partitions, or a GPT
+// behind a protective MBR. Each partition found becomes a block
+// device of its own, named after the disk: vda1, vda2, ...
+// A disk whose first sector is a FAT boot sector holds a bare
+// volume and is left whole.
+
+#include "include/types.h"
+#include "include/param.h"
+#include "include/riscv.h"
+#include "include/spinlock.h"
+#include "include/sleeplock.h"
+#include "include/buf.h"
+#include "include/disk.h"
+#include "include/string.h"
+#include "include/printf.h"
+
+#define MBR_PART        446     // the four partition entries
+#define MBR_TYPE_GPT    0xee    // protective MBR
+#define GPT_MAXENT      128
+
+// avoid misaligned loads on k210
+static uint32 get32(uchar *p)
+{
+    uint32 v;
+    memmove(&v, p, sizeof(v));
+    return v;
+}
+
+static uint64 get64(uchar *p)
+{
+    uint64 v;
+    memmove(&v, p, sizeof(v));
+    return v;
+}
+
+static void part_add(uint disk, int n, uint64 start, uint64 nsec)
+{
+    struct blkdev *d = blkdev_get(disk);
+    char name[sizeof(d->name)];
+    int len;
+
+    if (nsec == 0 || start + nsec > d->nsec || start + nsec >= ~0U) {
+        printf("%s: partition %d out of range\n", d->name, n);
+        return;
+    }
+    len = strlen(d->name);
+    if (len + 3 >= sizeof(name))
+        return;
+    safestrcpy(name, d->name, sizeof(name));
+    if (n >= 10)
+        name[len++] = '0' + n / 10;
+    name[len++] = '0' + n % 10;
+    name[len] = 0;
+    blkdev_add(name, disk, start, nsec);
+}
+
+static void gpt_scan(uint disk)
+{
+    struct buf *b;
+    uint64 lba, first, last;
+    uint nent, esize, i, n = 0;
+    static uchar zero[16];
+
+    b = bread(disk, 1);
+    if (strncmp((char *)b->data, "EFI PART", 8) != 0) {
+        brelse(b);
+        return;
+    }
+    lba = get64(b->data + 72);
+    nent = get32(b->data + 80);
+    esize = get32(b->data + 84);
+    brelse(b);
+    if (esize < 128 || BSIZE % esize != 0)
+        return;
+    if (nent > GPT_MAXENT)
+        nent = GPT_MAXENT;
+
+    b = 0;
+    for (i = 0; i < nent; i++) {
+        uint off = i * esize % BSIZE;
+        if (off == 0) {
+            if (b)
+                brelse(b);
+            b = bread(disk, lba + i * esize / BSIZE);
+        }
+        n++;
+        if (memcmp(b->data + off, zero, sizeof(zero)) == 0)
+            continue;       // unused entry
+        first = get64(b->data + off + 32);
+        last = get64(b->data + off + 40);
+        if (last >= first)
+            part_add(disk, n, first, last - first + 1);
+    }
+    if (b)
+        brelse(b);
+}
+
+// Add the partitions of disk.
+void part_scan(uint disk)
+{
+    struct buf *b;
+    uchar *e;
+    int i, gpt = 0;
+
+    b = bread(disk, 0);
+    if (b->data[510] != 0x55 || b->data[511] != 0xaa ||
+        strncmp((char *)b->data + 82, "FAT32", 5) == 0 ||
+        strncmp((char *)b->data + 54, "FAT", 3) == 0) {
+        brelse(b);
+        return;
+    }
+    for (i = 0; i < 4; i++) {
+        e = b->data + MBR_PART + 16 * i;
+        if ((e[0] & 0x7f) != 0) {
+            brelse(b);      // not a partition table after all
+            return;
+        }
+        if (e[4] == MBR_TYPE_GPT)
+            gpt = 1;
+    }
+    for (i = 0; i < 4 && !gpt; i++) {
+        e = b->data + MBR_PART + 16 * i;
+        if (e[4] != 0)
+            part_add(disk, i + 1, get32(e + 8), get32(e + 12));
+    }
+    brelse(b);
+    if (gpt)
+        gpt_scan(disk);
+}
@@ -13,7 +13,8 @@
 //
 
 void plicinit(void) {
-	writed(1, PLIC_V + DISK_IRQ * sizeof(uint32));
+	for (int i = 0; i < NDISK_IRQ; i++)
+		writed(1, PLIC_V + (DISK_IRQ + i) * sizeof(uint32));
 	writed(1, PLIC_V + UART_IRQ * sizeof(uint32));
 
 	#ifdef DEBUG 
@@ -27,7 +28,7 @@ plicinithart(void)
   int hart = cpuid();
   #ifdef QEMU
   // set uart's enable bit for this hart's S-mode. 
-  *(uint32*)PLIC_SENABLE(hart)= (1 << UART_IRQ) | (1 << DISK_IRQ);
+  *(uint32*)PLIC_SENABLE(hart)= (1 << UART_IRQ) | (((1 << NDISK_IRQ) - 1) << DISK_IRQ);
   // set this hart's S-mode priority threshold to 0.
   *(uint32*)PLIC_SPRIORITY(hart) = 0;
   #else
@@ -13,24 +13,54 @@
 #include "include/file.h"
 #include "include/trap.h"
 #include "include/vm.h"
+#include "include/timer.h"
+#include "include/sched.h"
+#include "include/futex.h"
+#include "include/sbi.h"
 
 
 struct cpu cpus[NCPU];
 
-struct proc proc[NPROC];
+volatile uint64 cpus_online;
+// harts waiting in wfi with nothing to run; see kick_idle().
+static volatile uint64 cpus_idle;
+
+// Every proc ever allocated, newest first. New procs are only
+// pushed at the head, so the list can be walked without a lock.
+static struct proc *allproc;
+static struct kmem_cache proc_cache;
 
 struct proc *initproc;
 
+// pid_lock protects nextpid, the pid hash and the free list.
 int nextpid = 1;
 struct spinlock pid_lock;
+static struct proc *pidhash[NPIDHASH];
+static struct proc *freeprocs;
+
+// helps ensure that wakeups of wait()ing parents are not lost,
+// and protects the parent, child and thread-group links.
+// must be acquired before any p->lock.
+struct spinlock wait_lock;
+
+#define for_each_proc(p) for(p = allproc; p; p = p->allnext)
 
 extern void forkret(void);
 extern void swtch(struct context*, struct context*);
-static void wakeup1(struct proc *chan);
+extern void fpsave(struct fpstate*);
+extern void fprestore(struct fpstate*);
 void freeproc(struct proc *p);
 
 extern char trampoline[]; // trampoline.S
 
+static struct hrtimer load_timer;
+static uint64 avenrun[3];    // load averages, FIXED_1 == 1.0
+static void calc_load(struct hrtimer *t);
+static void kinit_fs(void *arg);
+
+// Trapframe pages of exited threads, ready for allocproc().
+static struct pcache trapframe_cache;
+
 void reg_info(void) {
   printf("register info: {\n");
   printf("sstatus: %p\n", r_sstatus());
@@ -51,27 +81,16 @@ void reg_info(void) {
 void
 procinit(void)
 {
-  struct proc *p;
-  
   initlock(&pid_lock, "nextpid");
-  for(p = proc; p < &proc[NPROC]; p++) {
-      initlock(&p->lock, "proc");
-
-      // Allocate a page for the process's kernel stack.
-      // Map it high in memory, followed by an invalid
-      // guard page.
-      // char *pa = kalloc();
-      // // printf("[procinit]kernel stack: %p\n", (uint64)pa);
-      // if(pa == 0)
-      //   panic("kalloc");
-      // uint64 va = KSTACK((int) (p - proc));
-      // // printf("[procinit]kvmmap va %p to pa %p\n", va, (uint64)pa);
-      // kvmmap(va, (uint64)pa, PGSIZE, PTE_R | PTE_W);
-      // p->kstack = va;
-  }
-  //kvminithart();
+  initlock(&wait_lock, "wait_lock");
+  kmem_cache_init(&proc_cache, "proc", sizeof(struct proc));
 
   memset(cpus, 0, sizeof(cpus));
+
+  pcache_init(&trapframe_cache, "trapframe", kfree);
+  hrtimer_init(&load_timer, calc_load, 0);
+  load_timer.period = LOAD_FREQ;
+  hrtimer_start(&load_timer, r_time() + LOAD_FREQ);
   #ifdef DEBUG
   printf("procinit\n");
   #endif
@@ -107,143 +126,157 @@ myproc(void) {
   return p;
 }
 
-int
-allocpid() {
-  int pid;
-  
+// Give p a fresh pid and hash it.
+static void
+allocpid(struct proc *p)
+{
   acquire(&pid_lock);
-  pid = nextpid;
-  nextpid = nextpid + 1;
+  p->pid = nextpid++;
+  p->pidnext = pidhash[p->pid % NPIDHASH];
+  pidhash[p->pid % NPIDHASH] = p;
   release(&pid_lock);
+}
 
-  return pid;
+// Unhash p and put it on the free list. p->lock must be held.
+static void
+releasepid(struct proc *p)
+{
+  struct proc **pp;
+
+  acquire(&pid_lock);
+  for(pp = &pidhash[p->pid % NPIDHASH]; *pp; pp = &(*pp)->pidnext){
+    if(*pp == p){
+      *pp = p->pidnext;
+      break;
+    }
+  }
+  p->pid = 0;
+  p->pidnext = freeprocs;
+  freeprocs = p;
+  release(&pid_lock);
+}
+
+// Look up a thread by pid. The caller must check p->pid again
+// under a lock: p may exit and be reused in the meantime, but
+// since procs are never freed it remains a valid proc.
+struct proc*
+findproc(int pid)
+{
+  struct proc *p;
+
+  acquire(&pid_lock);
+  for(p = pidhash[pid % NPIDHASH]; p; p = p->pidnext)
+    if(p->pid == pid)
+      break;
+  release(&pid_lock);
+  return p;
 }
 
-// Look in the process table for an UNUSED proc.
-// If found, initialize state required to run in the kernel,
-// and return with p->lock held.
-// If there are no free procs, or a memory allocation fails, return 0.
+// Take an UNUSED proc from the free list, or allocate one.
+// If found, mark it USED, allocate its pid and trapframe and
+// return with p->lock held; the caller gives it an address space
+// with mm_attach(), which also sets up its kernel stack.
+// If memory runs out, return 0.
 struct proc*
 allocproc(void)
 {
   struct proc *p;
 
-  for(p = proc; p < &proc[NPROC]; p++) {
-    acquire(&p->lock);
-    if(p->state == UNUSED) {
-      goto found;
-    } else {
-      release(&p->lock);
-    }
+  acquire(&pid_lock);
+  if((p = freeprocs) != NULL)
+    freeprocs = p->pidnext;
+  release(&pid_lock);
+
+  if(p == NULL){
+    if((p = kmem_cache_alloc(&proc_cache)) == NULL)
+      return NULL;
+    memset(p, 0, sizeof(*p));
+    initlock(&p->lock, "proc");
+    p->state = UNUSED;
+    acquire(&pid_lock);
+    p->allnext = allproc;
+    // lock-free walkers must see p initialized before it is linked.
+    __sync_synchronize();
+    allproc = p;
+    release(&pid_lock);
   }
-  return NULL;
 
-found:
-  p->pid = allocpid();
+  acquire(&p->lock);
+  allocpid(p);
+  p->state = USED;
+  p->tgid = p->pid;
+  p->autoreap = 0;
+  p->group_exit = 0;
+  p->clear_child_tid = 0;
+  p->mm = NULL;
+  p->files = NULL;
+  p->parent = NULL;
+  p->children = NULL;
+  p->sibling = NULL;
+  p->group_leader = p;
+  p->threads = NULL;
+  p->thread_next = NULL;
+  p->cpumask = ~0UL;
+  memset(&p->fp, 0, sizeof(p->fp));
+  p->fpcpu = -1;
 
   // Allocate a trapframe page.
-  if((p->trapframe = (struct trapframe *)kalloc()) == NULL){
-    release(&p->lock);
-    return NULL;
-  }
-
-  // An empty user page table.
-  // And an identical kernel page table for this proc.
-  if ((p->pagetable = proc_pagetable(p)) == NULL ||
-      (p->kpagetable = proc_kpagetable()) == NULL) {
+  if((p->trapframe = pcache_get(&trapframe_cache)) == NULL &&
+     (p->trapframe = (struct trapframe *)kalloc()) == NULL){
     freeproc(p);
     release(&p->lock);
     return NULL;
   }
 
-  p->kstack = VKSTACK;
-
   // Set up new context to start executing at forkret,
-  // which returns to user space.
+  // which returns to user space. context.sp is set once
+  // mm_attach() has picked the kernel stack.
   memset(&p->context, 0, sizeof(p->context));
   p->context.ra = (uint64)forkret;
-  p->context.sp = p->kstack + PGSIZE;
 
-  // below
-  for(int i = 0; i < NVMA; ++i) {
-    p->vma[i].valid = 0;
-  }
+  p->utime = p->stime = 0;
+  p->cutime = p->cstime = 0;
 
   return p;
 }
 
+// Give p its address space; see mm_attach().
+static int
+proc_attach(struct proc *p, struct mm *mm)
+{
+  if(mm_attach(mm, p) < 0)
+    return -1;
+  p->context.sp = p->kstack + PGSIZE;
+  return 0;
+}
+
 // free a proc structure and the data hanging from it,
-// including user pages.
+// including user pages, and return it to the free list.
+// It must already be off its parent's or leader's list.
 // p->lock must be held.
 void
 freeproc(struct proc *p)
 {
+  if(p->mm)
+    mm_detach(p, 1);
+  if(p->kfn){
+    kstack_free((void*)p->kstack);
+    p->kstack = 0;
+    p->kfn = NULL;
+  }
   if(p->trapframe)
-    kfree((void*)p->trapframe);
+    pcache_put(&trapframe_cache, p->trapframe);
   p->trapframe = 0;
-  if (p->kpagetable) {
-    kvmfree(p->kpagetable, 1);
-  }
-  p->kpagetable = 0;
-  if(p->pagetable)
-    proc_freepagetable(p->pagetable, p->sz);
-  p->pagetable = 0;
-  p->sz = 0;
-  p->pid = 0;
+  p->tgid = 0;
+  p->autoreap = 0;
+  p->group_exit = 0;
   p->parent = 0;
   p->name[0] = 0;
   p->chan = 0;
   p->killed = 0;
   p->xstate = 0;
   p->state = UNUSED;
-
-  // below
-  for(int i = 0; i < NVMA; ++i) {
-    p->vma[i].valid = 0;
-  }
-}
-
-// Create a user page table for a given process,
-// with no user memory, but with trampoline pages.
-pagetable_t
-proc_pagetable(struct proc *p)
-{
-  pagetable_t pagetable;
-
-  // An empty page table.
-  pagetable = uvmcreate();
-  if(pagetable == 0)
-    return NULL;
-
-  // map the trampoline code (for system call return)
-  // at the highest user virtual address.
-  // only the supervisor uses it, on the way
-  // to/from user space, so not PTE_U.
-  if(mappages(pagetable, TRAMPOLINE, PGSIZE,
-              (uint64)trampoline, PTE_R | PTE_X) < 0){
-    uvmfree(pagetable, 0);
-    return NULL;
-  }
-
-  // map the trapframe just below TRAMPOLINE, for trampoline.S.
-  if(mappages(pagetable, TRAPFRAME, PGSIZE,
-              (uint64)(p->trapframe), PTE_R | PTE_W) < 0){
-    vmunmap(pagetable, TRAMPOLINE, 1, 0);
-    uvmfree(pagetable, 0);
-    return NULL;
-  }
-
-  return pagetable;
-}
-
-// Free a process's page table, and free the
-// physical memory it refers to.
-void
-proc_freepagetable(pagetable_t pagetable, uint64 sz)
-{
-  vmunmap(pagetable, TRAMPOLINE, 1, 0);
-  vmunmap(pagetable, TRAPFRAME, 1, 0);
-  uvmfree(pagetable, sz);
+  releasepid(p);
 }
 
 // a user program that calls exec("/init")
@@ -299,13 +332,20 @@ userinit(void)
 {
   struct proc *p;
 
+  struct mm *mm;
+
   p = allocproc();
   initproc = p;
+  if((mm = mm_alloc()) == NULL || proc_attach(p, mm) < 0)
+    panic("userinit");
+  mm_put(mm);
+  if((p->files = fdtable_alloc()) == NULL)
+    panic("userinit");
   
   // allocate one user page and copy init's instructions
   // and data into it.
-  uvminit(p->pagetable , p->kpagetable, initcode, sizeof(initcode));
-  p->sz = PGSIZE;
+  uvminit(mm->pagetable, mm->kpagetable, initcode, sizeof(initcode));
+  mm->sz = PGSIZE;
 
   // prepare for the very first "return" from kernel to user.
   p->trapframe->epc = 0x0;      // user program counter
@@ -313,11 +353,12 @@ userinit(void)
 
   safestrcpy(p->name, "initcode", sizeof(p->name));
 
-  p->state = RUNNABLE;
-
+  // left USED: kinit_fs() starts it once the file system is up.
   p->tmask = 0;
 
   release(&p->lock);
+  if(kthread_create(kinit_fs, 0, "kinit") == NULL)
+    panic("userinit");
   #ifdef DEBUG
   printf("userinit\n");
   #endif
@@ -329,17 +370,21 @@ int
 growproc(int n)
 {
   uint sz;
-  struct proc *p = myproc();
+  struct mm *mm = myproc()->mm;
 
-  sz = p->sz;
+  acquiresleep(&mm->lock);
+  sz = mm->sz;
   if(n > 0){
-    if((sz = uvmalloc(p->pagetable, p->kpagetable, sz, sz + n)) == 0) {
+    if((sz = uvmalloc(mm->pagetable, mm->kpagetable, sz, sz + n)) == 0) {
+      releasesleep(&mm->lock);
       return -1;
     }
   } else if(n < 0){
-    sz = uvmdealloc(p->pagetable, p->kpagetable, sz, sz + n);
+    sz = uvmdealloc(mm->pagetable, mm->kpagetable, sz, sz + n);
+    mm_flush_tlb(mm);
   }
-  p->sz = sz;
+  mm->sz = sz;
+  releasesleep(&mm->lock);
   return 0;
 }
 
@@ -348,85 +393,26 @@ growproc(int n)
 int
 fork(void)
 {
-  int i, pid;
-  struct proc *np;
-  struct proc *p = myproc();
-
-  // Allocate process.
-  if((np = allocproc()) == NULL){
-    return -1;
-  }
-
-  // Copy user memory from parent to child.
-  if(uvmcopy(p->pagetable, np->pagetable, np->kpagetable, p->sz) < 0){
-    freeproc(np);
-    release(&np->lock);
-    return -1;
-  }
-  np->sz = p->sz;
-
-  np->parent = p;
-
-  // copy tracing mask from parent.
-  np->tmask = p->tmask;
-
-  // copy saved user registers.
-  *(np->trapframe) = *(p->trapframe);
-
-  // Cause fork to return 0 in the child.
-  np->trapframe->a0 = 0;
-
-  // increment reference counts on open file descriptors.
-  for(i = 0; i < NOFILE; i++)
-    if(p->ofile[i])
-      np->ofile[i] = filedup(p->ofile[i]);
-  np->cwd = edup(p->cwd);
-
-  safestrcpy(np->name, p->name, sizeof(p->name));
-
-  pid = np->pid;
-
-  np->state = RUNNABLE;
-
-  // below
-  for(int i = 0; i < NVMA; ++i) {
-    if(p->vma[i].valid) {
-      np->vma[i] = p->vma[i];
-      if(np->vma[i].vm_file) {
-        filedup(np->vma[i].vm_file);
-      }
-    }
-  }
-
-  release(&np->lock);
-
-  return pid;
+  return clone(SIGCHLD, 0, 0, 0, 0);
 }
 
 // Pass p's abandoned children to init.
-// Caller must hold p->lock.
+// Caller must hold wait_lock.
 void
 reparent(struct proc *p)
 {
   struct proc *pp;
 
-  for(pp = proc; pp < &proc[NPROC]; pp++){
-    // this code uses pp->parent without holding pp->lock.
-    // acquiring the lock first could cause a deadlock
-    // if pp or a child of pp were also in exit()
-    // and about to try to lock p.
-    if(pp->parent == p){
-      // pp->parent can't change between the check and the acquire()
-      // because only the parent changes it, and we're the parent.
-      acquire(&pp->lock);
-      pp->parent = initproc;
-      // we should wake up init here, but that would require
-      // initproc->lock, which would be a deadlock, since we hold
-      // the lock on one of init's children (pp). this is why
-      // exit() always wakes init (before acquiring any locks).
-      release(&pp->lock);
-    }
+  if(p->children == NULL)
+    return;
+  while((pp = p->children) != NULL){
+    p->children = pp->sibling;
+    pp->parent = initproc;
+    pp->sibling = initproc->children;
+    initproc->children = pp;
   }
+  // some of them may be zombies already.
+  wakeup(initproc);
 }
 
 // Exit the current process.  Does not return.
@@ -439,56 +425,55 @@ exit(int status)
 
   if(p == initproc)
     panic("init exiting");
+  if(p->group_exit)
+    status = p->xstate;
 
   // Close all open files.
-  for(int fd = 0; fd < NOFILE; fd++){
-    if(p->ofile[fd]){
-      struct file *f = p->ofile[fd];
-      fileclose(f);
-      p->ofile[fd] = 0;
-    }
-  }
+  fdtable_put(p->files);
+  p->files = 0;
 
   eput(p->cwd);
   p->cwd = 0;
 
-  vma_free(p);
-
-  // we might re-parent a child to init. we can't be precise about
-  // waking up init, since we can't acquire its lock once we've
-  // acquired any other proc lock. so wake up init whether that's
-  // necessary or not. init may miss this wakeup, but that seems
-  // harmless.
-  acquire(&initproc->lock);
-  wakeup1(initproc);
-  release(&initproc->lock);
+  // pthread_join() waits for this word to be cleared.
+  if(p->clear_child_tid){
+    int zero = 0;
+    if(copyout2(p->clear_child_tid, (char *)&zero, sizeof(zero)) == 0)
+      futex_wake(p->clear_child_tid, 1);
+  }
 
-  // grab a copy of p->parent, to ensure that we unlock the same
-  // parent we locked. in case our parent gives us away to init while
-  // we're waiting for the parent lock. we may then race with an
-  // exiting parent, but the result will be a harmless spurious wakeup
-  // to a dead or wrong process; proc structs are never re-allocated
-  // as anything else.
-  acquire(&p->lock);
-  struct proc *original_parent = p->parent;
-  release(&p->lock);
-  
-  // we need the parent's lock in order to wake it up from wait().
-  // the parent-then-child rule says we have to lock it first.
-  acquire(&original_parent->lock);
+  mm_release(p->mm);
 
-  acquire(&p->lock);
+  acquire(&wait_lock);
 
   // Give any children to init.
   reparent(p);
 
-  // Parent might be sleeping in wait().
-  wakeup1(original_parent);
+  if(p->autoreap){
+    // nobody waits for a thread: the scheduler frees it once
+    // we are off its kernel stack. A zombie leader is only
+    // reaped once its last thread has left the group.
+    struct proc *leader = p->group_leader;
+    struct proc **pp;
+    for(pp = &leader->threads; *pp; pp = &(*pp)->thread_next){
+      if(*pp == p){
+        *pp = p->thread_next;
+        break;
+      }
+    }
+    if(leader->threads == NULL && leader->parent)
+      wakeup(leader->parent);
+  } else {
+    // Parent might be sleeping in wait().
+    wakeup(p->parent);
+  }
+
+  acquire(&p->lock);
 
   p->xstate = status;
   p->state = ZOMBIE;
 
-  release(&original_parent->lock);
+  release(&wait_lock);
 
   // Jump into the scheduler, never to return.
   sched();
@@ -500,60 +485,101 @@ exit(int status)
 int
 wait(int wpid, uint64 addr)
 {
-  struct proc *np;
+  struct proc *np, **pp;
   int havekids, pid;
   struct proc *p = myproc();
 
-  // hold p->lock for the whole time to avoid lost
-  // wakeups from a child's exit().
-  acquire(&p->lock);
+  acquire(&wait_lock);
 
   for(;;){
-    // Scan through table looking for exited children.
+    // Scan through our children looking for exited ones; for a
+    // given pid, the hash finds it without walking the list.
     havekids = 0;
-    for(np = proc; np < &proc[NPROC]; np++){
-      // this code uses np->parent without holding np->lock.
-      // acquiring the lock first would cause a deadlock,
-      // since np might be an ancestor, and we already hold p->lock.
-      if(np->parent == p){
-        //printf("looping\n");
-        if(wpid > 0 && np -> pid != wpid) {
-          havekids = 1;
-          continue;
-        }
-        // np->parent can't change between the check and the acquire()
-        // because only the parent changes it, and we're the parent.
-        acquire(&np->lock);
+    if(wpid > 0){
+      np = findproc(wpid);
+      if(np && np->parent == p && np->pid == wpid)
         havekids = 1;
-        if(np->state == ZOMBIE){
-          // Found one.
-          pid = np->pid;
-          int status = np -> xstate << 8;
-          if(addr != 0 && copyout2(addr, (char *)&status, sizeof(status)) < 0) {
-            release(&np->lock);
-            release(&p->lock);
-            return -1;
-          }
-          freeproc(np);
+      else
+        np = NULL;
+    } else {
+      np = p->children;
+      havekids = np != NULL;
+    }
+    for(; np; np = wpid > 0 ? NULL : np->sibling){
+      // a zombie leader still answers for the threads it left.
+      acquire(&np->lock);
+      if(np->state == ZOMBIE && np->threads == NULL){
+        // Found one.
+        pid = np->pid;
+        int status = np -> xstate << 8;
+        if(addr != 0 && copyout2(addr, (char *)&status, sizeof(status)) < 0) {
           release(&np->lock);
-          release(&p->lock);
-          return pid;
+          release(&wait_lock);
+          return -1;
         }
+        p->cutime += np->utime + np->cutime;
+        p->cstime += np->stime + np->cstime;
+        for(pp = &p->children; *pp != np; pp = &(*pp)->sibling)
+          ;
+        *pp = np->sibling;
+        freeproc(np);
         release(&np->lock);
+        release(&wait_lock);
+        return pid;
       }
+      release(&np->lock);
     }
 
     // No point waiting if we don't have any children.
     if(!havekids || p->killed){
-      release(&p->lock);
+      release(&wait_lock);
       return -1;
     }
     
     // Wait for a child to exit.
-    sleep(p, &p->lock);  //DOC: wait-sleep
+    sleep(p, &wait_lock);  //DOC: wait-sleep
   }
 }
 
+// Called by each hart right before it enters scheduler().
+void
+cpu_online(void)
+{
+  __sync_fetch_and_or(&cpus_online, 1UL << cpuid());
+}
+
+// Lock-free peek used by an idle hart: is there a RUNNABLE
+// process it is allowed to run? A stale answer only costs
+// one more trip around the scheduler loop.
+static int
+runnable_for(uint64 me)
+{
+  struct proc *p;
+
+  for_each_proc(p)
+    if(p->state == RUNNABLE && (p->cpumask & me))
+      return 1;
+  return 0;
+}
+
+// Send an IPI to idle harts in mask so that they rescan
+// the process list. One hart is enough for a process that
+// can run anywhere; the others keep sleeping.
+static void
+kick_idle(uint64 mask)
+{
+  uint64 idle, target;
+
+  if(mask == 0)
+    return;
+  __sync_synchronize();
+  idle = cpus_idle & mask & ~(1UL << cpuid());
+  if(idle == 0)
+    return;
+  target = idle & -idle;
+  sbi_send_ipi(&target);
+}
+
 // Per-CPU process scheduler.
 // Each CPU calls scheduler() after setting itself up.
 // Scheduler never returns.  It loops, doing:
@@ -568,26 +594,40 @@ scheduler(void)
   struct cpu *c = mycpu();
   extern pagetable_t kernel_pagetable;
 
+  uint64 me = 1UL << cpuid();
+
   c->proc = 0;
   for(;;){
     // Avoid deadlock by ensuring that devices can interrupt.
     intr_on();
     
     int found = 0;
-    for(p = proc; p < &proc[NPROC]; p++) {
+    for_each_proc(p) {
+      if((p->cpumask & me) == 0)
+        continue;
       acquire(&p->lock);
-      if(p->state == RUNNABLE) {
+      if(p->state == RUNNABLE && (p->cpumask & me)) {
         // Switch to chosen process.  It is the process's job
         // to release its lock and then reacquire it
         // before jumping back to us.
         // printf("[scheduler]found runnable proc with pid: %d\n", p->pid);
+        // Kernel threads have no mm and run on kernel_pagetable.
+        int user = p->mm != NULL;
         p->state = RUNNING;
         c->proc = p;
-        w_satp(MAKE_SATP(p->kpagetable));
-        sfence_vma();
+        if(user){
+          w_satp(MAKE_SATP(p->mm->kpagetable));
+          sfence_vma();
+        }
+        p->tstamp = r_time();
         swtch(&c->context, &p->context);
-        w_satp(MAKE_SATP(kernel_pagetable));
-        sfence_vma();
+        acct_charge(p, 0);
+        if(user){
+          w_satp(MAKE_SATP(kernel_pagetable));
+          sfence_vma();
+        }
+        if(p->state == ZOMBIE && p->autoreap)
+          freeproc(p);
         // Process is done running for now.
         // It should have changed its p->state before coming back.
         c->proc = 0;
@@ -597,8 +637,25 @@ scheduler(void)
       release(&p->lock);
     }
     if(found == 0) {
-      intr_on();
+      // Nothing to run: stop the periodic tick and sleep until
+      // an hrtimer or a device interrupt. wfi wakes up on a
+      // pending interrupt even with SIE clear; it is taken once
+      // the loop turns interrupts back on.
+      intr_off();
+      __sync_fetch_and_or(&cpus_idle, me);
+      __sync_synchronize();
+      // A wakeup() that ran before our bit became visible did
+      // not kick us; look once more before going to sleep.
+      if(runnable_for(me)){
+        __sync_fetch_and_and(&cpus_idle, ~me);
+        continue;
+      }
+      timer_idle_enter();
+      uint64 idle_start = r_time();
       asm volatile("wfi");
+      c->stat.idle += r_time() - idle_start;
+      __sync_fetch_and_and(&cpus_idle, ~me);
+      timer_idle_exit();
     }
   }
 }
@@ -625,11 +682,77 @@ sched(void)
   if(intr_get())
     panic("sched interruptible");
 
+  fp_save(p);
   intena = mycpu()->intena;
   swtch(&p->context, &mycpu()->context);
   mycpu()->intena = intena;
 }
 
+// Lazy FP switching. A process starts with sstatus.FS Off and
+// gets its registers loaded by fp_trap() on its first FP
+// instruction. They then stay in the hart until another
+// process loads its own there: the state is live when
+// mycpu()->fpowner == p and p->fpcpu == cpuid(). Integer-only
+// processes never take the trap and are never saved.
+
+// Write p's FP registers back to p->fp if p changed them since
+// they were loaded. p must be running on this hart.
+void
+fp_save(struct proc *p)
+{
+  push_off();
+  uint64 x = r_sstatus();
+  if((x & SSTATUS_FS) == SSTATUS_FS_DIRTY){
+    fpsave(&p->fp);
+    w_sstatus((x & ~SSTATUS_FS) | SSTATUS_FS_CLEAN);
+  }
+  pop_off();
+}
+
+// exec(): drop the old image's FP state, whether saved or live.
+void
+fp_reset(struct proc *p)
+{
+  push_off();
+  w_sstatus(r_sstatus() & ~SSTATUS_FS);
+  memset(&p->fp, 0, sizeof(p->fp));
+  p->fpcpu = -1;
+  pop_off();
+}
+
+// Illegal instruction from user mode, interrupts off. If it is
+// because FS is Off, load p's FP state into this hart and
+// return 1 so the instruction is retried.
+int
+fp_trap(struct proc *p)
+{
+  uint64 x = r_sstatus();
+
+  if((x & SSTATUS_FS) != SSTATUS_FS_OFF)
+    return 0;
+  w_sstatus(x | SSTATUS_FS_CLEAN);
+  fprestore(&p->fp);
+  w_sstatus((r_sstatus() & ~SSTATUS_FS) | SSTATUS_FS_CLEAN);
+  mycpu()->fpowner = p;
+  p->fpcpu = cpuid();
+  return 1;
+}
+
+// Set sstatus.FS for the return to user mode, interrupts off:
+// Off unless this hart's FP registers hold p's state.
+void
+fp_userret(struct proc *p)
+{
+  uint64 x = r_sstatus();
+
+  if(mycpu()->fpowner == p && p->fpcpu == cpuid()){
+    if((x & SSTATUS_FS) == SSTATUS_FS_OFF)
+      w_sstatus(x | SSTATUS_FS_CLEAN);
+  } else if(x & SSTATUS_FS){
+    w_sstatus(x & ~SSTATUS_FS);
+  }
+}
+
 // Give up the CPU for one scheduling round.
 void
 yield(void)
@@ -647,22 +770,81 @@ void
 forkret(void)
 {
   // printf("run in forkret\n");
-  static int first = 1;
 
   // Still holding p->lock from scheduler.
   release(&myproc()->lock);
 
-  if (first) {
-    // File system initialization must be run in the context of a
-    // regular process (e.g., because it calls sleep), and thus cannot
-    // be run from main().
-    // printf("[forkret]first scheduling\n");
-    first = 0;
-    fat32_init();
-    myproc()->cwd = ename("/");
+  usertrapret();
+}
+
+// A kernel thread's first scheduling lands here.
+static void
+kthread_start(void)
+{
+  struct proc *p = myproc();
+
+  // Still holding p->lock from scheduler.
+  release(&p->lock);
+  p->kfn(p->karg);
+  kthread_exit();
+}
+
+// Create a kernel thread running fn(arg). It has no address
+// space or trapframe: it runs on kernel_pagetable with a
+// kalloc()ed stack, and is freed by the scheduler once it
+// returns or calls kthread_exit(). Returns NULL if out of memory.
+struct proc*
+kthread_create(void (*fn)(void *), void *arg, char *name)
+{
+  struct proc *p;
+  char *stack;
+
+  if((p = allocproc()) == NULL)
+    return NULL;
+  pcache_put(&trapframe_cache, p->trapframe);
+  p->trapframe = 0;
+  if((stack = kstack_alloc()) == NULL){
+    freeproc(p);
+    release(&p->lock);
+    return NULL;
   }
+  p->kstack = (uint64)stack;
+  p->kfn = fn;
+  p->karg = arg;
+  p->autoreap = 1;
+  p->context.ra = (uint64)kthread_start;
+  p->context.sp = p->kstack + PGSIZE;
+  safestrcpy(p->name, name, sizeof(p->name));
+  p->state = RUNNABLE;
+  release(&p->lock);
+  kick_idle(p->cpumask);
+  return p;
+}
 
-  usertrapret();
+void
+kthread_exit(void)
+{
+  struct proc *p = myproc();
+
+  acquire(&p->lock);
+  p->state = ZOMBIE;
+  sched();
+  panic("zombie kthread");
+}
+
+// File system initialization must be run in the context of a
+// process (e.g., because it calls sleep), and thus cannot be
+// run from main(). init is held back until it is done.
+static void
+kinit_fs(void *arg)
+{
+  fat32_init();
+  initproc->cwd = ename("/");
+
+  acquire(&initproc->lock);
+  initproc->state = RUNNABLE;
+  release(&initproc->lock);
+  kick_idle(initproc->cpumask);
 }
 
 // Atomically release lock and sleep on chan.
@@ -705,50 +887,153 @@ void
 wakeup(void *chan)
 {
   struct proc *p;
+  uint64 mask = 0;
 
-  for(p = proc; p < &proc[NPROC]; p++) {
+  for_each_proc(p) {
     acquire(&p->lock);
     if(p->state == SLEEPING && p->chan == chan) {
       p->state = RUNNABLE;
+      mask |= p->cpumask;
     }
     release(&p->lock);
   }
+  kick_idle(mask);
 }
 
-// Wake up p if it is sleeping in wait(); used by exit().
-// Caller must hold p->lock.
+// Mark p killed and get it out of sleep(). p->lock must be held.
 static void
-wakeup1(struct proc *p)
+killone(struct proc *p)
 {
-  if(!holding(&p->lock))
-    panic("wakeup1");
-  if(p->chan == p && p->state == SLEEPING) {
+  if(p->state == UNUSED || p->state == ZOMBIE)
+    return;
+  p->killed = 1;
+  if(p->state == SLEEPING){
+    // Wake process from sleep().
     p->state = RUNNABLE;
+    kick_idle(p->cpumask);
   }
 }
 
-// Kill the process with the given pid.
+// Kill the process with the given pid, with all its threads.
 // The victim won't exit until it tries to return
 // to user space (see usertrap() in trap.c).
 int
 kill(int pid)
 {
-  struct proc *p;
+  struct proc *p, *t;
 
-  for(p = proc; p < &proc[NPROC]; p++){
-    acquire(&p->lock);
-    if(p->pid == pid){
-      p->killed = 1;
-      if(p->state == SLEEPING){
-        // Wake process from sleep().
-        p->state = RUNNABLE;
-      }
-      release(&p->lock);
-      return 0;
-    }
+  if((p = findproc(pid)) == NULL)
+    return -1;
+  acquire(&wait_lock);
+  if(p->pid != pid){
+    // exited meanwhile.
+    release(&wait_lock);
+    return -1;
+  }
+  p = p->group_leader;
+  if(p->kfn){
+    // kernel threads can't be killed.
+    release(&wait_lock);
+    return -1;
+  }
+  acquire(&p->lock);
+  killone(p);
+  release(&p->lock);
+  for(t = p->threads; t; t = t->thread_next){
+    acquire(&t->lock);
+    killone(t);
+    release(&t->lock);
+  }
+  release(&wait_lock);
+  return 0;
+}
+
+// Restrict thread pid (0 for the caller) to the harts in mask.
+// Harts that are not online are dropped; an empty result is an
+// error. A thread running elsewhere moves at its next yield().
+int
+setaffinity(int pid, uint64 mask)
+{
+  struct proc *p = myproc();
+
+  mask &= cpus_online;
+  if(mask == 0)
+    return -1;
+  if(pid != 0 && (p = findproc(pid)) == NULL)
+    return -1;
+  acquire(&p->lock);
+  if(p->state == UNUSED || (pid != 0 && p->pid != pid)){
     release(&p->lock);
+    return -1;
   }
-  return -1;
+  p->cpumask = mask;
+  release(&p->lock);
+  if(p == myproc() && (mask & (1UL << cpuid())) == 0)
+    yield();
+  else
+    kick_idle(mask);
+  return 0;
+}
+
+int
+getaffinity(int pid, uint64 *mask)
+{
+  struct proc *p = myproc();
+
+  if(pid != 0 && (p = findproc(pid)) == NULL)
+    return -1;
+  acquire(&p->lock);
+  if(p->state == UNUSED || (pid != 0 && p->pid != pid)){
+    release(&p->lock);
+    return -1;
+  }
+  *mask = p->cpumask & cpus_online;
+  release(&p->lock);
+  return 0;
+}
+
+// Kill the other threads of p's thread group, for exit_group()
+// and exec(). With group_exit, the leader will report status
+// to its parent.
+static void
+kill_group(struct proc *p, int group_exit, int status)
+{
+  struct proc *leader, *t;
+
+  acquire(&wait_lock);
+  leader = p->group_leader;
+  if(leader != p){
+    acquire(&leader->lock);
+    if(group_exit && leader->state != ZOMBIE){
+      leader->group_exit = 1;
+      leader->xstate = status;
+    }
+    killone(leader);
+    release(&leader->lock);
+  }
+  for(t = leader->threads; t; t = t->thread_next){
+    if(t == p)
+      continue;
+    acquire(&t->lock);
+    killone(t);
+    release(&t->lock);
+  }
+  release(&wait_lock);
+}
+
+void
+kill_other_threads(struct proc *p)
+{
+  kill_group(p, 0, 0);
+}
+
+// Exit every thread of the calling process. The group leader
+// reports status to the parent, whichever thread called this.
+void
+exit_group(int status)
+{
+  kill_group(myproc(), 1, status);
+  exit(status);
 }
 
 // Copy to either a user address, or kernel address,
@@ -791,6 +1076,7 @@ procdump(void)
 {
   static char *states[] = {
   [UNUSED]    "unused",
+  [USED]      "used  ",
   [SLEEPING]  "sleep ",
   [RUNNABLE]  "runble",
   [RUNNING]   "run   ",
@@ -800,14 +1086,14 @@ procdump(void)
   char *state;
 
   printf("\nPID\tSTATE\tNAME\tMEM\n");
-  for(p = proc; p < &proc[NPROC]; p++){
+  for_each_proc(p){
     if(p->state == UNUSED)
       continue;
     if(p->state >= 0 && p->state < NELEM(states) && states[p->state])
       state = states[p->state];
     else
       state = "???";
-    printf("%d\t%s\t%s\t%d", p->pid, state, p->name, p->sz);
+    printf("%d\t%s\t%s\t%d", p->pid, state, p->name, p->mm ? p->mm->sz : 0);
     printf("\n");
   }
 }
@@ -818,7 +1104,7 @@ procnum(void)
   int num = 0;
   struct proc *p;
 
-  for (p = proc; p < &proc[NPROC]; p++) {
+  for_each_proc(p) {
     if (p->state != UNUSED) {
       num++;
     }
@@ -827,6 +1113,67 @@ procnum(void)
   return num;
 }
 
+// Charge the time since p->tstamp to p and to this hart,
+// as user time if user is set, as system time otherwise.
+// Interrupts must be disabled.
+void
+acct_charge(struct proc *p, int user)
+{
+  uint64 now = r_time();
+  uint64 delta = now - p->tstamp;
+  struct cpu *c = mycpu();
+
+  p->tstamp = now;
+  if(user){
+    p->utime += delta;
+    c->stat.user += delta;
+  } else {
+    p->stime += delta;
+    c->stat.sys += delta;
+  }
+}
+
+// Exponentially-decaying load averages, as in Linux: every
+// LOAD_FREQ, load = load * e + active * (1 - e) in FSHIFT
+// fixed point, where e = exp(-5s / {1, 5, 15} min).
+#define EXP_1   1884
+#define EXP_5   2014
+#define EXP_15  2037
+
+static uint64
+calc_load1(uint64 load, uint64 exp, uint64 active)
+{
+  uint64 newload = load * exp + active * (FIXED_1 - exp);
+  if(active >= load)
+    newload += FIXED_1 - 1;
+  return newload / FIXED_1;
+}
+
+// hrtimer callback, in interrupt context: the count is a
+// lock-free snapshot, which is all a load average needs.
+static void
+calc_load(struct hrtimer *t)
+{
+  struct proc *p;
+  uint64 active = 0;
+
+  for_each_proc(p)
+    if(p->state == RUNNABLE || p->state == RUNNING)
+      active++;
+  active *= FIXED_1;
+
+  avenrun[0] = calc_load1(avenrun[0], EXP_1, active);
+  avenrun[1] = calc_load1(avenrun[1], EXP_5, active);
+  avenrun[2] = calc_load1(avenrun[2], EXP_15, active);
+}
+
+void
+loadavg(uint64 loads[3])
+{
+  for(int i = 0; i < 3; i++)
+    loads[i] = avenrun[i];
+}
+
 #include "include/types.h"
 #include "include/riscv.h"
 #include "include/param.h"
@@ -843,29 +1190,61 @@ procnum(void)
 #include "include/printf.h"
 #include "include/vm.h"
 
+// Create a new thread or process, per Linux clone(2).
+// stack, when non-zero, becomes the child's sp; the caller's
+// user-level wrapper finds the function to run there.
 int
-clone(void)
+clone(uint64 flags, uint64 stack, uint64 ptid, uint64 tls, uint64 ctid)
 {
-  int i, pid;
+  int pid;
   struct proc *np;
   struct proc *p = myproc();
+  struct mm *mm;
 
-  uint64 stack;
+  // a thread must share the address space it runs in.
+  if((flags & CLONE_THREAD) && !(flags & CLONE_VM))
+    return -1;
 
-  // Allocate process.
+  // Allocate process. It stays USED, so nobody else takes or
+  // runs it, while we attach it without np->lock: mm_attach()
+  // may sleep on mm->lock.
   if((np = allocproc()) == NULL){
     return -1;
   }
-
-  // Copy user memory from parent to child.
-  if(uvmcopy(p->pagetable, np->pagetable, np->kpagetable, p->sz) < 0){
-    freeproc(np);
-    release(&np->lock);
-    return -1;
+  release(&np->lock);
+  np->cpumask = p->cpumask;
+  fp_save(p);
+  np->fp = p->fp;
+
+  // Share or copy user memory from parent to child.
+  if(flags & CLONE_VM){
+    mm = p->mm;
+  } else if((mm = mm_dup(p->mm)) == NULL){
+    goto bad;
+  }
+  if(proc_attach(np, mm) < 0){
+    if(!(flags & CLONE_VM)){
+      vma_free(mm);
+      mm_put(mm);
+    }
+    goto bad;
+  }
+  if(!(flags & CLONE_VM))
+    mm_put(mm);
+
+  if(flags & CLONE_FILES)
+    np->files = fdtable_get(p->files);
+  else
+    np->files = fdtable_dup(p->files);
+  if(np->files == NULL){
+    mm_release(np->mm);
+    goto bad;
   }
-  np->sz = p->sz;
 
-  np->parent = p;
+  if(flags & CLONE_THREAD){
+    np->tgid = p->tgid;
+    np->autoreap = 1;
+  }
 
   // copy tracing mask from parent.
   np->tmask = p->tmask;
@@ -873,47 +1252,50 @@ clone(void)
   // copy saved user registers.
   *(np->trapframe) = *(p->trapframe);
 
-  argaddr(1, &stack);
-  if(stack != NULL) {
-    uint64 fn, arg;
-    if (copyin(p->pagetable, (char*)&fn, stack, sizeof(fn)) < 0 ||
-      copyin(p->pagetable, (char*)&arg, stack + 8, sizeof(arg)) < 0) {
-      freeproc(np);
-      release(&np->lock);
-      return -1;
-    }
-    np -> trapframe -> epc = fn;
-    np -> trapframe -> a1 = arg;
-  }
-
-  // Cause fork to return 0 in the child.
+  // Cause clone to return 0 in the child.
   np->trapframe->a0 = 0;
+  if(stack)
+    np->trapframe->sp = stack;
+  if(flags & CLONE_SETTLS)
+    np->trapframe->tp = tls;
+
+  pid = np->pid;
+  if(flags & CLONE_CHILD_CLEARTID)
+    np->clear_child_tid = ctid;
+  if(flags & CLONE_CHILD_SETTID)
+    copyout(np->mm->pagetable, ctid, (char *)&pid, sizeof(pid));
+  if(flags & CLONE_PARENT_SETTID)
+    copyout2(ptid, (char *)&pid, sizeof(pid));
 
-  // increment reference counts on open file descriptors.
-  for(i = 0; i < NOFILE; i++)
-    if(p->ofile[i])
-      np->ofile[i] = filedup(p->ofile[i]);
   np->cwd = edup(p->cwd);
 
   safestrcpy(np->name, p->name, sizeof(p->name));
 
-  pid = np->pid;
-
-  np->state = RUNNABLE;
-
-  // below
-  for(int i = 0; i < NVMA; ++i) {
-    if(p->vma[i].valid) {
-      np->vma[i] = p->vma[i];
-      if(np->vma[i].vm_file) {
-        filedup(np->vma[i].vm_file);
-      }
-    }
+  acquire(&wait_lock);
+  if(flags & CLONE_THREAD){
+    struct proc *leader = p->group_leader;
+    np->group_leader = leader;
+    np->thread_next = leader->threads;
+    leader->threads = np;
+  } else {
+    np->parent = p;
+    np->sibling = p->children;
+    p->children = np;
   }
+  release(&wait_lock);
 
+  acquire(&np->lock);
+  np->state = RUNNABLE;
   release(&np->lock);
+  kick_idle(np->cpumask);
 
   return pid;
+
+bad:
+  acquire(&np->lock);
+  freeproc(np);
+  release(&np->lock);
+  return -1;
 }
 
 uint64
@@ -0,0 +1,41 @@
+// RAM disk: a block device kept in memory, for a volume that
+// should never touch a real disk. With `make ramdisk=<image>`, a
+// FAT32 image is linked into the kernel (ramdisk_img.S) and
+// becomes ram0, ahead of the other disks, so that it is the root
+// volume.
+
+#include "include/types.h"
+#include "include/param.h"
+#include "include/riscv.h"
+#include "include/spinlock.h"
+#include "include/buf.h"
+#include "include/disk.h"
+#include "include/string.h"
+#include "include/printf.h"
+
+// Requests are done on submission, in the process that sends
+// them, like the SD card's.
+static void ramdisk_submit(struct blkreq *r)
+{
+    uchar *mem = (uchar *)blkdev_get(r->dev)->private + (uint64)r->sectorno * BSIZE;
+
+    for (int i = 0; i < r->nseg; i++) {
+        if (r->op == BLK_READ)
+            memmove(r->seg[i].addr, mem, r->seg[i].len);
+        else if (r->op == BLK_WRITE)
+            memmove(mem, r->seg[i].addr, r->seg[i].len);
+        mem += r->seg[i].len;
+    }
+    disk_complete(r, 0);
+}
+
+static int ramdisk_cost(struct blkreq *r)
+{
+    return 1;
+}
+
+// Make the nsec sectors at mem a disk.
+int ramdisk_register(char *name, uchar *mem, uint nsec)
+{
+    return disk_register(name, nsec, ramdisk_submit, ramdisk_cost, 1, mem);
+}
@@ -8,6 +8,11 @@
 #include "include/spinlock.h"
 #include "include/proc.h"
 #include "include/sleeplock.h"
+#include "include/lockstat.h"
+#include "include/timer.h"
+
+// Longest a waiter spins before it sleeps, in r_time() ticks.
+#define SLEEPLOCK_SPIN  (CLOCK_FREQ / 10000)    // 100us
 
 void
 initsleeplock(struct sleeplock *lk, char *name)
@@ -16,26 +21,78 @@ initsleeplock(struct sleeplock *lk, char *name)
   lk->name = name;
   lk->locked = 0;
   lk->pid = 0;
+  lk->owner = 0;
+  lk->cls = lock_class_get(name, 1);
+  lk->tstamp = 0;
+}
+
+// Spin, without lk->lk, while lk is held by a process running
+// on another hart. Returns, with lk->lk held again, once lk looks
+// free, its holder is sleeping, preempted or ourselves, or the
+// budget since start runs out. procs are never freed, so peeking
+// at the holder is safe.
+static void
+spinsleep(struct sleeplock *lk, uint64 start)
+{
+  struct proc *me = myproc(), *o;
+
+  release(&lk->lk);
+  while (__atomic_load_n(&lk->locked, __ATOMIC_RELAXED) &&
+         (o = __atomic_load_n(&lk->owner, __ATOMIC_RELAXED)) != 0 && o != me &&
+         __atomic_load_n(&o->state, __ATOMIC_RELAXED) == RUNNING &&
+         r_time() - start < SLEEPLOCK_SPIN)
+    ;
+  acquire(&lk->lk);
 }
 
 void
 acquiresleep(struct sleeplock *lk)
+{
+  uint64 start = 0;
+
+  acquire(&lk->lk);
+  if (lk->locked) {
+    start = r_time();
+    // adaptive: spin while the holder makes progress elsewhere
+    spinsleep(lk, start);
+    while (lk->locked) {
+      sleep(lk, &lk->lk);
+    }
+  }
+  lk->locked = 1;
+  lk->pid = myproc()->pid;
+  lk->owner = myproc();
+  lk->tstamp = r_time();
+  lockstat_acquired(lk->cls, start ? lk->tstamp - start : 0, start != 0);
+  release(&lk->lk);
+}
+
+// Take lk only if it is free. Returns 1 if it was taken.
+int
+tryacquiresleep(struct sleeplock *lk)
 {
   acquire(&lk->lk);
-  while (lk->locked) {
-    sleep(lk, &lk->lk);
+  if (lk->locked) {
+    release(&lk->lk);
+    return 0;
   }
   lk->locked = 1;
   lk->pid = myproc()->pid;
+  lk->owner = myproc();
+  lk->tstamp = r_time();
+  lockstat_acquired(lk->cls, 0, 0);
   release(&lk->lk);
+  return 1;
 }
 
 void
 releasesleep(struct sleeplock *lk)
 {
   acquire(&lk->lk);
+  lockstat_released(lk->cls, r_time() - lk->tstamp);
   lk->locked = 0;
   lk->pid = 0;
+  lk->owner = 0;
   wakeup(lk);
   release(&lk->lk);
 }
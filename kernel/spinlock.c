@@ -9,13 +9,91 @@
 #include "include/proc.h"
 #include "include/intr.h"
 #include "include/printf.h"
+#include "include/lockstat.h"
+
+// MCS queue nodes, NMCS per cpu: enough for the SPIN_MCS locks
+// one cpu can hold, or wait for, at the same time. Locks are not
+// always released in the reverse order, so a node is taken from
+// the pool rather than by nesting depth.
+#define NMCS 8
+static struct mcs_node mcs_nodes[NCPU][NMCS];
 
 void
 initlock(struct spinlock *lk, char *name)
+{
+  initlock_kind(lk, name, SPIN_TAS);
+}
+
+void
+initlock_kind(struct spinlock *lk, char *name, int kind)
 {
   lk->name = name;
   lk->locked = 0;
+  lk->kind = kind;
+  lk->next = 0;
+  lk->owner = 0;
+  lk->tail = 0;
+  lk->node = 0;
   lk->cpu = 0;
+  lk->cls = lock_class_get(name, 0);
+  lk->tstamp = 0;
+}
+
+static struct mcs_node *
+mcs_get(void)
+{
+  struct mcs_node *n = mcs_nodes[cpuid()];
+
+  for(int i = 0; i < NMCS; i++, n++){
+    if(!n->busy){
+      n->busy = 1;
+      return n;
+    }
+  }
+  panic("mcs_get");
+  return 0;
+}
+
+// Returns the time the lock was first found busy, or 0.
+static uint64
+mcs_acquire(struct spinlock *lk)
+{
+  struct mcs_node *n = mcs_get(), *prev;
+  uint64 start = 0;
+
+  n->next = 0;
+  n->wait = 1;
+  prev = __atomic_exchange_n(&lk->tail, n, __ATOMIC_ACQ_REL);
+  if(prev){
+    start = r_time();
+    __atomic_store_n(&prev->next, n, __ATOMIC_RELEASE);
+    while(__atomic_load_n(&n->wait, __ATOMIC_ACQUIRE))
+      ;
+  }
+  lk->node = n;
+  return start;
+}
+
+static void
+mcs_release(struct spinlock *lk)
+{
+  struct mcs_node *n = lk->node, *next, *expected = n;
+
+  lk->node = 0;
+  if(__atomic_load_n(&n->next, __ATOMIC_ACQUIRE) == 0){
+    // nobody queued behind us: empty the queue, unless a
+    // waiter is just now linking itself in.
+    if(__atomic_compare_exchange_n(&lk->tail, &expected, 0, 0,
+                                   __ATOMIC_RELEASE, __ATOMIC_RELAXED)){
+      n->busy = 0;
+      return;
+    }
+    while(__atomic_load_n(&n->next, __ATOMIC_ACQUIRE) == 0)
+      ;
+  }
+  next = n->next;
+  __atomic_store_n(&next->wait, 0, __ATOMIC_RELEASE);
+  n->busy = 0;
 }
 
 // Acquire the lock.
@@ -23,6 +101,8 @@ initlock(struct spinlock *lk, char *name)
 void
 acquire(struct spinlock *lk)
 {
+  uint64 start = 0;   // when we found it busy, if we did
+
   push_off(); // disable interrupts to avoid deadlock.
   if(holding(lk)) {
     
@@ -33,13 +113,35 @@ acquire(struct spinlock *lk)
     panic("acquire");
   }
 
-
-  // On RISC-V, sync_lock_test_and_set turns into an atomic swap:
-  //   a5 = 1
-  //   s1 = &lk->locked
-  //   amoswap.w.aq a5, a5, (s1)
-  while(__sync_lock_test_and_set(&lk->locked, 1) != 0)
-    ;
+  switch(lk->kind){
+  case SPIN_TICKET: {
+    // Take a ticket, then wait for it to be called: waiters get
+    // the lock in the order they arrived.
+    uint ticket = __atomic_fetch_add(&lk->next, 1, __ATOMIC_RELAXED);
+    if(__atomic_load_n(&lk->owner, __ATOMIC_ACQUIRE) != ticket){
+      start = r_time();
+      while(__atomic_load_n(&lk->owner, __ATOMIC_ACQUIRE) != ticket)
+        ;
+    }
+    lk->locked = 1;
+    break;
+  }
+  case SPIN_MCS:
+    start = mcs_acquire(lk);
+    lk->locked = 1;
+    break;
+  default:
+    // On RISC-V, sync_lock_test_and_set turns into an atomic swap:
+    //   a5 = 1
+    //   s1 = &lk->locked
+    //   amoswap.w.aq a5, a5, (s1)
+    if(__sync_lock_test_and_set(&lk->locked, 1) != 0){
+      start = r_time();
+      while(__sync_lock_test_and_set(&lk->locked, 1) != 0)
+        ;
+    }
+    break;
+  }
 
   // Tell the C compiler and the processor to not move loads or stores
   // past this point, to ensure that the critical section's memory
@@ -49,6 +151,8 @@ acquire(struct spinlock *lk)
 
   // Record info about lock acquisition for holding() and debugging.
   lk->cpu = mycpu();
+  lk->tstamp = r_time();
+  lockstat_acquired(lk->cls, start ? lk->tstamp - start : 0, start != 0);
 }
 
 // Release the lock.
@@ -58,6 +162,7 @@ release(struct spinlock *lk)
   if(!holding(lk))
     panic("release");
 
+  lockstat_released(lk->cls, r_time() - lk->tstamp);
   lk->cpu = 0;
 
   // Tell the C compiler and the CPU to not move loads or stores
@@ -68,14 +173,27 @@ release(struct spinlock *lk)
   // On RISC-V, this emits a fence instruction.
   __sync_synchronize();
 
-  // Release the lock, equivalent to lk->locked = 0.
-  // This code doesn't use a C assignment, since the C standard
-  // implies that an assignment might be implemented with
-  // multiple store instructions.
-  // On RISC-V, sync_lock_release turns into an atomic swap:
-  //   s1 = &lk->locked
-  //   amoswap.w zero, zero, (s1)
-  __sync_lock_release(&lk->locked);
+  switch(lk->kind){
+  case SPIN_TICKET:
+    // only the holder writes owner: call the next ticket.
+    lk->locked = 0;
+    __atomic_store_n(&lk->owner, lk->owner + 1, __ATOMIC_RELEASE);
+    break;
+  case SPIN_MCS:
+    lk->locked = 0;
+    mcs_release(lk);
+    break;
+  default:
+    // Release the lock, equivalent to lk->locked = 0.
+    // This code doesn't use a C assignment, since the C standard
+    // implies that an assignment might be implemented with
+    // multiple store instructions.
+    // On RISC-V, sync_lock_release turns into an atomic swap:
+    //   s1 = &lk->locked
+    //   amoswap.w zero, zero, (s1)
+    __sync_lock_release(&lk->locked);
+    break;
+  }
 
   pop_off();
 }
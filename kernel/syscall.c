@@ -11,13 +11,16 @@
 #include "include/vm.h"
 #include "include/string.h"
 #include "include/printf.h"
+#include "include/timer.h"
+#include "include/lockstat.h"
+#include "include/buf.h"
 
 // Fetch the uint64 at addr from the current process.
 int
 fetchaddr(uint64 addr, uint64 *ip)
 {
   struct proc *p = myproc();
-  if(addr >= p->sz || addr+sizeof(uint64) > p->sz)
+  if(addr >= p->mm->sz || addr+sizeof(uint64) > p->mm->sz)
     return -1;
   // if(copyin(p->pagetable, (char *)ip, addr, sizeof(*ip)) != 0)
   if(copyin2((char *)ip, addr, sizeof(*ip)) != 0)
@@ -98,6 +101,12 @@ extern uint64 sys_exit(void);
 extern uint64 sys_fork(void);
 extern uint64 sys_fstat(void);
 extern uint64 sys_getpid(void);
+extern uint64 sys_gettid(void);
+extern uint64 sys_exit_group(void);
+extern uint64 sys_set_tid_address(void);
+extern uint64 sys_futex(void);
+extern uint64 sys_sched_setaffinity(void);
+extern uint64 sys_sched_getaffinity(void);
 extern uint64 sys_kill(void);
 extern uint64 sys_mkdir(void);
 extern uint64 sys_open(void);
@@ -115,9 +124,14 @@ extern uint64 sys_getcwd(void);
 extern uint64 sys_remove(void);
 extern uint64 sys_trace(void);
 extern uint64 sys_sysinfo(void);
+extern uint64 sys_lockstat(void);
 extern uint64 sys_rename(void);
 extern uint64 sys_shutdown(void);
+extern uint64 sys_sync(void);
+extern uint64 sys_fsync(void);
+extern uint64 sys_fdatasync(void);
 extern uint64 sys_times(void);
+extern uint64 sys_getrusage(void);
 extern uint64 sys_uname(void);
 extern uint64 sys_gettimeofday(void);
 extern uint64 sys_nanosleep(void);
@@ -156,10 +170,15 @@ static uint64 (*syscalls[])(void) = {
   [SYS_remove]      sys_remove,
   [SYS_trace]       sys_trace,
   [SYS_sysinfo]     sys_sysinfo,
+  [SYS_lockstat]    sys_lockstat,
   [SYS_rename]      sys_rename,
   [SYS_shutdown]    sys_shutdown,
+  [SYS_sync]        sys_sync,
+  [SYS_fsync]       sys_fsync,
+  [SYS_fdatasync]   sys_fdatasync,
   [SYS_uname]       sys_uname,
   [SYS_times]       sys_times,
+  [SYS_getrusage]   sys_getrusage,
   [SYS_gettimeofday]sys_gettimeofday,
   [SYS_nanosleep]   sys_nanosleep,
   [SYS_clone]       sys_clone,
@@ -169,6 +188,12 @@ static uint64 (*syscalls[])(void) = {
   [SYS_brk]         sys_brk,
   [SYS_mmap]        sys_mmap,
   [SYS_munmap]      sys_munmap,
+  [SYS_gettid]      sys_gettid,
+  [SYS_exit_group]  sys_exit_group,
+  [SYS_set_tid_address] sys_set_tid_address,
+  [SYS_futex]       sys_futex,
+  [SYS_sched_setaffinity] sys_sched_setaffinity,
+  [SYS_sched_getaffinity] sys_sched_getaffinity,
 };
 
 static char *sysnames[] = {
@@ -197,10 +222,15 @@ static char *sysnames[] = {
   [SYS_remove]      "remove",
   [SYS_trace]       "trace",
   [SYS_sysinfo]     "sysinfo",
+  [SYS_lockstat]    "lockstat",
   [SYS_rename]      "rename",
   [SYS_shutdown]    "shutdown",
+  [SYS_sync]        "sync",
+  [SYS_fsync]       "fsync",
+  [SYS_fdatasync]   "fdatasync",
   [SYS_uname]       "uname",
   [SYS_times]       "times",
+  [SYS_getrusage]   "getrusage",
   [SYS_gettimeofday]"gettimeofday",
   [SYS_nanosleep]   "nanosleep",
   [SYS_clone]       "clone",
@@ -210,6 +240,12 @@ static char *sysnames[] = {
   [SYS_brk]         "brk",
   [SYS_mmap]        "mmap",
   [SYS_munmap]      "unmmap",
+  [SYS_gettid]      "gettid",
+  [SYS_exit_group]  "exit_group",
+  [SYS_set_tid_address] "set_tid_address",
+  [SYS_futex]       "futex",
+  [SYS_sched_setaffinity] "sched_setaffinity",
+  [SYS_sched_getaffinity] "sched_getaffinity",
 };
 
 void
@@ -251,8 +287,24 @@ sys_sysinfo(void)
   }
 
   struct sysinfo info;
+  memset(&info, 0, sizeof(info));
   info.freemem = freemem_amount();
   info.nproc = procnum();
+  info.uptime = r_time() / CLOCK_FREQ;
+  loadavg(info.loads);
+  // harts come up in any order; report up to the highest one online.
+  info.ncpu = 0;
+  for (int i = 0; i < NCPU; i++) {
+    if (cpus_online & (1UL << i))
+      info.ncpu = i + 1;
+  }
+  for (int i = 0; i < info.ncpu; i++) {
+    info.cpu[i].user = htick_to_usec(cpus[i].stat.user);
+    info.cpu[i].sys = htick_to_usec(cpus[i].stat.sys);
+    info.cpu[i].irq = htick_to_usec(cpus[i].stat.irq);
+    info.cpu[i].idle = htick_to_usec(cpus[i].stat.idle);
+  }
+  bcache_stat(&info.bcache);
 
   // if (copyout(p->pagetable, addr, (char *)&info, sizeof(info)) < 0) {
   if (copyout2(addr, (char *)&info, sizeof(info)) < 0) {
@@ -260,4 +312,29 @@ sys_sysinfo(void)
   }
 
   return 0;
-}
\ No newline at end of file
+}
+
+// lockstat(buf, n, reset): copy up to n struct lockstat to buf,
+// then zero the counters if reset. Returns the number copied.
+uint64
+sys_lockstat(void)
+{
+  uint64 addr;
+  int n, reset, i;
+  struct lockstat st;
+
+  if (argaddr(0, &addr) < 0 || argint(1, &n) < 0 || argint(2, &reset) < 0) {
+    return -1;
+  }
+
+  for (i = 0; i < n && lockstat_get(i, &st) == 0; i++) {
+    if (copyout2(addr + i * sizeof(st), (char *)&st, sizeof(st)) < 0) {
+      return -1;
+    }
+  }
+  if (reset) {
+    lockstat_reset();
+  }
+
+  return i;
+}
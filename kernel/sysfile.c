@@ -16,6 +16,8 @@
 #include "include/pipe.h"
 #include "include/fcntl.h"
 #include "include/fat32.h"
+#include "include/tmpfs.h"
+#include "include/buf.h"
 #include "include/syscall.h"
 #include "include/string.h"
 #include "include/printf.h"
@@ -40,8 +42,8 @@ void printofile() {
 
   printf("------ofiles:\n");
   for(fd = 0; fd < NOFILE; fd++){
-    printf("%d\n", p->ofile[fd]);
-    if(p->ofile[fd] == 0){
+    printf("%d\n", p->files->ofile[fd]);
+    if(p->files->ofile[fd] == 0){
       break;
     }
   }
@@ -49,7 +51,8 @@ void printofile() {
 }
 
 // Fetch the nth word-sized system call argument as a file descriptor
-// and return both the descriptor and the corresponding struct file.
+// and return both the descriptor and the corresponding struct file,
+// with a reference (see fget()) for the caller to fileclose().
 static int
 argfd(int n, int *pfd, struct file **pf)
 {
@@ -58,12 +61,14 @@ argfd(int n, int *pfd, struct file **pf)
 
   if(argint(n, &fd) < 0)
     return -1;
-  if(fd < 0 || fd >= NOFILE || (f=myproc()->ofile[fd]) == NULL)
+  if((f = fget(fd)) == NULL)
     return -1;
   if(pfd)
     *pfd = fd;
   if(pf)
     *pf = f;
+  else
+    fileclose(f);
   return 0;
 }
 
@@ -74,15 +79,18 @@ fdalloc(struct file *f)
 {
   //assertneq((uint64)NULL, (uint64)f);
   int fd;
-  struct proc *p = myproc();
+  struct fdtable *t = myproc()->files;
 
+  acquire(&t->lock);
   for(fd = 0; fd < NOFILE; fd++){
     //printf("loop...%d\n", fd);
-    if(p->ofile[fd] == 0){
-      p->ofile[fd] = f;
+    if(t->ofile[fd] == 0){
+      t->ofile[fd] = f;
+      release(&t->lock);
       return fd;
     }
   }
+  release(&t->lock);
   return -1;
 }
 
@@ -94,9 +102,10 @@ sys_dup(void)
 
   if(argfd(0, 0, &f) < 0)
     return -1;
-  if((fd=fdalloc(f)) < 0)
+  if((fd=fdalloc(f)) < 0){
+    fileclose(f);
     return -1;
-  filedup(f);
+  }
   return fd;
 }
 
@@ -104,27 +113,29 @@ uint64
 sys_read(void)
 {
   struct file *f;
-  int n;
+  int n, ret;
   uint64 p;
 
-  if(argfd(0, 0, &f) < 0 || argint(2, &n) < 0 || argaddr(1, &p) < 0)
+  if(argint(2, &n) < 0 || argaddr(1, &p) < 0 || argfd(0, 0, &f) < 0)
     return -1;
   
   int fdd;
   argint(0, &fdd);  
   //printf("%d in read\n", fdd);
 
-  return fileread(f, p, n);
+  ret = fileread(f, p, n);
+  fileclose(f);
+  return ret;
 }
 
 uint64
 sys_write(void)
 {
   struct file *f;
-  int n;
+  int n, ret;
   uint64 p;
 
-  if(argfd(0, 0, &f) < 0 || argint(2, &n) < 0 || argaddr(1, &p) < 0)
+  if(argint(2, &n) < 0 || argaddr(1, &p) < 0 || argfd(0, 0, &f) < 0)
     return -1;
 
   
@@ -132,7 +143,9 @@ sys_write(void)
   argint(0, &fdd);  
   //printf("%d in write\n", fdd);
   
-  return filewrite(f, p, n);
+  ret = filewrite(f, p, n);
+  fileclose(f);
+  return ret;
 }
 
 uint64
@@ -141,9 +154,18 @@ sys_close(void)
   int fd;
   struct file *f;
 
-  if(argfd(0, &fd, &f) < 0)
+  struct fdtable *t = myproc()->files;
+
+  if(argint(0, &fd) < 0 || fd < 0 || fd >= NOFILE)
     return -1;
-  myproc()->ofile[fd] = 0;
+  // another thread may close the same fd concurrently.
+  acquire(&t->lock);
+  if((f = t->ofile[fd]) == NULL){
+    release(&t->lock);
+    return -1;
+  }
+  t->ofile[fd] = 0;
+  release(&t->lock);
   fileclose(f);
   return 0;
 }
@@ -154,9 +176,99 @@ sys_fstat(void)
   struct file *f;
   uint64 st; // user pointer to struct stat
 
-  if(argfd(0, 0, &f) < 0 || argaddr(1, &st) < 0)
+  int ret;
+
+  if(argaddr(1, &st) < 0 || argfd(0, 0, &f) < 0)
+    return -1;
+  ret = filestat(f, st);
+  fileclose(f);
+  return ret;
+}
+
+static int
+fsync1(int datasync)
+{
+  struct file *f;
+
+  int ret = 0;
+
+  if(argfd(0, 0, &f) < 0)
+    return -1;
+  if(f->type == FD_ENTRY){
+    elock(f->ep);
+    esync(f->ep, datasync);
+    eunlock(f->ep);
+  } else if(f->type != FD_TMPFS)
+    ret = -1;
+  fileclose(f);
+  return ret;
+}
+
+uint64
+sys_fsync(void)
+{
+  return fsync1(0);
+}
+
+uint64
+sys_fdatasync(void)
+{
+  return fsync1(1);
+}
+
+uint64
+sys_sync(void)
+{
+  fat32_sync();
+  bsync();
+  return 0;
+}
+
+// If path names something in tmpfs, the part after "/tmp";
+// else 0. A relative path can only be in tmpfs from the root.
+static char*
+tmpath(char *path)
+{
+  if(path[0] != '/' && myproc()->cwd->parent != NULL)
+    return 0;
+  return tmpfs_path(path);
+}
+
+// Open the tmpfs file at path (after "/tmp").
+static int
+topen(char *path, int omode)
+{
+  struct tnode *t;
+  struct file *f;
+  int fd;
+
+  if(omode & O_CREATE)
+    t = tcreate(path, T_FILE);
+  else
+    t = tname(path);
+  if(t == NULL)
+    return -1;
+  if(t->type == T_DIR && (omode & (O_WRONLY | O_RDWR))){
+    tput(t);
     return -1;
-  return filestat(f, st);
+  }
+  if((f = filealloc()) == NULL || (fd = fdalloc(f)) < 0){
+    if(f)
+      fileclose(f);
+    tput(t);
+    return -1;
+  }
+  tlock(t);
+  if(t->type == T_FILE && (omode & O_TRUNC))
+    ttrunc(t);
+  f->off = (omode & O_APPEND) ? t->size : 0;
+  tunlock(t);
+  f->type = FD_TMPFS;
+  f->tn = t;
+  f->ep = 0;
+  f->readable = !(omode & O_WRONLY);
+  f->writable = (omode & O_WRONLY) || (omode & O_RDWR);
+  return fd;
 }
 
 static struct dirent*
@@ -208,6 +320,8 @@ sys_open(void)
 
   if(argstr(0, path, FAT32_MAX_PATH) < 0 || argint(1, &omode) < 0)
     return -1;
+  if(tmpath(path))
+    return topen(tmpath(path), omode);
 
   if(omode & O_CREATE){
     ep = create(path, T_FILE, omode);
@@ -255,8 +369,17 @@ sys_mkdir(void)
 {
   char path[FAT32_MAX_PATH];
   struct dirent *ep;
+  struct tnode *t;
 
-  if(argstr(0, path, FAT32_MAX_PATH) < 0 || (ep = create(path, T_DIR, 0)) == 0){
+  if(argstr(0, path, FAT32_MAX_PATH) < 0)
+    return -1;
+  if(tmpath(path)){
+    if((t = tcreate(tmpath(path), T_DIR)) == NULL)
+      return -1;
+    tput(t);
+    return 0;
+  }
+  if((ep = create(path, T_DIR, 0)) == 0){
     return -1;
   }
   eunlock(ep);
@@ -271,7 +394,8 @@ sys_chdir(void)
   struct dirent *ep;
   struct proc *p = myproc();
   
-  if(argstr(0, path, FAT32_MAX_PATH) < 0 || (ep = ename(path)) == NULL){
+  // the cwd is a FAT directory: there is no changing into tmpfs.
+  if(argstr(0, path, FAT32_MAX_PATH) < 0 || tmpath(path) || (ep = ename(path)) == NULL){
     return -1;
   }
   elock(ep);
@@ -300,8 +424,11 @@ sys_pipe(void)
     return -1;
   fd0 = -1;
   if((fd0 = fdalloc(rf)) < 0 || (fd1 = fdalloc(wf)) < 0){
-    if(fd0 >= 0)
-      p->ofile[fd0] = 0;
+    if(fd0 >= 0){
+      acquire(&p->files->lock);
+      p->files->ofile[fd0] = 0;
+      release(&p->files->lock);
+    }
     fileclose(rf);
     fileclose(wf);
     return -1;
@@ -310,8 +437,10 @@ sys_pipe(void)
   //    copyout(p->pagetable, fdarray+sizeof(fd0), (char *)&fd1, sizeof(fd1)) < 0){
   if(copyout2(fdarray, (char*)&fd0, sizeof(fd0)) < 0 ||
      copyout2(fdarray+sizeof(fd0), (char *)&fd1, sizeof(fd1)) < 0){
-    p->ofile[fd0] = 0;
-    p->ofile[fd1] = 0;
+    acquire(&p->files->lock);
+    p->files->ofile[fd0] = 0;
+    p->files->ofile[fd1] = 0;
+    release(&p->files->lock);
     fileclose(rf);
     fileclose(wf);
     return -1;
@@ -361,9 +490,13 @@ sys_readdir(void)
   struct file *f;
   uint64 p;
 
-  if(argfd(0, 0, &f) < 0 || argaddr(1, &p) < 0)
+  int ret;
+
+  if(argaddr(1, &p) < 0 || argfd(0, 0, &f) < 0)
     return -1;
-  return dirnext(f, p);
+  ret = dirnext(f, p);
+  fileclose(f);
+  return ret;
 }
 
 // get absolute cwd string
@@ -442,6 +575,8 @@ sys_remove(void)
   if (s >= path && *s == '.' && (s == path || *--s == '/')) {
     return -1;
   }
+  if (tmpath(path))
+    return tremove(tmpath(path));
   
   if((ep = ename(path)) == NULL){
     return -1;
@@ -470,6 +605,11 @@ sys_rename(void)
   if (argstr(0, old, FAT32_MAX_PATH) < 0 || argstr(1, new, FAT32_MAX_PATH) < 0) {
       return -1;
   }
+  if (tmpath(old) || tmpath(new)) {
+    if (!tmpath(old) || !tmpath(new))
+      return -1;        // across file systems
+    return trename(tmpath(old), tmpath(new));
+  }
 
   struct dirent *src = NULL, *dst = NULL, *pdst = NULL;
   int srclock = 0;
@@ -605,17 +745,24 @@ int get_path(char* path, int fd) {
   }
   // 相对于指定的 fd 定位
   else {
-    if (fd < 0 || fd >= NOFILE) {
-      return -1;
+    struct file* f = fget(fd);
+    int bad = 0;
+    if (f != NULL && f->type == FD_TMPFS && f->tn->type == T_DIR) {
+      bad = tabspath(f->tn, base_path, FAT32_MAX_PATH) < 0;
     }
-    struct file* f = myproc()->ofile[fd];
-    if (f == NULL || !(f->ep->attribute & ATTR_DIRECTORY)) {
-      return -1;
+    else if (f == NULL || f->type != FD_ENTRY || !(f->ep->attribute & ATTR_DIRECTORY)) {
+      bad = 1;
+    }
+    else {
+      bad = get_abspath(f->ep, base_path, FAT32_MAX_PATH) < 0;
     }
-    base_de = f->ep;
+    if (f != NULL)
+      fileclose(f);
+    if (bad)
+      return -1;
   }
   // 获取绝对路径
-  if (get_abspath(base_de, base_path, FAT32_MAX_PATH) < 0) {
+  if (base_de != NULL && get_abspath(base_de, base_path, FAT32_MAX_PATH) < 0) {
     return -1;
   }
   // 使用一个临时缓冲区来安全地拼接最终路径
@@ -655,6 +802,7 @@ uint64 sys_openat(void) {
   }
 
   if(get_path(path, dirfd) < 0) return -1;
+  if(tmpath(path)) return topen(tmpath(path), flags);
 
   //printf("%d\n", O_CREATE | O_RDWR);
   //printf("%d\n", flags);
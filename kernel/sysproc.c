@@ -11,6 +11,11 @@
 #include "include/string.h"
 #include "include/printf.h"
 #include "include/sbi.h"
+#include "include/intr.h"
+#include "include/futex.h"
+#include "include/sleeplock.h"
+#include "include/buf.h"
+#include "include/fat32.h"
 
 extern int exec(char *path, char **argv);
 
@@ -62,16 +67,48 @@ sys_exit(void)
   int n;
   if(argint(0, &n) < 0)
     return -1;
+  // the leader leaving takes the whole process with it; other
+  // threads leave alone, as from pthread_exit().
+  if(myproc()->pid == myproc()->tgid)
+    exit_group(n);
   exit(n);
   return 0;  // not reached
 }
 
+uint64
+sys_exit_group(void)
+{
+  int n;
+  if(argint(0, &n) < 0)
+    return -1;
+  exit_group(n);
+  return 0;  // not reached
+}
+
 uint64
 sys_getpid(void)
+{
+  return myproc()->tgid;
+}
+
+uint64
+sys_gettid(void)
 {
   return myproc()->pid;
 }
 
+// Set the word that exit() clears; returns the caller's tid.
+uint64
+sys_set_tid_address(void)
+{
+  uint64 tidptr;
+
+  if(argaddr(0, &tidptr) < 0)
+    return -1;
+  myproc()->clear_child_tid = tidptr;
+  return myproc()->pid;
+}
+
 uint64
 sys_fork(void)
 {
@@ -86,7 +123,7 @@ sys_sbrk(void)
 
   if(argint(0, &n) < 0)
     return -1;
-  addr = myproc()->sz;
+  addr = myproc()->mm->sz;
   if(growproc(n) < 0)
     return -1;
   return addr;
@@ -96,21 +133,12 @@ uint64
 sys_sleep(void)
 {
   int n;
-  uint ticks0;
 
   if(argint(0, &n) < 0)
     return -1;
-  acquire(&tickslock);
-  ticks0 = ticks;
-  while(ticks - ticks0 < n){
-    if(myproc()->killed){
-      release(&tickslock);
-      return -1;
-    }
-    sleep(&ticks, &tickslock);
-  }
-  release(&tickslock);
-  return 0;
+  if(n <= 0)
+    return 0;
+  return hrtimer_sleep_until(r_time() + (uint64)n * INTERVAL);
 }
 
 uint64
@@ -149,6 +177,8 @@ sys_trace(void)
 
 uint64
 sys_shutdown(void) {
+    fat32_sync();
+    bsync();
     sbi_shutdown();
     return 0;
 }
@@ -189,22 +219,69 @@ sys_shutdown(void) {
 }
 
 /**
- * @brief 实现 times 系统调用，返回自启动以来经过的操作系统 tick 数。
+ * @brief 实现 times 系统调用，返回当前进程及已回收子进程的用户态/系统态时间。
  * @param addr tms 结构体存到的目标地址
- * @return 0 成功，-1 失败
+ * @return 自启动以来经过的时间（CLK_TCK 为单位），-1 失败
  */
  #include "include/timer.h"
  uint64 sys_times(void) {
   struct tms tms;
+  struct proc *p = myproc();
 
-  acquire(&tickslock);
-  tms.tms_utime = tms.tms_stime = tms.tms_cutime = tms.tms_cstime = ticks;
-  release(&tickslock);
+  // 先把本次系统调用之前的内核态时间记上
+  push_off();
+  acct_charge(p, 0);
+  pop_off();
+
+  tms.tms_utime = htick_to_clk(p->utime);
+  tms.tms_stime = htick_to_clk(p->stime);
+  tms.tms_cutime = htick_to_clk(p->cutime);
+  tms.tms_cstime = htick_to_clk(p->cstime);
 
   if (get_and_copyout(0, (char *)&tms, sizeof(tms)) < 0) {
     return -1;
   }
 
+  return htick_to_clk(r_time());
+}
+
+static void htick_to_timeval(uint64 htick, struct timespec *tv) {
+  tv->sec = htick / CLOCK_FREQ;
+  tv->usec = htick % CLOCK_FREQ * 1000000 / CLOCK_FREQ;
+}
+
+/**
+ * @brief 实现 getrusage 系统调用。
+ * @param who RUSAGE_SELF 或 RUSAGE_CHILDREN
+ * @param addr rusage 结构体存到的目标地址
+ * @return 0 成功，-1 失败
+ */
+uint64 sys_getrusage(void) {
+  int who;
+  struct rusage ru;
+  struct proc *p = myproc();
+
+  if (argint(0, &who) < 0) {
+    return -1;
+  }
+
+  memset(&ru, 0, sizeof(ru));
+  if (who == RUSAGE_SELF) {
+    push_off();
+    acct_charge(p, 0);
+    pop_off();
+    htick_to_timeval(p->utime, &ru.ru_utime);
+    htick_to_timeval(p->stime, &ru.ru_stime);
+  } else if (who == RUSAGE_CHILDREN) {
+    htick_to_timeval(p->cutime, &ru.ru_utime);
+    htick_to_timeval(p->cstime, &ru.ru_stime);
+  } else {
+    return -1;
+  }
+
+  if (get_and_copyout(1, (char *)&ru, sizeof(ru)) < 0) {
+    return -1;
+  }
   return 0;
 }
 
@@ -260,40 +337,115 @@ sys_shutdown(void) {
   return 0;
 }
 
+/**
+ * @brief 实现 nanosleep 系统调用，由 hrtimer 在精确的硬件 tick 到期时唤醒。
+ * @param req 睡眠时长（timespec，sec + usec）
+ * @param rem 被打断时写回剩余时长，可为 NULL
+ * @return 0 成功，-1 失败或被打断
+ */
 uint64 sys_nanosleep(void) {
   uint64 addr_tv;
   uint64 addr_rm;
-  argaddr(0, &addr_tv);
-  argaddr(1, &addr_rm);
+  if (argaddr(0, &addr_tv) < 0 || argaddr(1, &addr_rm) < 0) {
+    return -1;
+  }
 
   struct timespec interval;
-  copyin2((char*)&interval, addr_tv, sizeof(struct timespec));
+  if (copyin2((char*)&interval, addr_tv, sizeof(struct timespec)) < 0) {
+    return -1;
+  }
 
-  int ticks_interval = interval.sec * TICKS_PER_SECOND + interval.usec * TICKS_PER_SECOND / 1000000;
+  uint64 deadline = r_time() + interval.sec * CLOCK_FREQ + interval.usec * CLOCK_FREQ / 1000000;
 
-  acquire(&tickslock);
-  uint64 start = ticks;
-  while(ticks < start + ticks_interval) {
-    if(myproc() -> killed) {
-      if(addr_rm != NULL) {
-        uint64 rem_ticks = (ticks < start + ticks_interval) ? start + ticks_interval - ticks : 0;
-        struct timespec rem_ts;
-        rem_ts.sec = rem_ticks / TICKS_PER_SECOND;
-        rem_ts.usec = (rem_ticks * 1000000) % TICKS_PER_SECOND;
-        copyout2(addr_rm, (char*)&rem_ts, sizeof(struct timespec));
-      }
-      release(&tickslock);
-      return -1;
+  if (hrtimer_sleep_until(deadline) < 0) {
+    if (addr_rm != NULL) {
+      uint64 now = r_time();
+      uint64 rem_htick = now < deadline ? deadline - now : 0;
+      struct timespec rem_ts;
+      rem_ts.sec = rem_htick / CLOCK_FREQ;
+      rem_ts.usec = (rem_htick % CLOCK_FREQ) * 1000000 / CLOCK_FREQ;
+      copyout2(addr_rm, (char*)&rem_ts, sizeof(struct timespec));
     }
-    sleep(&ticks, &tickslock);
+    return -1;
   }
-
-  release(&tickslock);
   return 0;
 }
 
+/**
+ * @brief 用户态同步原语的内核部分
+ * futex(uaddr, op, val, timeout/val2, uaddr2, val3)
+ * FUTEX_WAIT 的 timeout 为相对时间（struct timespec，单位与 nanosleep 相同）；
+ * FUTEX_REQUEUE/FUTEX_CMP_REQUEUE 中第四个参数按整数 val2 解释，即最多迁移的等待者数
+ */
+uint64 sys_futex(void) {
+  uint64 uaddr, timeout, uaddr2;
+  int op, val, val3;
+
+  if(argaddr(0, &uaddr) < 0 || argint(1, &op) < 0 || argint(2, &val) < 0 ||
+     argaddr(3, &timeout) < 0 || argaddr(4, &uaddr2) < 0 || argint(5, &val3) < 0)
+    return -1;
+
+  switch(op & FUTEX_CMD_MASK){
+  case FUTEX_WAIT:
+    return futex_wait(uaddr, val, timeout);
+  case FUTEX_WAKE:
+    return futex_wake(uaddr, val);
+  case FUTEX_REQUEUE:
+    return futex_requeue(uaddr, val, (int)timeout, uaddr2, 0, 0);
+  case FUTEX_CMP_REQUEUE:
+    return futex_requeue(uaddr, val, (int)timeout, uaddr2, 1, val3);
+  }
+  return -1;
+}
+
+/**
+ * @brief 设置线程的CPU亲和性
+ * sched_setaffinity(pid, len, mask)，pid 为 0 表示调用者本身；
+ * mask 为 uint64 位图，第 i 位对应 hart i，不在线的 hart 被忽略
+ */
+uint64 sys_sched_setaffinity(void) {
+  int pid, len;
+  uint64 addr, mask;
+
+  if(argint(0, &pid) < 0 || argint(1, &len) < 0 || argaddr(2, &addr) < 0)
+    return -1;
+  if(len < (int)sizeof(mask))
+    return -1;
+  if(copyin2((char*)&mask, addr, sizeof(mask)) < 0)
+    return -1;
+  return setaffinity(pid, mask);
+}
+
+/**
+ * @brief 获取线程的CPU亲和性
+ * 成功时返回写入的字节数（8），与 Linux 系统调用一致
+ */
+uint64 sys_sched_getaffinity(void) {
+  int pid, len;
+  uint64 addr, mask;
+
+  if(argint(0, &pid) < 0 || argint(1, &len) < 0 || argaddr(2, &addr) < 0)
+    return -1;
+  if(len < (int)sizeof(mask))
+    return -1;
+  if(getaffinity(pid, &mask) < 0)
+    return -1;
+  if(copyout2(addr, (char*)&mask, sizeof(mask)) < 0)
+    return -1;
+  return sizeof(mask);
+}
+
+/**
+ * @brief 创建线程或进程
+ * clone(flags, stack, ptid, tls, ctid)，参数顺序与 Linux riscv64 一致
+ */
 uint64 sys_clone(void) {
-  return clone();
+  uint64 flags, stack, ptid, tls, ctid;
+
+  if(argaddr(0, &flags) < 0 || argaddr(1, &stack) < 0 || argaddr(2, &ptid) < 0 ||
+     argaddr(3, &tls) < 0 || argaddr(4, &ctid) < 0)
+    return -1;
+  return clone(flags, stack, ptid, tls, ctid);
 }
 
 uint64
@@ -317,7 +469,7 @@ uint64 sys_brk(void) {
     return -1;
   }
 
-  addr = myproc()->sz;
+  addr = myproc()->mm->sz;
 
   if (new_addr == 0) {
     return addr;
@@ -345,31 +497,42 @@ uint64 sys_mmap(void) {
   len = PGROUNDUP(len);
 
   struct proc *p = myproc();
+  struct mm *mm = p->mm;
 
+  struct file* f = NULL;
+  if(!(flags & MAP_ANONYMOUS)) {
+    if((f = fget(fd)) == NULL)
+      return -1;
+    if(f->type != FD_ENTRY){
+      fileclose(f);
+      return -1;
+    }
+  }
+
+  acquiresleep(&mm->lock);
   struct vma *v = NULL;
   for(int i = 0; i < NVMA; ++i) {
-    if(p->vma[i].valid == 0) {
-      v = &p->vma[i];
+    if(mm->vma[i].valid == 0) {
+      v = &mm->vma[i];
       break;
     }
   }
 
   if(v == NULL) {
+    releasesleep(&mm->lock);
+    if(f)
+      fileclose(f);
     return -1;
   }
 
-  struct file* f = NULL;
-  if(!(flags & MAP_ANONYMOUS)) {
-    f = p->ofile[fd];
-  }
-
-  v->start = mmap_getaddr(p, len);
+  v->start = mmap_getaddr(mm, len);
   v->end = v->start + len;
   v->prot = prot;
   v->flags = flags;
   v->offset = offset;
-  v->vm_file = (f == NULL) ? NULL : filedup(f);
+  v->vm_file = f;             // takes over fget()'s reference
   v->valid = 1;
+  releasesleep(&mm->lock);
 
   return v->start;
 }
@@ -386,22 +549,26 @@ uint64 sys_munmap(void) {
 
   if(len == 0) return 0;
 
-  struct proc *p = myproc();
+  struct mm *mm = myproc()->mm;
+  acquiresleep(&mm->lock);
   for(int i = 0; i < NVMA; ++i) {
-    struct vma *v = &p->vma[i];
+    struct vma *v = &mm->vma[i];
     if(v->valid && v->start == addr && (v->end - v->start) == len) {
-      vma_writeback(p, v);
+      vma_writeback(mm, v);
       uint64 npages = len / PGSIZE;
       int do_free = (v->flags & MAP_SHARED) == 0;
-      vmunmap(p->pagetable, addr, npages, do_free);
+      vmunmap(mm->pagetable, addr, npages, do_free);
+      mm_flush_tlb(mm);
       if(v->vm_file) {
         fileclose(v->vm_file);
         v->vm_file = NULL;
       }
       v->valid = 0;
+      releasesleep(&mm->lock);
       return 0;
     }
   }
+  releasesleep(&mm->lock);
 
   return -1;
 }
\ No newline at end of file
@@ -13,13 +13,103 @@
 struct spinlock tickslock;
 uint ticks;
 
+static uint64 boot_time;
+
+// Pending hrtimers, a binary min-heap on expires.
+struct {
+    struct spinlock lock;
+    struct hrtimer *heap[NHRTIMER];
+    int n;
+} hrt;
+
 void timerinit() {
     initlock(&tickslock, "time");
+    initlock(&hrt.lock, "hrtimer");
+    hrt.n = 0;
+    boot_time = r_time();
     #ifdef DEBUG
     printf("timerinit\n");
     #endif
 }
 
+static void
+heap_swap(int i, int j)
+{
+    struct hrtimer *t = hrt.heap[i];
+    hrt.heap[i] = hrt.heap[j];
+    hrt.heap[j] = t;
+    hrt.heap[i]->idx = i;
+    hrt.heap[j]->idx = j;
+}
+
+static void
+heap_up(int i)
+{
+    while (i > 0) {
+        int parent = (i - 1) / 2;
+        if (hrt.heap[parent]->expires <= hrt.heap[i]->expires)
+            break;
+        heap_swap(i, parent);
+        i = parent;
+    }
+}
+
+static void
+heap_down(int i)
+{
+    for (;;) {
+        int l = 2 * i + 1, r = l + 1, min = i;
+        if (l < hrt.n && hrt.heap[l]->expires < hrt.heap[min]->expires)
+            min = l;
+        if (r < hrt.n && hrt.heap[r]->expires < hrt.heap[min]->expires)
+            min = r;
+        if (min == i)
+            break;
+        heap_swap(i, min);
+        i = min;
+    }
+}
+
+// hrt.lock must be held.
+static int
+heap_insert(struct hrtimer *t)
+{
+    if (hrt.n >= NHRTIMER)
+        return -1;
+    t->idx = hrt.n;
+    hrt.heap[hrt.n++] = t;
+    heap_up(t->idx);
+    return 0;
+}
+
+// hrt.lock must be held.
+static void
+heap_remove(struct hrtimer *t)
+{
+    int i = t->idx;
+
+    t->idx = -1;
+    if (--hrt.n == i)
+        return;
+    hrt.heap[i] = hrt.heap[hrt.n];
+    hrt.heap[i]->idx = i;
+    heap_up(i);
+    heap_down(hrt.heap[i]->idx);
+}
+
+// Program this hart's comparator for the earlier of its next
+// periodic tick and the first pending hrtimer.
+// hrt.lock must be held.
+static void
+program_timer(struct cpu *c)
+{
+    uint64 deadline = c->next_tick;
+
+    if (hrt.n > 0 && hrt.heap[0]->expires < deadline)
+        deadline = hrt.heap[0]->expires;
+    sbi_set_timer(deadline);
+}
+
 void
 set_next_timeout() {
     // There is a very strange bug,
@@ -28,13 +118,143 @@ set_next_timeout() {
 
     // this bug seems to disappear automatically
     // printf("");
-    sbi_set_timer(r_time() + INTERVAL);
+    acquire(&hrt.lock);
+    struct cpu *c = mycpu();
+    c->next_tick = r_time() + INTERVAL;
+    program_timer(c);
+    release(&hrt.lock);
+}
+
+// Called from devintr() on every supervisor timer interrupt.
+// Runs expired hrtimers, and returns 1 if the periodic tick
+// was due (the caller should then yield), 0 otherwise.
+int timer_tick() {
+    int tick = 0;
+    uint64 now = r_time();
+
+    acquire(&hrt.lock);
+    struct cpu *c = mycpu();
+    while (hrt.n > 0 && hrt.heap[0]->expires <= now) {
+        struct hrtimer *t = hrt.heap[0];
+        heap_remove(t);
+        if (t->period) {
+            t->expires += t->period;
+            if (t->expires <= now)
+                t->expires = now + t->period;
+            heap_insert(t);
+        }
+        t->fn(t);
+    }
+    if (now >= c->next_tick) {
+        tick = 1;
+        c->next_tick = now + INTERVAL;
+    }
+    program_timer(c);
+    release(&hrt.lock);
+
+    if (tick) {
+        acquire(&tickslock);
+        ticks = (now - boot_time) / INTERVAL;
+        release(&tickslock);
+    }
+    return tick;
+}
+
+// The scheduler found nothing to run and is about to wfi:
+// stop the periodic tick so that only hrtimers (and devices)
+// wake this hart. Interrupts must be off.
+void timer_idle_enter() {
+    acquire(&hrt.lock);
+    struct cpu *c = mycpu();
+    c->next_tick = (uint64)-1;
+    program_timer(c);
+    release(&hrt.lock);
 }
 
-void timer_tick() {
-    acquire(&tickslock);
-    ticks++;
-    wakeup(&ticks);
-    release(&tickslock);
+// Back from wfi: restart the periodic tick.
+void timer_idle_exit() {
     set_next_timeout();
 }
+
+void
+hrtimer_init(struct hrtimer *t, void (*fn)(struct hrtimer *), void *arg)
+{
+    t->expires = 0;
+    t->period = 0;
+    t->fn = fn;
+    t->arg = arg;
+    t->idx = -1;
+}
+
+// Queue t to fire at the absolute hardware time expires.
+// Re-arms t if it was already queued.
+// Returns 0 on success, -1 if too many timers are pending.
+int
+hrtimer_start(struct hrtimer *t, uint64 expires)
+{
+    int ret;
+
+    acquire(&hrt.lock);
+    if (t->idx >= 0)
+        heap_remove(t);
+    t->expires = expires;
+    ret = heap_insert(t);
+    // the new head may be earlier than anything a hart has
+    // programmed; make sure at least this hart catches it.
+    if (ret == 0 && t->idx == 0)
+        program_timer(mycpu());
+    release(&hrt.lock);
+    return ret;
+}
+
+// Dequeue t. Returns 1 if it was still pending, 0 otherwise.
+int
+hrtimer_cancel(struct hrtimer *t)
+{
+    int pending;
+
+    acquire(&hrt.lock);
+    pending = t->idx >= 0;
+    if (pending)
+        heap_remove(t);
+    release(&hrt.lock);
+    return pending;
+}
+
+static void
+hrtimer_wakeup(struct hrtimer *t)
+{
+    wakeup(t);
+}
+
+// Sleep until the absolute hardware time deadline.
+// Returns 0 once the deadline passed, -1 if the process was killed.
+int
+hrtimer_sleep_until(uint64 deadline)
+{
+    struct hrtimer t;
+    struct proc *p = myproc();
+
+    if (deadline <= r_time())
+        return 0;
+    hrtimer_init(&t, hrtimer_wakeup, p);
+
+    acquire(&hrt.lock);
+    t.expires = deadline;
+    if (heap_insert(&t) < 0) {
+        release(&hrt.lock);
+        return -1;
+    }
+    if (t.idx == 0)
+        program_timer(mycpu());
+    // hrt.lock is the condition lock: the callback runs under it,
+    // so the wakeup cannot slip in between the check and sleep().
+    while (t.idx >= 0 && !p->killed)
+        sleep(&t, &hrt.lock);
+    int interrupted = t.idx >= 0;
+    if (interrupted)
+        heap_remove(&t);
+    release(&hrt.lock);
+
+    return interrupted ? -1 : 0;
+}
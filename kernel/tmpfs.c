@@ -0,0 +1,453 @@
+// tmpfs: an in-memory file system mounted on /tmp.
+//
+// Nodes are found by walking names down from the root; the
+// tree, the names and the reference counts are guarded by one
+// sleep lock, tmpfs.lock, and a file's size and data by the
+// node's own lock. A node is freed once it is no longer in its
+// directory and the last reference to it is put.
+//
+// The file layer reaches tmpfs through FD_TMPFS files; sysfile.c
+// sends paths under /tmp here (see tmpfs_path()).
+
+#include "include/types.h"
+#include "include/param.h"
+#include "include/riscv.h"
+#include "include/spinlock.h"
+#include "include/sleeplock.h"
+#include "include/proc.h"
+#include "include/stat.h"
+#include "include/kalloc.h"
+#include "include/string.h"
+#include "include/printf.h"
+#include "include/tmpfs.h"
+
+#define NPTR        (PGSIZE / sizeof(void *))   // pointers in an index page
+#define TMPFS_MAXSIZE   ((uint64)NPTR * NPTR * PGSIZE)
+
+static struct {
+    struct sleeplock lock;
+    struct kmem_cache cache;
+    struct tnode root;
+} tmpfs;
+
+void tmpfs_init(void)
+{
+    initsleeplock(&tmpfs.lock, "tmpfs");
+    kmem_cache_init(&tmpfs.cache, "tnode", sizeof(struct tnode));
+    safestrcpy(tmpfs.root.name, "tmp", sizeof(tmpfs.root.name));
+    tmpfs.root.type = T_DIR;
+    tmpfs.root.ref = 1;
+    tmpfs.root.linked = 1;
+    initsleeplock(&tmpfs.root.lock, "tnode");
+}
+
+/**
+ * If path is under /tmp, return the rest of it, after "/tmp";
+ * otherwise return 0. A relative path is taken to be from the
+ * root directory: the caller checks that it is. A path that
+ * climbs back out of /tmp through ".." is left to the FAT.
+ */
+char *tmpfs_path(char *path)
+{
+    char *s;
+    int depth = 0;
+
+    while (*path == '/' || (path[0] == '.' && path[1] == '/'))
+        path += (*path == '/') ? 1 : 2;
+    if (strncmp(path, "tmp", 3) != 0 || (path[3] != '\0' && path[3] != '/'))
+        return 0;
+    for (s = path + 3; *s; ) {
+        while (*s == '/')
+            s++;
+        if (s[0] == '.' && s[1] == '.' && (s[2] == '/' || s[2] == '\0')) {
+            if (--depth < 0)
+                return 0;
+        } else if (*s && !(s[0] == '.' && (s[1] == '/' || s[1] == '\0'))) {
+            depth++;
+        }
+        while (*s && *s != '/')
+            s++;
+    }
+    return path + 3;
+}
+
+// Whether name is "." or "..", which can't be made or renamed to.
+static int dotname(char *name)
+{
+    return strncmp(name, ".", FAT32_MAX_FILENAME) == 0 ||
+           strncmp(name, "..", FAT32_MAX_FILENAME) == 0;
+}
+
+// Copy the next path element from path into name and return the
+// rest of path, or 0 if there is none; like skipelem() in fat32.c.
+static char *skipelem(char *path, char *name)
+{
+    char *s;
+    int len;
+
+    while (*path == '/')
+        path++;
+    if (*path == 0)
+        return 0;
+    s = path;
+    while (*path != '/' && *path != 0)
+        path++;
+    len = path - s;
+    if (len > FAT32_MAX_FILENAME)
+        len = FAT32_MAX_FILENAME;
+    memmove(name, s, len);
+    name[len] = 0;
+    while (*path == '/')
+        path++;
+    return path;
+}
+
+static struct tnode *dirlook(struct tnode *dp, char *name)
+{
+    struct tnode *t;
+
+    if (strncmp(name, ".", FAT32_MAX_FILENAME) == 0)
+        return dp;
+    if (strncmp(name, "..", FAT32_MAX_FILENAME) == 0)
+        return dp->parent;      // 0 at the root: see tmpfs_path()
+    for (t = dp->child; t; t = t->next) {
+        if (strncmp(t->name, name, FAT32_MAX_FILENAME) == 0)
+            return t;
+    }
+    return 0;
+}
+
+/**
+ * Walk path, the part after "/tmp", down from the root. With
+ * name, stop at the last element's directory and copy the
+ * element to name. Caller holds tmpfs.lock; no reference is
+ * taken.
+ */
+static struct tnode *lookup(char *path, char *name)
+{
+    struct tnode *t = &tmpfs.root;
+    char elem[FAT32_MAX_FILENAME + 1];
+
+    while ((path = skipelem(path, elem)) != 0) {
+        if (t->type != T_DIR)
+            return 0;
+        if (name && *path == '\0') {
+            safestrcpy(name, elem, FAT32_MAX_FILENAME + 1);
+            return t;
+        }
+        if ((t = dirlook(t, elem)) == 0)
+            return 0;
+    }
+    return name ? 0 : t;
+}
+
+struct tnode *tdup(struct tnode *t)
+{
+    acquiresleep(&tmpfs.lock);
+    t->ref++;
+    releasesleep(&tmpfs.lock);
+    return t;
+}
+
+struct tnode *tname(char *path)
+{
+    struct tnode *t;
+
+    acquiresleep(&tmpfs.lock);
+    if ((t = lookup(path, 0)) != 0)
+        t->ref++;
+    releasesleep(&tmpfs.lock);
+    return t;
+}
+
+/**
+ * Create a file or directory at path, or find the one there if it
+ * is of the same type. Returns it with a reference, or 0.
+ */
+struct tnode *tcreate(char *path, short type)
+{
+    struct tnode *dp, *t;
+    char name[FAT32_MAX_FILENAME + 1];
+
+    acquiresleep(&tmpfs.lock);
+    if ((dp = lookup(path, name)) == 0 || dp->type != T_DIR || dotname(name)) {
+        releasesleep(&tmpfs.lock);
+        return 0;
+    }
+    if ((t = dirlook(dp, name)) != 0) {
+        if (t->type != type)
+            t = 0;
+        else
+            t->ref++;
+        releasesleep(&tmpfs.lock);
+        return t;
+    }
+    if ((t = kmem_cache_alloc(&tmpfs.cache)) == 0) {
+        releasesleep(&tmpfs.lock);
+        return 0;
+    }
+    memset(t, 0, sizeof(*t));
+    safestrcpy(t->name, name, sizeof(t->name));
+    t->type = type;
+    t->ref = 1;
+    t->linked = 1;
+    t->parent = dp;
+    dp->ref++;
+    t->next = dp->child;
+    dp->child = t;
+    initsleeplock(&t->lock, "tnode");
+    releasesleep(&tmpfs.lock);
+    return t;
+}
+
+// The page holding byte pgno*PGSIZE of t, or 0 if there is none;
+// with alloc, one is made. Caller holds t->lock.
+static uchar *tpage(struct tnode *t, uint pgno, int alloc)
+{
+    void **ind;
+    uchar *pg;
+
+    if (pgno >= NPTR * NPTR)
+        return 0;
+    if (t->index == 0) {
+        if (!alloc || (t->index = kalloc()) == 0)
+            return 0;
+        memset(t->index, 0, PGSIZE);
+    }
+    if ((ind = t->index[pgno / NPTR]) == 0) {
+        if (!alloc || (ind = kalloc()) == 0)
+            return 0;
+        memset(ind, 0, PGSIZE);
+        t->index[pgno / NPTR] = ind;
+    }
+    if ((pg = ind[pgno % NPTR]) == 0) {
+        if (!alloc || (pg = kalloc()) == 0)
+            return 0;
+        memset(pg, 0, PGSIZE);
+        ind[pgno % NPTR] = pg;
+    }
+    return pg;
+}
+
+// Free t's data. Caller holds t->lock, or the last reference.
+static void tfree(struct tnode *t)
+{
+    void **ind;
+
+    if (t->index) {
+        for (int i = 0; i < NPTR; i++) {
+            if ((ind = t->index[i]) == 0)
+                continue;
+            for (int j = 0; j < NPTR; j++) {
+                if (ind[j])
+                    kfree(ind[j]);
+            }
+            kfree(ind);
+        }
+        kfree(t->index);
+        t->index = 0;
+    }
+    t->size = 0;
+}
+
+void tput(struct tnode *t)
+{
+    struct tnode *dp;
+
+    acquiresleep(&tmpfs.lock);
+    while (t && --t->ref == 0 && !t->linked) {
+        dp = t->parent;
+        tfree(t);
+        kmem_cache_free(&tmpfs.cache, t);
+        t = dp;     // drop the reference t held on its directory
+    }
+    releasesleep(&tmpfs.lock);
+}
+
+void tlock(struct tnode *t)
+{
+    acquiresleep(&t->lock);
+}
+
+void tunlock(struct tnode *t)
+{
+    releasesleep(&t->lock);
+}
+
+// Unlink t from its directory. Caller holds tmpfs.lock.
+static void unlink(struct tnode *t)
+{
+    struct tnode **pp;
+
+    for (pp = &t->parent->child; *pp != t; pp = &(*pp)->next)
+        ;
+    *pp = t->next;
+    t->next = 0;
+    t->linked = 0;
+}
+
+// Remove the file or empty directory at path.
+int tremove(char *path)
+{
+    struct tnode *dp, *t;
+    char name[FAT32_MAX_FILENAME + 1];
+
+    acquiresleep(&tmpfs.lock);
+    if ((dp = lookup(path, name)) == 0 || dp->type != T_DIR || dotname(name) ||
+        (t = dirlook(dp, name)) == 0 || (t->type == T_DIR && t->child)) {
+        releasesleep(&tmpfs.lock);
+        return -1;
+    }
+    unlink(t);
+    t->ref++;
+    releasesleep(&tmpfs.lock);
+    tput(t);
+    return 0;
+}
+
+/**
+ * Move old to new, replacing a file, or an empty directory, that
+ * is there; both are under /tmp.
+ */
+int trename(char *old, char *new)
+{
+    struct tnode *src, *dp, *dst, *p;
+    char name[FAT32_MAX_FILENAME + 1];
+
+    acquiresleep(&tmpfs.lock);
+    if ((src = lookup(old, 0)) == 0 || src == &tmpfs.root ||
+        (dp = lookup(new, name)) == 0 || dp->type != T_DIR || dotname(name))
+        goto fail;
+    for (p = dp; p; p = p->parent) {
+        if (p == src)
+            goto fail;      // into itself
+    }
+    if ((dst = dirlook(dp, name)) != 0) {
+        if (dst == src)
+            goto fail;
+        if (dst->type != src->type || (dst->type == T_DIR && dst->child))
+            goto fail;
+        unlink(dst);
+        dst->ref++;
+    }
+    unlink(src);
+    safestrcpy(src->name, name, sizeof(src->name));
+    dp->ref++;
+    p = src->parent;
+    src->parent = dp;
+    src->next = dp->child;
+    dp->child = src;
+    src->linked = 1;
+    releasesleep(&tmpfs.lock);
+    tput(p);        // src's reference on its old directory
+    if (dst)
+        tput(dst);
+    return 0;
+
+fail:
+    releasesleep(&tmpfs.lock);
+    return -1;
+}
+
+// Caller holds t->lock.
+int tread(struct tnode *t, int user_dst, uint64 dst, uint off, uint n)
+{
+    uint tot, m;
+    uchar *pg;
+
+    if (t->type == T_DIR || off > t->size)
+        return 0;
+    if (n > t->size - off)
+        n = t->size - off;
+    for (tot = 0; tot < n; tot += m, off += m, dst += m) {
+        m = PGSIZE - off % PGSIZE;
+        if (m > n - tot)
+            m = n - tot;
+        if ((pg = tpage(t, off / PGSIZE, 0)) == 0) {
+            // a hole: reads as zeros
+            static char zeros[64];
+            for (uint i = 0, k; i < m; i += k) {
+                k = m - i < sizeof(zeros) ? m - i : sizeof(zeros);
+                if (either_copyout(user_dst, dst + i, zeros, k) < 0)
+                    return tot ? tot : -1;
+            }
+        } else if (either_copyout(user_dst, dst, pg + off % PGSIZE, m) < 0) {
+            return tot ? tot : -1;
+        }
+    }
+    return tot;
+}
+
+// Caller holds t->lock. Returns how much was written, which is
+// short when memory runs out.
+int twrite(struct tnode *t, int user_src, uint64 src, uint off, uint n)
+{
+    uint tot, m;
+    uchar *pg;
+
+    if (t->type == T_DIR || (uint64)off + n > TMPFS_MAXSIZE)
+        return -1;
+    for (tot = 0; tot < n; tot += m, off += m, src += m) {
+        m = PGSIZE - off % PGSIZE;
+        if (m > n - tot)
+            m = n - tot;
+        if ((pg = tpage(t, off / PGSIZE, 1)) == 0 ||
+            either_copyin(pg + off % PGSIZE, user_src, src, m) < 0)
+            break;
+    }
+    if (off > t->size)
+        t->size = off;
+    return tot;
+}
+
+// Caller holds t->lock.
+void ttrunc(struct tnode *t)
+{
+    tfree(t);
+}
+
+void tstat(struct tnode *t, struct stat *st)
+{
+    strncpy(st->name, t->name, STAT_MAX_NAME);
+    st->type = t->type;
+    st->dev = TMPFS_DEV;
+    st->size = t->size;
+}
+
+// Stat the entry numbered off of directory dp; returns 0 past the
+// last one.
+int tnext(struct tnode *dp, uint off, struct stat *st)
+{
+    struct tnode *t;
+
+    acquiresleep(&tmpfs.lock);
+    for (t = dp->child; t && off > 0; t = t->next, off--)
+        ;
+    if (t)
+        tstat(t, st);
+    releasesleep(&tmpfs.lock);
+    return t != 0;
+}
+
+// Put t's absolute path, "/tmp/...", in buf.
+int tabspath(struct tnode *t, char *buf, int size)
+{
+    char *s = buf + size - 1;
+    int len, ret = 0;
+
+    *s = 0;
+    acquiresleep(&tmpfs.lock);
+    for (; t; t = t->parent) {
+        len = strlen(t->name);
+        if ((s -= len + 1) < buf) {
+            ret = -1;
+            break;
+        }
+        s[0] = '/';
+        memmove(s + 1, t->name, len);
+    }
+    releasesleep(&tmpfs.lock);
+    if (ret == 0)
+        memmove(buf, s, strlen(s) + 1);
+    return ret;
+}
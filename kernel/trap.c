@@ -65,6 +65,7 @@ usertrap(void)
   w_stvec((uint64)kernelvec);
 
   struct proc *p = myproc();
+  acct_charge(p, 1);
   
   // save user program counter.
   p->trapframe->epc = r_sepc();
@@ -84,15 +85,22 @@ usertrap(void)
   else if((which_dev = devintr()) != 0){
     // ok
   } 
+  else if(r_scause() == 2 && fp_trap(p)){
+    // first FP instruction since the FP state was switched out;
+    // retry it with the registers loaded.
+  }
   else {
     uint64 scause = r_scause();
     uint64 stval = r_stval();
 
     if (scause == 12 || scause == 13 || scause == 15) {
+      // other threads may fault on, or unmap, the same area.
+      struct mm *mm = p->mm;
+      acquiresleep(&mm->lock);
       struct vma* v = 0;
       for (int i = 0; i < NVMA; i++) {
-        if (p->vma[i].valid && stval >= p->vma[i].start && stval < p->vma[i].end) {
-          v = &p->vma[i];
+        if (mm->vma[i].valid && stval >= mm->vma[i].start && stval < mm->vma[i].end) {
+          v = &mm->vma[i];
           break;
         }
       }
@@ -110,16 +118,20 @@ usertrap(void)
           printf("usertrap(): protection fault pid=%d %s, va=%p\n", p->pid, p->name, stval);
           p->killed = 1;
         }
-        else {
+        else if (walkaddr(mm->pagetable, PGROUNDDOWN(stval)) == 0) {
+          // not yet filled in by another thread.
           uint64 va_page_start = PGROUNDDOWN(stval);
 
-          char* mem = kalloc();
-            memset(mem, 0, PGSIZE);
-
+          char* mem = kzalloc();
+          if (mem == NULL) {
+            p->killed = 1;
+          }
+          else {
             if (v->vm_file) {
               elock(v->vm_file->ep);
               uint64 file_offset = v->offset + (va_page_start - v->start);
               eread(v->vm_file->ep, 0, (uint64)mem, file_offset, PGSIZE);
+              filereadahead(v->vm_file, file_offset, PGSIZE);
               eunlock(v->vm_file->ep);
             }
 
@@ -128,18 +140,19 @@ usertrap(void)
             if (v->prot & PROT_WRITE) pte_flags |= PTE_W;
             if (v->prot & PROT_EXEC) pte_flags |= PTE_X;
 
-            if (mappages(p->pagetable, va_page_start, PGSIZE, (uint64)mem, pte_flags) != 0) {
+            if (mappages(mm->pagetable, va_page_start, PGSIZE, (uint64)mem, pte_flags) != 0) {
               kfree(mem); 
               printf("usertrap(): mappages failed\n");
               p->killed = 1;
             }
-            if (mappages(p->kpagetable, va_page_start, PGSIZE, (uint64)mem, pte_flags & ~PTE_U) != 0) {
-              kfree(mem);
-              vmunmap(p->pagetable, va_page_start, 1, 1);
+            else if (mappages(mm->kpagetable, va_page_start, PGSIZE, (uint64)mem, pte_flags & ~PTE_U) != 0) {
+              vmunmap(mm->pagetable, va_page_start, 1, 1);
               p->killed = 1;
             }
+          }
         }
       }
+      releasesleep(&mm->lock);
     }
     else {
       printf("\nusertrap(): unexpected scause %p pid=%d %s\n", r_scause(), p->pid, p->name);
@@ -170,6 +183,7 @@ usertrapret(void)
   // kerneltrap() to usertrap(), so turn off interrupts until
   // we're back in user space, where usertrap() is correct.
   intr_off();
+  acct_charge(p, 0);
 
   // send syscalls, interrupts, and exceptions to trampoline.S
   w_stvec(TRAMPOLINE + (uservec - trampoline));
@@ -184,6 +198,8 @@ usertrapret(void)
   // set up the registers that trampoline.S's sret will use
   // to get to user space.
   
+  fp_userret(p);
+
   // set S Previous Privilege mode to User.
   unsigned long x = r_sstatus();
   x &= ~SSTATUS_SPP; // clear SPP to 0 for user mode
@@ -195,13 +211,13 @@ usertrapret(void)
 
   // tell trampoline.S the user page table to switch to.
   // printf("[usertrapret]p->pagetable: %p\n", p->pagetable);
-  uint64 satp = MAKE_SATP(p->pagetable);
+  uint64 satp = MAKE_SATP(p->mm->pagetable);
 
   // jump to trampoline.S at the top of memory, which 
   // switches to the user page table, restores user registers,
   // and switches to user mode with sret.
   uint64 fn = TRAMPOLINE + (userret - trampoline);
-  ((void (*)(uint64,uint64))fn)(TRAPFRAME, satp);
+  ((void (*)(uint64,uint64))fn)(TRAPFRAME_SLOT(p->tslot), satp);
 }
 
 // interrupts and exceptions from kernel code go here via kernelvec,
@@ -235,16 +251,37 @@ kerneltrap() {
   }
   // the yield() may have caused some traps to occur,
   // so restore trap registers for use by kernelvec.S's sepc instruction.
+  // sstatus.FS belongs to the hart, which may no longer be
+  // the one we trapped on: keep its current value.
   w_sepc(sepc);
-  w_sstatus(sstatus);
+  w_sstatus((sstatus & ~SSTATUS_FS) | (r_sstatus() & SSTATUS_FS));
 }
 
+static int handle_devintr(void);
+
 // Check if it's an external/software interrupt, 
 // and handle it. 
 // returns  2 if timer interrupt, 
 //          1 if other device, 
 //          0 if not recognized. 
+// Interrupt time is charged to this hart's irq time only:
+// the interrupted process's accounting period is pushed
+// forward so it is not billed for it.
 int devintr(void) {
+	uint64 start = r_time();
+	int which_dev = handle_devintr();
+
+	if (which_dev) {
+		uint64 delta = r_time() - start;
+		struct cpu *c = mycpu();
+		c->stat.irq += delta;
+		if (c->proc)
+			c->proc->tstamp += delta;
+	}
+	return which_dev;
+}
+
+static int handle_devintr(void) {
 	uint64 scause = r_scause();
 
 	#ifdef QEMU 
@@ -265,8 +302,8 @@ int devintr(void) {
 				consoleintr(c);
 			}
 		}
-		else if (DISK_IRQ == irq) {
-			disk_intr();
+		else if (irq >= DISK_IRQ && irq < DISK_IRQ + NDISK_IRQ) {
+			disk_intr(irq);
 		}
 		else if (irq) {
 			printf("unexpected interrupt irq = %d\n", irq);
@@ -282,8 +319,15 @@ int devintr(void) {
 		return 1;
 	}
 	else if (0x8000000000000005L == scause) {
-		timer_tick();
-		return 2;
+		// only the periodic tick ends a time slice;
+		// an hrtimer expiry is just another interrupt.
+		return timer_tick() ? 2 : 1;
+	}
+	else if (0x8000000000000001L == scause) {
+		// IPI from kick_idle(): the hart only had to leave
+		// wfi and rescan the process list.
+		w_sip(r_sip() & ~2);
+		return 1;
 	}
 	else { return 0;}
 }
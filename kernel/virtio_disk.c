@@ -1,10 +1,15 @@
 //
 // driver for qemu's virtio disk device.
-// uses qemu's mmio interface to virtio.
-// qemu presents a "legacy" virtio interface.
+// uses qemu's mmio interface to virtio, legacy or modern.
 //
 // qemu ... -drive file=fs.img,if=none,format=raw,id=x0 -device virtio-blk-device,drive=x0,bus=virtio-mmio-bus.0
 //
+// every virtio-mmio slot with a disk in it is a disk, vda, vdb,
+// &c., in slot order; more are given with -device ...,bus=virtio-mmio-bus.N.
+// with VIRTIO_BLK_F_MQ (qemu's num-queues=N), each hart submits
+// to a virtqueue of its own; the NCPU virtqueues are shared out
+// between the disks.
+//
 
 
 #include "include/types.h"
@@ -14,18 +19,22 @@
 #include "include/spinlock.h"
 #include "include/sleeplock.h"
 #include "include/buf.h"
+#include "include/disk.h"
 #include "include/virtio.h"
 #include "include/proc.h"
 #include "include/vm.h"
 #include "include/string.h"
 #include "include/printf.h"
+#include "include/intr.h"
+#include "include/plic.h"
 
 
-// the address of virtio mmio register r.
-#define R(r) ((volatile uint32 *)(VIRTIO0_V + (r)))
+// the address of virtio mmio register r of disk d.
+#define R(d, r) ((volatile uint32 *)((d)->base + (r)))
 
-static struct disk {
- // memory for virtio descriptors &c for queue 0.
+// a virtqueue, with the driver's book-keeping for it.
+struct vqueue {
+ // memory for virtio descriptors &c.
  // this is a global instead of allocated because it must
  // be multiple contiguous pages, which kalloc()
  // doesn't support, and page aligned.
@@ -36,96 +45,231 @@ static struct disk {
 
   // our own book-keeping.
   char free[NUM];  // is a descriptor free?
-  uint16 used_idx; // we've looked this far in used[2..NUM].
+  int nfree;
+  uint16 used_idx; // we've looked this far in used->elems[], mod 2^16.
 
   // track info about in-flight operations,
   // for use when completion interrupt arrives.
   // indexed by first descriptor index of chain.
   struct {
-    struct buf *b;
+    struct blkreq *r;
     char status;
   } info[NUM];
-  
-  struct spinlock vdisk_lock;
-  
-} __attribute__ ((aligned (PGSIZE))) disk;
 
-void
-virtio_disk_init(void)
+  // request headers, also indexed by the head descriptor:
+  // direct mapped, unlike a kernel stack.
+  struct virtio_blk_outhdr {
+    uint32 type;
+    uint32 reserved;
+    uint64 sector;
+  } hdr[NUM];
+
+  // indirect descriptor tables, indexed likewise.
+  struct VRingDesc ind[NUM][NDESC_REQ] __attribute__ ((aligned (16)));
+
+  struct disk *disk;
+  struct spinlock lock;
+} __attribute__ ((aligned (PGSIZE)));
+
+#define NVQUEUE NCPU
+
+static struct vqueue vqueues[NVQUEUE];
+
+static struct disk {
+  uint64 base;        // its mmio registers
+  int irq;
+  int dev;            // block device number
+  struct vqueue *q;   // its virtqueues
+  int nq;
+
+  int modern;         // version 2 mmio interface
+  int can_flush;      // VIRTIO_BLK_F_FLUSH was negotiated
+  int indirect;       // VIRTIO_RING_F_INDIRECT_DESC was
+  int event_idx;      // VIRTIO_RING_F_EVENT_IDX was
+} disks[NDISK];
+
+static int ndisk;
+static int polling;   // processes spinning in virtio_disk_poll()
+
+// the event index fields, after the avail and used rings.
+#define USED_EVENT(q)    ((q)->avail[2 + NUM])
+#define AVAIL_EVENT(q)   ((q)->used->avail_event)
+
+// virtio_blk_config.capacity, in sectors, at byte 0 of the
+// config space, and num_queues, at byte 34.
+#define VIRTIO_MMIO_CONFIG          0x100
+#define VIRTIO_BLK_CONFIG_CAPACITY  (VIRTIO_MMIO_CONFIG + 0)
+#define VIRTIO_BLK_CONFIG_NUMQ      (VIRTIO_MMIO_CONFIG + 32)
+
+static void
+vq_init(struct disk *d, struct vqueue *q, int qi)
 {
-  uint32 status = 0;
+  initlock_kind(&q->lock, "virtio_disk", SPIN_QUEUED);
+  q->disk = d;
 
-  initlock(&disk.vdisk_lock, "virtio_disk");
+  *R(d, VIRTIO_MMIO_QUEUE_SEL) = qi;
+  if(d->modern && *R(d, VIRTIO_MMIO_QUEUE_READY))
+    panic("virtio disk queue in use");
+  uint32 max = *R(d, VIRTIO_MMIO_QUEUE_NUM_MAX);
+  if(max == 0)
+    panic("virtio disk has no queue");
+  if(max < NUM)
+    panic("virtio disk max queue too short");
+  *R(d, VIRTIO_MMIO_QUEUE_NUM) = NUM;
+  memset(q->pages, 0, sizeof(q->pages));
 
-  if(*R(VIRTIO_MMIO_MAGIC_VALUE) != 0x74726976 ||
-     *R(VIRTIO_MMIO_VERSION) != 1 ||
-     *R(VIRTIO_MMIO_DEVICE_ID) != 2 ||
-     *R(VIRTIO_MMIO_VENDOR_ID) != 0x554d4551){
-    panic("could not find virtio disk");
+  // desc = pages -- num * VRingDesc
+  // avail = pages + 0x200 -- 2 * uint16, then num * uint16, then used_event
+  // used = pages + 4096 -- 2 * uint16, then num * vRingUsedElem, then avail_event
+
+  q->desc = (struct VRingDesc *) q->pages;
+  q->avail = (uint16*)(((char*)q->desc) + NUM*sizeof(struct VRingDesc));
+  q->used = (struct UsedArea *) (q->pages + PGSIZE);
+
+  if(d->modern){
+    *R(d, VIRTIO_MMIO_QUEUE_DESC_LOW) = (uint64)q->desc;
+    *R(d, VIRTIO_MMIO_QUEUE_DESC_HIGH) = (uint64)q->desc >> 32;
+    *R(d, VIRTIO_MMIO_DRIVER_DESC_LOW) = (uint64)q->avail;
+    *R(d, VIRTIO_MMIO_DRIVER_DESC_HIGH) = (uint64)q->avail >> 32;
+    *R(d, VIRTIO_MMIO_DEVICE_DESC_LOW) = (uint64)q->used;
+    *R(d, VIRTIO_MMIO_DEVICE_DESC_HIGH) = (uint64)q->used >> 32;
+    *R(d, VIRTIO_MMIO_QUEUE_READY) = 1;
+  } else {
+    *R(d, VIRTIO_MMIO_QUEUE_PFN) = ((uint64)q->pages) >> PGSHIFT;
   }
-  
+
+  for(int i = 0; i < NUM; i++)
+    q->free[i] = 1;
+  q->nfree = NUM;
+}
+
+static int virtio_disk_cost(struct blkreq *r);
+static void virtio_disk_start(struct blkreq *r);
+
+// Set up disk d, with nq virtqueues at most, and register it.
+static void
+disk_setup(struct disk *d, int nq)
+{
+  uint32 status = 0;
+  uint64 nsec;
+  char name[4] = "vd?";
+
+  d->modern = *R(d, VIRTIO_MMIO_VERSION) == 2;
+
+  // reset the device.
+  *R(d, VIRTIO_MMIO_STATUS) = status;
+
   status |= VIRTIO_CONFIG_S_ACKNOWLEDGE;
-  *R(VIRTIO_MMIO_STATUS) = status;
+  *R(d, VIRTIO_MMIO_STATUS) = status;
 
   status |= VIRTIO_CONFIG_S_DRIVER;
-  *R(VIRTIO_MMIO_STATUS) = status;
-
-  // negotiate features
-  uint64 features = *R(VIRTIO_MMIO_DEVICE_FEATURES);
-  features &= ~(1 << VIRTIO_BLK_F_RO);
-  features &= ~(1 << VIRTIO_BLK_F_SCSI);
-  features &= ~(1 << VIRTIO_BLK_F_CONFIG_WCE);
-  features &= ~(1 << VIRTIO_BLK_F_MQ);
-  features &= ~(1 << VIRTIO_F_ANY_LAYOUT);
-  features &= ~(1 << VIRTIO_RING_F_EVENT_IDX);
-  features &= ~(1 << VIRTIO_RING_F_INDIRECT_DESC);
-  *R(VIRTIO_MMIO_DRIVER_FEATURES) = features;
+  *R(d, VIRTIO_MMIO_STATUS) = status;
+
+  // negotiate features: only those the driver knows.
+  uint64 features = *R(d, VIRTIO_MMIO_DEVICE_FEATURES);
+  if(d->modern){
+    *R(d, VIRTIO_MMIO_DEVICE_FEATURES_SEL) = 1;
+    features |= (uint64)*R(d, VIRTIO_MMIO_DEVICE_FEATURES) << 32;
+  }
+  features &= (1UL << VIRTIO_BLK_F_FLUSH) |
+              (1UL << VIRTIO_BLK_F_MQ) |
+              (1UL << VIRTIO_RING_F_INDIRECT_DESC) |
+              (1UL << VIRTIO_RING_F_EVENT_IDX) |
+              (1UL << VIRTIO_F_VERSION_1);
+  if(d->modern && !(features & (1UL << VIRTIO_F_VERSION_1)))
+    panic("virtio disk: no VERSION_1");
+  if(d->modern)
+    *R(d, VIRTIO_MMIO_DRIVER_FEATURES_SEL) = 0;
+  *R(d, VIRTIO_MMIO_DRIVER_FEATURES) = (uint32)features;
+  if(d->modern){
+    *R(d, VIRTIO_MMIO_DRIVER_FEATURES_SEL) = 1;
+    *R(d, VIRTIO_MMIO_DRIVER_FEATURES) = features >> 32;
+  }
+  d->can_flush = (features >> VIRTIO_BLK_F_FLUSH) & 1;
+  d->indirect = (features >> VIRTIO_RING_F_INDIRECT_DESC) & 1;
+  d->event_idx = (features >> VIRTIO_RING_F_EVENT_IDX) & 1;
 
   // tell device that feature negotiation is complete.
   status |= VIRTIO_CONFIG_S_FEATURES_OK;
-  *R(VIRTIO_MMIO_STATUS) = status;
+  *R(d, VIRTIO_MMIO_STATUS) = status;
+  if(d->modern && !(*R(d, VIRTIO_MMIO_STATUS) & VIRTIO_CONFIG_S_FEATURES_OK))
+    panic("virtio disk: features not accepted");
+
+  // a queue per hart, as far as the device and its share of
+  // vqueues[] go.
+  d->nq = 1;
+  if(features & (1UL << VIRTIO_BLK_F_MQ))
+    d->nq = *R(d, VIRTIO_BLK_CONFIG_NUMQ) >> 16;
+  if(d->nq < 1)
+    d->nq = 1;
+  if(d->nq > nq)
+    d->nq = nq;
+
+  if(!d->modern)
+    *R(d, VIRTIO_MMIO_GUEST_PAGE_SIZE) = PGSIZE;
+  for(int i = 0; i < d->nq; i++)
+    vq_init(d, &d->q[i], i);
 
   // tell device we're completely ready.
   status |= VIRTIO_CONFIG_S_DRIVER_OK;
-  *R(VIRTIO_MMIO_STATUS) = status;
+  *R(d, VIRTIO_MMIO_STATUS) = status;
 
-  *R(VIRTIO_MMIO_GUEST_PAGE_SIZE) = PGSIZE;
+  nsec = *R(d, VIRTIO_BLK_CONFIG_CAPACITY) |
+         (uint64)*R(d, VIRTIO_BLK_CONFIG_CAPACITY + 4) << 32;
+  if(nsec >= ~0U)
+    nsec = ~0U - 1;
+  name[2] = 'a' + (d - disks);
+  d->dev = disk_register(name, nsec, virtio_disk_start, virtio_disk_cost,
+                         d->indirect ? d->nq * NUM : NUM, d);
 
-  // initialize queue 0.
-  *R(VIRTIO_MMIO_QUEUE_SEL) = 0;
-  uint32 max = *R(VIRTIO_MMIO_QUEUE_NUM_MAX);
-  if(max == 0)
-    panic("virtio disk has no queue 0");
-  if(max < NUM)
-    panic("virtio disk max queue too short");
-  *R(VIRTIO_MMIO_QUEUE_NUM) = NUM;
-  memset(disk.pages, 0, sizeof(disk.pages));
-  *R(VIRTIO_MMIO_QUEUE_PFN) = ((uint64)disk.pages) >> PGSHIFT;
-
-  // desc = pages -- num * VRingDesc
-  // avail = pages + 0x40 -- 2 * uint16, then num * uint16
-  // used = pages + 4096 -- 2 * uint16, then num * vRingUsedElem
+  #ifdef DEBUG
+  printf("virtio_disk_init: %s v%d, %d queues%s%s%s\n", name,
+         d->modern ? 2 : 1, d->nq,
+         d->indirect ? " indirect" : "", d->event_idx ? " event_idx" : "",
+         d->can_flush ? " flush" : "");
+  #endif
+}
 
-  disk.desc = (struct VRingDesc *) disk.pages;
-  disk.avail = (uint16*)(((char*)disk.desc) + NUM*sizeof(struct VRingDesc));
-  disk.used = (struct UsedArea *) (disk.pages + PGSIZE);
+// Find the disks in the virtio-mmio slots and set them up.
+void
+virtio_disk_init(void)
+{
+  struct disk *d;
+  uint32 version;
+  int i, nq;
+
+  for(i = 0; i < NVIRTIO && ndisk < NDISK; i++){
+    d = &disks[ndisk];
+    d->base = VIRTIO_V(i);
+    d->irq = VIRTIO_IRQ(i);
+    version = *R(d, VIRTIO_MMIO_VERSION);
+    if(*R(d, VIRTIO_MMIO_MAGIC_VALUE) != 0x74726976 ||
+       (version != 1 && version != 2) ||
+       *R(d, VIRTIO_MMIO_DEVICE_ID) != 2 ||
+       *R(d, VIRTIO_MMIO_VENDOR_ID) != 0x554d4551)
+      continue;   // empty, or not a disk
+    ndisk++;
+  }
+  if(ndisk == 0)
+    panic("could not find virtio disk");
 
-  for(int i = 0; i < NUM; i++)
-    disk.free[i] = 1;
+  nq = NVQUEUE / ndisk;
+  for(i = 0; i < ndisk; i++){
+    disks[i].q = &vqueues[i * nq];
+    disk_setup(&disks[i], nq);
+  }
 
-  // plic.c and trap.c arrange for interrupts from VIRTIO0_IRQ.
-  #ifdef DEBUG
-  printf("virtio_disk_init\n");
-  #endif
+  // plic.c and trap.c arrange for interrupts from VIRTIO_IRQ(i).
 }
 
 // find a free descriptor, mark it non-free, return its index.
 static int
-alloc_desc()
+alloc_desc(struct vqueue *q)
 {
   for(int i = 0; i < NUM; i++){
-    if(disk.free[i]){
-      disk.free[i] = 0;
+    if(q->free[i]){
+      q->free[i] = 0;
+      q->nfree--;
       return i;
     }
   }
@@ -134,144 +278,306 @@ alloc_desc()
 
 // mark a descriptor as free.
 static void
-free_desc(int i)
+free_desc(struct vqueue *q, int i)
 {
   if(i >= NUM)
     panic("virtio_disk_intr 1");
-  if(disk.free[i])
+  if(q->free[i])
     panic("virtio_disk_intr 2");
-  disk.desc[i].addr = 0;
-  disk.free[i] = 1;
-  wakeup(&disk.free[0]);
+  q->desc[i].addr = 0;
+  q->free[i] = 1;
+  q->nfree++;
+  wakeup(&q->free[0]);
 }
 
-// free a chain of descriptors.
+// free a chain of descriptors. an indirect table is not
+// part of the ring's chain.
 static void
-free_chain(int i)
+free_chain(struct vqueue *q, int i)
 {
   while(1){
-    free_desc(i);
-    if(disk.desc[i].flags & VRING_DESC_F_NEXT)
-      i = disk.desc[i].next;
+    free_desc(q, i);
+    if(q->desc[i].flags & VRING_DESC_F_NEXT)
+      i = q->desc[i].next;
     else
       break;
   }
 }
 
 static int
-alloc3_desc(int *idx)
+alloc_descs(struct vqueue *q, int *idx, int n)
 {
-  for(int i = 0; i < 3; i++){
-    idx[i] = alloc_desc();
-    if(idx[i] < 0){
-      for(int j = 0; j < i; j++)
-        free_desc(idx[j]);
-      return -1;
-    }
-  }
+  if(q->nfree < n)
+    return -1;
+  for(int i = 0; i < n; i++)
+    idx[i] = alloc_desc(q);
   return 0;
 }
 
-void
-virtio_disk_rw(struct buf *b, int write)
+static inline struct disk *
+rdisk(struct blkreq *r)
 {
-  uint64 sector = b->sectorno;
+  return blkdev_get(r->dev)->private;
+}
 
-  acquire(&disk.vdisk_lock);
+// How many ring descriptors r takes. The block layer keeps within
+// the slots given to disk_register(): NUM per queue when each
+// request takes one, as a request goes on the submitting hart's
+// queue or on another when that one is full; NUM in all when it
+// takes more.
+static int
+virtio_disk_cost(struct blkreq *r)
+{
+  return rdisk(r)->indirect ? 1 : r->nseg + 2;
+}
 
-  // the spec says that legacy block operations use three
-  // descriptors: one for type/reserved/sector, one for
-  // the data, one for a 1-byte status result.
+// Lock and return a queue of d for this hart with n descriptors
+// free, or its own queue if none has them.
+static struct vqueue *
+vq_get(struct disk *d, int n)
+{
+  struct vqueue *q;
+  int id, i;
+
+  push_off();
+  id = cpuid() % d->nq;
+  pop_off();
+  for(i = 0; i < d->nq; i++){
+    q = &d->q[(id + i) % d->nq];
+    acquire(&q->lock);
+    if(q->nfree >= n)
+      return q;
+    release(&q->lock);
+  }
+  q = &d->q[id];
+  acquire(&q->lock);
+  return q;
+}
 
-  // allocate the three descriptors.
-  int idx[3];
-  while(1){
-    if(alloc3_desc(idx) == 0) {
-      break;
-    }
-    sleep(&disk.free[0], &disk.vdisk_lock);
+// Queue r and return; virtio_disk_intr() completes it. A
+// request takes a descriptor for its header, one per segment and
+// one for the status byte, in an indirect table when the device
+// takes them, so that a request takes one in the ring; waits for
+// that many to be free.
+static void
+virtio_disk_start(struct blkreq *r)
+{
+  int idx[NDESC_REQ];
+  int n = r->nseg + 2;
+  struct disk *dk = rdisk(r);
+  struct vqueue *q;
+  struct VRingDesc *d;
+  uint16 old;
+  int head;
+
+  if(r->nseg < 0 || r->nseg > BLKREQ_MAXSEG || (r->op == BLK_FLUSH) != (r->nseg == 0))
+    panic("virtio_disk_start");
+  if(r->op == BLK_FLUSH && !dk->can_flush){
+    disk_complete(r, 0);
+    return;
   }
-  
-  // format the three descriptors.
-  // qemu's virtio-blk.c reads them.
 
-  struct virtio_blk_outhdr {
-    uint32 type;
-    uint32 reserved;
-    uint64 sector;
-  } buf0;
+  q = vq_get(dk, virtio_disk_cost(r));
+
+  while(alloc_descs(q, idx, virtio_disk_cost(r)) != 0)
+    sleep(&q->free[0], &q->lock);
+  head = idx[0];
+
+  // the request's descriptors: the ring's, or its own table.
+  if(dk->indirect){
+    d = q->ind[head];
+    for(int i = 0; i < n; i++)
+      idx[i] = i;
+    q->desc[head].addr = (uint64) d;
+    q->desc[head].len = n * sizeof(struct VRingDesc);
+    q->desc[head].flags = VRING_DESC_F_INDIRECT;
+    q->desc[head].next = 0;
+  } else {
+    d = q->desc;
+  }
 
-  if(write)
-    buf0.type = VIRTIO_BLK_T_OUT; // write the disk
-  else
-    buf0.type = VIRTIO_BLK_T_IN; // read the disk
-  buf0.reserved = 0;
-  buf0.sector = sector;
-
-  // buf0 is on a kernel stack, which is not direct mapped,
-  // thus the call to kvmpa().
-  disk.desc[idx[0]].addr = (uint64) kwalkaddr(myproc()->kpagetable, (uint64) &buf0);
-  disk.desc[idx[0]].len = sizeof(buf0);
-  disk.desc[idx[0]].flags = VRING_DESC_F_NEXT;
-  disk.desc[idx[0]].next = idx[1];
-
-  disk.desc[idx[1]].addr = (uint64) b->data;
-  disk.desc[idx[1]].len = BSIZE;
-  if(write)
-    disk.desc[idx[1]].flags = 0; // device reads b->data
+  // format the descriptors.
+  // qemu's virtio-blk.c reads them.
+  struct virtio_blk_outhdr *hdr = &q->hdr[head];
+  if(r->op == BLK_WRITE)
+    hdr->type = VIRTIO_BLK_T_OUT; // write the disk
+  else if(r->op == BLK_READ)
+    hdr->type = VIRTIO_BLK_T_IN; // read the disk
   else
-    disk.desc[idx[1]].flags = VRING_DESC_F_WRITE; // device writes b->data
-  disk.desc[idx[1]].flags |= VRING_DESC_F_NEXT;
-  disk.desc[idx[1]].next = idx[2];
+    hdr->type = VIRTIO_BLK_T_FLUSH;
+  hdr->reserved = 0;
+  hdr->sector = r->sectorno;
+
+  d[idx[0]].addr = (uint64) hdr;
+  d[idx[0]].len = sizeof(*hdr);
+  d[idx[0]].flags = VRING_DESC_F_NEXT;
+  d[idx[0]].next = idx[1];
+
+  for(int i = 0; i < r->nseg; i++){
+    struct VRingDesc *s = &d[idx[i + 1]];
+    s->addr = (uint64) r->seg[i].addr;
+    s->len = r->seg[i].len;
+    if(r->op == BLK_WRITE)
+      s->flags = 0; // device reads the segment
+    else
+      s->flags = VRING_DESC_F_WRITE; // device writes the segment
+    s->flags |= VRING_DESC_F_NEXT;
+    s->next = idx[i + 2];
+  }
 
-  disk.info[idx[0]].status = 0;
-  disk.desc[idx[2]].addr = (uint64) &disk.info[idx[0]].status;
-  disk.desc[idx[2]].len = 1;
-  disk.desc[idx[2]].flags = VRING_DESC_F_WRITE; // device writes the status
-  disk.desc[idx[2]].next = 0;
+  q->info[head].status = 0xff;
+  d[idx[n - 1]].addr = (uint64) &q->info[head].status;
+  d[idx[n - 1]].len = 1;
+  d[idx[n - 1]].flags = VRING_DESC_F_WRITE; // device writes the status
+  d[idx[n - 1]].next = 0;
 
-  // record struct buf for virtio_disk_intr().
-  b->disk = 1;
-  disk.info[idx[0]].b = b;
+  // record the request for virtio_disk_intr().
+  q->info[head].r = r;
 
   // avail[0] is flags
   // avail[1] tells the device how far to look in avail[2...].
   // avail[2...] are desc[] indices the device should process.
   // we only tell device the first index in our chain of descriptors.
-  disk.avail[2 + (disk.avail[1] % NUM)] = idx[0];
+  old = q->avail[1];
+  q->avail[2 + (old % NUM)] = head;
+  __sync_synchronize();
+  q->avail[1] = old + 1;
   __sync_synchronize();
-  disk.avail[1] = disk.avail[1] + 1;
 
-  *R(VIRTIO_MMIO_QUEUE_NOTIFY) = 0; // value is queue number
+  // the device may say it is still working through the avail
+  // ring, and will come to this request without being told:
+  // with event indices, it wants telling only when avail idx
+  // passes the one it gave.
+  if(dk->event_idx ? AVAIL_EVENT(q) == old
+                    : !(q->used->flags & VRING_USED_F_NO_NOTIFY))
+    *R(dk, VIRTIO_MMIO_QUEUE_NOTIFY) = q - dk->q; // value is queue number
 
-  // Wait for virtio_disk_intr() to say request has finished.
-  while(b->disk == 1) {
-    sleep(b, &disk.vdisk_lock);
-  }
+  release(&q->lock);
+}
 
-  disk.info[idx[0]].b = 0;
-  free_chain(idx[0]);
+// Whether the device should interrupt for completions on q.
+static void
+set_intr(struct vqueue *q, int on)
+{
+  if(q->disk->event_idx)
+    USED_EVENT(q) = on ? q->used_idx : q->used_idx - 1;
+  else if(on)
+    q->avail[0] &= ~VRING_AVAIL_F_NO_INTERRUPT;
+  else
+    q->avail[0] |= VRING_AVAIL_F_NO_INTERRUPT;
+  __sync_synchronize();
+}
 
-  release(&disk.vdisk_lock);
+static inline int
+vq_pending(struct vqueue *q)
+{
+  return q->used_idx != *(volatile uint16 *)&q->used->id;
 }
 
-void
-virtio_disk_intr()
+// Take the completed requests off q's used ring and complete
+// them; returns how many. Interrupts are off while the ring is
+// drained, so a burst of completions raises one, and stay off
+// while a process polls.
+// Requests are completed after the queue lock is dropped, so that
+// their end() may submit more.
+static int
+vq_poll(struct vqueue *q)
 {
-  acquire(&disk.vdisk_lock);
+  struct blkreq *done = 0, *r;
+  int st, n = 0;
+
+  acquire(&q->lock);
+
+  for(;;){
+    set_intr(q, 0);
+    while(vq_pending(q)){
+      __sync_synchronize();
+      int id = q->used->elems[q->used_idx % NUM].id;
+
+      r = q->info[id].r;
+      r->status = q->info[id].status;
+      q->info[id].r = 0;
+      free_chain(q, id);
+      r->next = done;
+      done = r;
+      n++;
+
+      q->used_idx++;
+    }
+    if(polling)
+      break;
+    // a completion may have come in before interrupts were
+    // back on.
+    set_intr(q, 1);
+    if(!vq_pending(q))
+      break;
+  }
 
-  while((disk.used_idx % NUM) != (disk.used->id % NUM)){
-    int id = disk.used->elems[disk.used_idx].id;
+  release(&q->lock);
 
-    if(disk.info[id].status != 0)
-      panic("virtio_disk_intr status");
-    
-    disk.info[id].b->disk = 0;   // disk is done with buf
-    wakeup(disk.info[id].b);
+  while((r = done) != 0){
+    done = r->next;
+    st = r->status;
+    disk_complete(r, st == 0 ? 0 : -1);
+  }
+  return n;
+}
 
-    disk.used_idx = (disk.used_idx + 1) % NUM;
+// Reap completions on every queue of d, starting with this
+// hart's; a queue with nothing new isn't locked. With force, each
+// is looked at under its lock, so interrupts are set right.
+static int
+poll_disk(struct disk *d, int force)
+{
+  int id, i, n = 0;
+  struct vqueue *q;
+
+  push_off();
+  id = cpuid() % d->nq;
+  pop_off();
+  for(i = 0; i < d->nq; i++){
+    q = &d->q[(id + i) % d->nq];
+    if(force || vq_pending(q))
+      n += vq_poll(q);
   }
-  *R(VIRTIO_MMIO_INTERRUPT_ACK) = *R(VIRTIO_MMIO_INTERRUPT_STATUS) & 0x3;
+  return n;
+}
+
+static int
+poll_all(int force)
+{
+  int n = 0;
+
+  for(int i = 0; i < ndisk; i++)
+    n += poll_disk(&disks[i], force);
+  return n;
+}
+
+int
+virtio_disk_poll(void)
+{
+  return poll_all(0);
+}
+
+// A process starts (on) or stops spinning in virtio_disk_poll()
+// for its request; completion interrupts are off meanwhile.
+void
+virtio_disk_polling(int on)
+{
+  __sync_fetch_and_add(&polling, on ? 1 : -1);
+  if(!on)
+    poll_all(1);
+}
 
-  release(&disk.vdisk_lock);
+// A disk has one interrupt for all its queues.
+void
+virtio_disk_intr(int irq)
+{
+  for(int i = 0; i < ndisk; i++){
+    struct disk *d = &disks[i];
+    if(d->irq == irq){
+      *R(d, VIRTIO_MMIO_INTERRUPT_ACK) = *R(d, VIRTIO_MMIO_INTERRUPT_STATUS) & 0x3;
+      poll_disk(d, 1);
+    }
+  }
 }
@@ -8,6 +8,7 @@
 #include "include/proc.h"
 #include "include/printf.h"
 #include "include/string.h"
+#include "include/sbi.h"
 
 /*
  * the kernel's page table.
@@ -31,15 +32,15 @@ kvminit()
   kvmmap(UART_V, UART, PGSIZE, PTE_R | PTE_W);
   
   #ifdef QEMU
-  // virtio mmio disk interface
-  kvmmap(VIRTIO0_V, VIRTIO0, PGSIZE, PTE_R | PTE_W);
+  // virtio mmio disk interfaces
+  kvmmap(VIRTIO0_V, VIRTIO0, NVIRTIO * PGSIZE, PTE_R | PTE_W);
   #endif
   // CLINT
   kvmmap(CLINT_V, CLINT, 0x10000, PTE_R | PTE_W);
 
   // PLIC
   kvmmap(PLIC_V, PLIC, 0x4000, PTE_R | PTE_W);
-  kvmmap(PLIC_V + 0x200000, PLIC + 0x200000, 0x4000, PTE_R | PTE_W);
+  kvmmap(PLIC_V + 0x200000, PLIC + 0x200000, NCPU * 0x2000, PTE_R | PTE_W);
 
   #ifndef QEMU
   // GPIOHS
@@ -123,9 +124,8 @@ walk(pagetable_t pagetable, uint64 va, int alloc)
     if(*pte & PTE_V) {
       pagetable = (pagetable_t)PTE2PA(*pte);
     } else {
-      if(!alloc || (pagetable = (pde_t*)kalloc()) == NULL)
+      if(!alloc || (pagetable = (pde_t*)kzalloc()) == NULL)
         return NULL;
-      memset(pagetable, 0, PGSIZE);
       *pte = PA2PTE(pagetable) | PTE_V;
     }
   }
@@ -251,10 +251,9 @@ pagetable_t
 uvmcreate()
 {
   pagetable_t pagetable;
-  pagetable = (pagetable_t) kalloc();
+  pagetable = (pagetable_t) kzalloc();
   if(pagetable == NULL)
     return NULL;
-  memset(pagetable, 0, PGSIZE);
   return pagetable;
 }
 
@@ -292,12 +291,11 @@ uvmalloc(pagetable_t pagetable, pagetable_t kpagetable, uint64 oldsz, uint64 new
 
   oldsz = PGROUNDUP(oldsz);
   for(a = oldsz; a < newsz; a += PGSIZE){
-    mem = kalloc();
+    mem = kzalloc();
     if(mem == NULL){
       uvmdealloc(pagetable, kpagetable, a, oldsz);
       return 0;
     }
-    memset(mem, 0, PGSIZE);
     if (mappages(pagetable, a, PGSIZE, (uint64)mem, PTE_W|PTE_X|PTE_R|PTE_U) != 0) {
       kfree(mem);
       uvmdealloc(pagetable, kpagetable, a, oldsz);
@@ -445,7 +443,7 @@ copyout(pagetable_t pagetable, uint64 dstva, char *src, uint64 len)
 int
 copyout2(uint64 dstva, char *src, uint64 len)
 {
-  uint64 sz = myproc()->sz;
+  uint64 sz = myproc()->mm->sz;
   if (dstva + len > sz || dstva >= sz) {
     return -1;
   }
@@ -481,7 +479,7 @@ copyin(pagetable_t pagetable, char *dst, uint64 srcva, uint64 len)
 int
 copyin2(char *dst, uint64 srcva, uint64 len)
 {
-  uint64 sz = myproc()->sz;
+  uint64 sz = myproc()->mm->sz;
   if (srcva + len > sz || srcva >= sz) {
     return -1;
   }
@@ -536,7 +534,7 @@ int
 copyinstr2(char *dst, uint64 srcva, uint64 max)
 {
   int got_null = 0;
-  uint64 sz = myproc()->sz;
+  uint64 sz = myproc()->mm->sz;
   while(srcva < sz && max > 0){
     char *p = (char *)srcva;
     if(*p == '\0'){
@@ -557,27 +555,25 @@ copyinstr2(char *dst, uint64 srcva, uint64 max)
   }
 }
 
+// Recycled page-table roots and kernel stacks; see mminit().
+static struct pcache kpt_cache;
+static struct pcache upt_cache;
+static struct pcache kstack_cache;
+
 // initialize kernel pagetable for each process.
 pagetable_t
 proc_kpagetable()
 {
-  pagetable_t kpt = (pagetable_t) kalloc();
-  if (kpt == NULL)
+  pagetable_t kpt = pcache_get(&kpt_cache);
+  if (kpt != NULL)
+    return kpt;
+  if ((kpt = (pagetable_t) kalloc()) == NULL)
     return NULL;
   memmove(kpt, kernel_pagetable, PGSIZE);
 
-  // remap stack and trampoline, because they share the same page table of level 1 and 0
-  char *pstack = kalloc();
-  if(pstack == NULL)
-    goto fail;
-  if (mappages(kpt, VKSTACK, PGSIZE, (uint64)pstack, PTE_R | PTE_W) != 0)
-    goto fail;
-  
+  // kernel stacks are mapped per thread by mm_attach(); they get
+  // their own lower-level tables, not shared with kernel_pagetable.
   return kpt;
-
-fail:
-  kvmfree(kpt, 1);
-  return NULL;
 }
 
 // only free page table, not physical pages
@@ -609,18 +605,101 @@ kvmfreeusr(pagetable_t kpt)
   }
 }
 
+// Free a kernel page table built by proc_kpagetable().
+// With stack_free, also free the page-table pages that held the
+// kernel stacks; the stacks themselves must be unmapped already.
+// The root is then a plain copy of kernel_pagetable again and
+// goes back to kpt_cache.
 void
 kvmfree(pagetable_t kpt, int stack_free)
 {
   if (stack_free) {
-    vmunmap(kpt, VKSTACK, 1, 1);
     pte_t pte = kpt[PX(2, VKSTACK)];
     if ((pte & PTE_V) && (pte & (PTE_R|PTE_W|PTE_X)) == 0) {
       kfreewalk((pagetable_t) PTE2PA(pte));
     }
+    kpt[PX(2, VKSTACK)] = 0;
   }
   kvmfreeusr(kpt);
-  kfree(kpt);
+  if (stack_free)
+    pcache_put(&kpt_cache, kpt);
+  else
+    kfree(kpt);
+}
+
+// A user page table with only the trampoline mapped, as
+// mm_alloc() wants it. Returns NULL if out of memory.
+static pagetable_t
+upt_alloc(void)
+{
+  pagetable_t pagetable;
+
+  if((pagetable = pcache_get(&upt_cache)) != NULL)
+    return pagetable;
+  if((pagetable = uvmcreate()) == NULL)
+    return NULL;
+  // map the trampoline code (for system call return)
+  // at the highest user virtual address.
+  // only the supervisor uses it, on the way
+  // to/from user space, so not PTE_U.
+  if(mappages(pagetable, TRAMPOLINE, PGSIZE,
+              (uint64)trampoline, PTE_R | PTE_X) < 0){
+    uvmfree(pagetable, 0);
+    return NULL;
+  }
+  return pagetable;
+}
+
+// upt_cache's release(): a skeleton only holds the trampoline.
+static void
+upt_release(void *pagetable)
+{
+  vmunmap(pagetable, TRAMPOLINE, 1, 0);
+  freewalk(pagetable);
+}
+
+// Free a user page table whose memory below sz is the only thing
+// left mapped besides the trampoline. The page-table pages on the
+// trampoline's path are kept, for upt_alloc() to hand out again.
+static void
+upt_free(pagetable_t pagetable, uint64 sz)
+{
+  int i2 = PX(2, TRAMPOLINE), i1 = PX(1, TRAMPOLINE);
+  pagetable_t l1;
+
+  if(sz > 0)
+    vmunmap(pagetable, 0, PGROUNDUP(sz)/PGSIZE, 1);
+  for(int i = 0; i < 512; i++){
+    if(i != i2 && (pagetable[i] & PTE_V)){
+      freewalk((pagetable_t)PTE2PA(pagetable[i]));
+      pagetable[i] = 0;
+    }
+  }
+  l1 = (pagetable_t)PTE2PA(pagetable[i2]);
+  for(int i = 0; i < 512; i++){
+    if(i != i1 && (l1[i] & PTE_V)){
+      freewalk((pagetable_t)PTE2PA(l1[i]));
+      l1[i] = 0;
+    }
+  }
+  pcache_put(&upt_cache, pagetable);
+}
+
+// A kernel stack page, or 0 if out of memory.
+void *
+kstack_alloc(void)
+{
+  void *kstack;
+
+  if((kstack = pcache_get(&kstack_cache)) != NULL)
+    return kstack;
+  return kalloc();
+}
+
+void
+kstack_free(void *kstack)
+{
+  pcache_put(&kstack_cache, kstack);
 }
 
 void vmprint(pagetable_t pagetable)
@@ -649,7 +728,7 @@ void vmprint(pagetable_t pagetable)
   return;
 }
 
-void vma_writeback(struct proc *p, struct vma *v) {
+void vma_writeback(struct mm *mm, struct vma *v) {
   if(
     v->valid == 0 ||
     (v->flags & MAP_SHARED) == 0 ||
@@ -662,7 +741,7 @@ void vma_writeback(struct proc *p, struct vma *v) {
 
   for (uint64 va = v->start; va < v->end; va += PGSIZE) {
     struct dirent *ep = v->vm_file->ep;
-    uint64 pa = walkaddr(p->pagetable, va);
+    uint64 pa = walkaddr(mm->pagetable, va);
     if(pa == 0) continue;
     elock(ep);
     uint64 offset = (va - v->start) + v->offset;
@@ -671,14 +750,14 @@ void vma_writeback(struct proc *p, struct vma *v) {
   }
 }
 
-void vma_free(struct proc *p) {
+void vma_free(struct mm *mm) {
   for(int i = 0; i < NVMA; ++i) {
-    struct vma *v = &p->vma[i];
+    struct vma *v = &mm->vma[i];
     if(v->valid == 0) continue;
 
     int npages = (v->end - v->start) / PGSIZE;
     int do_free = (v->flags & MAP_SHARED) == 0;
-    vmunmap(p->pagetable, v->start, npages, do_free);
+    vmunmap(mm->pagetable, v->start, npages, do_free);
 
     if(v->vm_file != NULL) {
       fileclose(v->vm_file);
@@ -689,12 +768,12 @@ void vma_free(struct proc *p) {
   }
 }
 
-uint64 mmap_getaddr(struct proc *p, uint64 len) {
+uint64 mmap_getaddr(struct mm *mm, uint64 len) {
   uint64 addr = MMAPBASE - len;
 
-  for(; addr >= p->sz; addr -= len) {
+  for(; addr >= mm->sz; addr -= len) {
     for(int i = 0; i < NVMA; ++i) {
-      struct vma *v = &p->vma[i];
+      struct vma *v = &mm->vma[i];
       if(v->valid && v->start <= addr && v->end >= addr) {
         addr = v->start;
         goto next;
@@ -705,3 +784,241 @@ uint64 mmap_getaddr(struct proc *p, uint64 len) {
   }
   return 0;
 }
+
+// Address spaces, shared by CLONE_VM threads.
+// mmtable.lock protects ref, users and slots of every mm.
+struct {
+  struct spinlock lock;
+  struct kmem_cache cache;
+} mmtable;
+
+void
+mminit(void)
+{
+  initlock(&mmtable.lock, "mmtable");
+  kmem_cache_init(&mmtable.cache, "mm", sizeof(struct mm));
+  pcache_init(&kpt_cache, "kpt", kfree);
+  pcache_init(&upt_cache, "upt", upt_release);
+  pcache_init(&kstack_cache, "kstack", kfree);
+}
+
+// Allocate an empty address space: a user page table with only
+// the trampoline, and a kernel page table without stacks.
+// Returns with one reference held by the caller, or NULL.
+struct mm*
+mm_alloc(void)
+{
+  struct mm *mm;
+
+  if((mm = kmem_cache_alloc(&mmtable.cache)) == NULL)
+    return NULL;
+  initsleeplock(&mm->lock, "mm");
+  mm->ref = 1;
+  mm->users = 0;
+  mm->slots = 0;
+  mm->sz = 0;
+  for(int i = 0; i < NVMA; i++)
+    mm->vma[i].valid = 0;
+  mm->kpagetable = NULL;
+  if((mm->pagetable = upt_alloc()) == NULL)
+    goto bad;
+  if((mm->kpagetable = proc_kpagetable()) == NULL)
+    goto bad;
+  return mm;
+
+bad:
+  mm_put(mm);
+  return NULL;
+}
+
+static void
+mm_free(struct mm *mm)
+{
+  if(mm->pagetable)
+    upt_free(mm->pagetable, mm->sz);
+  mm->pagetable = NULL;
+  if(mm->kpagetable)
+    kvmfree(mm->kpagetable, 1);
+  mm->kpagetable = NULL;
+  kmem_cache_free(&mmtable.cache, mm);
+}
+
+// Drop a reference; the last one frees the page tables
+// and user memory. Does not sleep.
+void
+mm_put(struct mm *mm)
+{
+  int last;
+
+  acquire(&mmtable.lock);
+  last = mm->ref == 1;
+  if(!last)
+    mm->ref--;
+  release(&mmtable.lock);
+  if(last)
+    mm_free(mm);
+}
+
+// A thread using mm is exiting or exec()ing away from it; the
+// last one tears down the mmaps, which may write back to files.
+void
+mm_release(struct mm *mm)
+{
+  int last;
+
+  acquire(&mmtable.lock);
+  last = --mm->users == 0;
+  release(&mmtable.lock);
+  if(last)
+    vma_free(mm);
+}
+
+// Copy an address space, for fork() and clone() without CLONE_VM.
+struct mm*
+mm_dup(struct mm *old)
+{
+  struct mm *mm;
+
+  if((mm = mm_alloc()) == NULL)
+    return NULL;
+
+  acquiresleep(&old->lock);
+  if(uvmcopy(old->pagetable, mm->pagetable, mm->kpagetable, old->sz) < 0){
+    releasesleep(&old->lock);
+    mm_put(mm);
+    return NULL;
+  }
+  mm->sz = old->sz;
+  for(int i = 0; i < NVMA; i++){
+    if(old->vma[i].valid){
+      mm->vma[i] = old->vma[i];
+      if(mm->vma[i].vm_file)
+        filedup(mm->vma[i].vm_file);
+    }
+  }
+  releasesleep(&old->lock);
+  return mm;
+}
+
+// Add p to mm as a new thread: give it a free slot, a fresh
+// kernel stack, and map its trapframe.
+// Returns 0, or -1 if mm is full or memory ran out.
+int
+mm_attach(struct mm *mm, struct proc *p)
+{
+  int slot, shared;
+  char *kstack;
+
+  acquire(&mmtable.lock);
+  for(slot = 0; slot < NTHREAD; slot++)
+    if((mm->slots & (1 << slot)) == 0)
+      break;
+  if(slot == NTHREAD){
+    release(&mmtable.lock);
+    return -1;
+  }
+  mm->slots |= 1 << slot;
+  mm->ref++;
+  shared = mm->users++ > 0;
+  release(&mmtable.lock);
+
+  // other threads may be changing the same page tables. A fresh
+  // mm has none, which lets userinit() get here without a proc.
+  if(shared)
+    acquiresleep(&mm->lock);
+  if((kstack = kstack_alloc()) == NULL)
+    goto bad;
+  if(mappages(mm->kpagetable, KSTACK(slot), PGSIZE, (uint64)kstack, PTE_R | PTE_W) < 0){
+    kstack_free(kstack);
+    goto bad;
+  }
+  if(mappages(mm->pagetable, TRAPFRAME_SLOT(slot), PGSIZE,
+              (uint64)p->trapframe, PTE_R | PTE_W) < 0){
+    vmunmap(mm->kpagetable, KSTACK(slot), 1, 1);
+    goto bad;
+  }
+  if(shared)
+    releasesleep(&mm->lock);
+
+  p->mm = mm;
+  p->tslot = slot;
+  p->kstack = KSTACK(slot);
+  return 0;
+
+bad:
+  if(shared)
+    releasesleep(&mm->lock);
+  acquire(&mmtable.lock);
+  mm->slots &= ~(1 << slot);
+  mm->ref--;
+  mm->users--;
+  release(&mmtable.lock);
+  return -1;
+}
+
+// Remove p's trapframe and kernel stack from its address space and
+// drop p's reference. Only clears leaf PTEs, so it does not race
+// with mappages() in other threads and can run without mm->lock.
+void
+mm_detach(struct proc *p, int free_kstack)
+{
+  struct mm *mm = p->mm;
+  void *kstack = (void*)kwalkaddr(mm->kpagetable, p->kstack);
+
+  vmunmap(mm->pagetable, TRAPFRAME_SLOT(p->tslot), 1, 0);
+  vmunmap(mm->kpagetable, p->kstack, 1, 0);
+  if(free_kstack)
+    kstack_free(kstack);
+  acquire(&mmtable.lock);
+  mm->slots &= ~(1 << p->tslot);
+  release(&mmtable.lock);
+  p->mm = NULL;
+  mm_put(mm);
+}
+
+// Move the calling thread into the fresh address space mm, for
+// exec(). The kernel stack we are running on keeps its address
+// and page; the old address space loses this thread.
+int
+mm_move(struct proc *p, struct mm *mm)
+{
+  struct mm *old = p->mm;
+  uint64 kstack = kwalkaddr(old->kpagetable, p->kstack);
+
+  if(mappages(mm->kpagetable, p->kstack, PGSIZE, kstack, PTE_R | PTE_W) < 0)
+    return -1;
+  if(mappages(mm->pagetable, TRAPFRAME_SLOT(p->tslot), PGSIZE,
+              (uint64)p->trapframe, PTE_R | PTE_W) < 0){
+    vmunmap(mm->kpagetable, p->kstack, 1, 0);
+    return -1;
+  }
+  acquire(&mmtable.lock);
+  mm->slots |= 1 << p->tslot;
+  mm->ref++;
+  mm->users++;
+  release(&mmtable.lock);
+
+  p->mm = mm;
+  w_satp(MAKE_SATP(mm->kpagetable));
+  sfence_vma();
+
+  mm_release(old);
+  vmunmap(old->pagetable, TRAPFRAME_SLOT(p->tslot), 1, 0);
+  vmunmap(old->kpagetable, p->kstack, 1, 0);
+  acquire(&mmtable.lock);
+  old->slots &= ~(1 << p->tslot);
+  release(&mmtable.lock);
+  mm_put(old);
+  return 0;
+}
+
+// User mappings of mm were removed; other harts running its
+// threads may still cache them.
+void
+mm_flush_tlb(struct mm *mm)
+{
+  if(mm->users > 1){
+    unsigned long mask = cpus_online;
+    sbi_remote_sfence_vma(&mask, 0, MAXUVA);
+  }
+}
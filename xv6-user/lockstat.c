@@ -0,0 +1,53 @@
+#include "kernel/include/types.h"
+#include "kernel/include/stat.h"
+#include "kernel/include/timer.h"
+#include "kernel/include/lockstat.h"
+#include "xv6-user/user.h"
+
+// hardware ticks to microseconds
+#define US(t)   ((t) / (CLOCK_FREQ / 1000000))
+
+static struct lockstat st[NLOCKCLASS + 1];
+
+int
+main(int argc, char *argv[])
+{
+  int n, reset = 0;
+
+  if(argc > 2 || (argc == 2 && strcmp(argv[1], "-r") != 0)){
+    fprintf(2, "usage: %s [-r]\n", argv[0]);
+    exit(1);
+  }
+  if(argc == 2)
+    reset = 1;
+
+  if((n = lockstat(st, NLOCKCLASS + 1, reset)) < 0){
+    fprintf(2, "%s: lockstat failed\n", argv[0]);
+    exit(1);
+  }
+
+  // most time spent waiting first
+  for(int i = 1; i < n; i++){
+    for(int j = i; j > 0 && st[j].wait_total > st[j-1].wait_total; j--){
+      struct lockstat t = st[j];
+      st[j] = st[j-1];
+      st[j-1] = t;
+    }
+  }
+
+  printf("name             type   acquire contended wait-us  max-us   hold-us  max-us\n");
+  for(int i = 0; i < n; i++){
+    if(st[i].acquire == 0)
+      continue;
+    printf("%s", st[i].name);
+    for(int k = strlen(st[i].name); k < 17; k++)
+      printf(" ");
+    printf("%s %l %l %l %l %l %l\n", st[i].sleep ? "sleep" : "spin ",
+           st[i].acquire, st[i].contended,
+           US(st[i].wait_total), US(st[i].wait_max),
+           US(st[i].hold_total), US(st[i].hold_max));
+  }
+  if(reset)
+    printf("counters reset\n");
+  exit(0);
+}
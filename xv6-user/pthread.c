@@ -0,0 +1,165 @@
+#include "kernel/include/types.h"
+#include "kernel/include/sysnum.h"
+#include "kernel/include/sched.h"
+#include "kernel/include/futex.h"
+#include "xv6-user/user.h"
+#include "xv6-user/pthread.h"
+
+#define STR(x)  #x
+#define XSTR(x) STR(x)
+
+// int __clone(int (*fn)(void *), void *stack, int flags, void *arg,
+//             int *ptid, void *tls, int *ctid);
+// fn and arg are pushed on the new stack, where only the child
+// finds them; the child calls fn(arg) and exits with its result.
+int __clone(int (*)(void *), void *, int, void *, int *, void *, int *);
+asm(
+  ".text\n"
+  ".global __clone\n"
+  "__clone:\n"
+  "  andi a1, a1, -16\n"
+  "  addi a1, a1, -16\n"
+  "  sd a0, 0(a1)\n"
+  "  sd a3, 8(a1)\n"
+  "  mv a0, a2\n"
+  "  mv a2, a4\n"
+  "  mv a3, a5\n"
+  "  mv a4, a6\n"
+  "  li a7, " XSTR(SYS_clone) "\n"
+  "  ecall\n"
+  "  beqz a0, 1f\n"
+  "  ret\n"
+  "1:\n"
+  "  ld a1, 0(sp)\n"
+  "  ld a0, 8(sp)\n"
+  "  jalr a1\n"
+  "  li a7, " XSTR(SYS_exit) "\n"
+  "  ecall\n"
+);
+
+#define THREAD_FLAGS (CLONE_VM | CLONE_FS | CLONE_FILES | CLONE_SIGHAND | \
+                      CLONE_THREAD | CLONE_SYSVSEM | CLONE_SETTLS | \
+                      CLONE_PARENT_SETTID | CLONE_CHILD_CLEARTID)
+
+static struct pthread main_thread;
+
+static int
+start_thread(void *arg)
+{
+  struct pthread *t = arg;
+
+  t->result = t->start(t->arg);
+  return 0;
+}
+
+int
+pthread_create(pthread_t *thread, const pthread_attr_t *attr,
+               void *(*start)(void *), void *arg)
+{
+  struct pthread *t;
+
+  if((t = malloc(sizeof(*t))) == 0)
+    return -1;
+  if((t->stack = malloc(PTHREAD_STACK_SIZE)) == 0){
+    free(t);
+    return -1;
+  }
+  t->self = t;
+  t->start = start;
+  t->arg = arg;
+  t->result = 0;
+  if(__clone(start_thread, t->stack + PTHREAD_STACK_SIZE, THREAD_FLAGS, t,
+             (int *)&t->tid, t, (int *)&t->tid) < 0){
+    free(t->stack);
+    free(t);
+    return -1;
+  }
+  *thread = t;
+  return 0;
+}
+
+int
+pthread_join(pthread_t t, void **result)
+{
+  int tid;
+
+  // the kernel clears tid and wakes us when the thread exits.
+  while((tid = t->tid) != 0)
+    futex(&t->tid, FUTEX_WAIT, tid, 0, 0, 0);
+  if(result)
+    *result = t->result;
+  free(t->stack);
+  free(t);
+  return 0;
+}
+
+void
+pthread_exit(void *result)
+{
+  pthread_self()->result = result;
+  exit(0);
+}
+
+pthread_t
+pthread_self(void)
+{
+  struct pthread *t;
+
+  asm volatile("mv %0, tp" : "=r" (t));
+  return t ? t : &main_thread;
+}
+
+int
+pthread_mutex_init(pthread_mutex_t *m, void *attr)
+{
+  mutex_init(m);
+  return 0;
+}
+
+int
+pthread_mutex_trylock(pthread_mutex_t *m)
+{
+  return mutex_trylock(m);
+}
+
+int
+pthread_mutex_lock(pthread_mutex_t *m)
+{
+  mutex_lock(m);
+  return 0;
+}
+
+int
+pthread_mutex_unlock(pthread_mutex_t *m)
+{
+  mutex_unlock(m);
+  return 0;
+}
+
+int
+pthread_cond_init(pthread_cond_t *c, void *attr)
+{
+  cond_init(c);
+  return 0;
+}
+
+int
+pthread_cond_wait(pthread_cond_t *c, pthread_mutex_t *m)
+{
+  cond_wait(c, m);
+  return 0;
+}
+
+int
+pthread_cond_signal(pthread_cond_t *c)
+{
+  cond_signal(c);
+  return 0;
+}
+
+int
+pthread_cond_broadcast(pthread_cond_t *c)
+{
+  cond_broadcast(c);
+  return 0;
+}
@@ -0,0 +1,45 @@
+#ifndef __PTHREAD_H
+#define __PTHREAD_H
+
+// A minimal pthreads on top of clone(). Each thread gets a
+// malloc()ed stack; umalloc is not thread-safe, so create and
+// join threads from one thread only, and do not malloc() in
+// several threads at once.
+
+#define PTHREAD_STACK_SIZE  8192
+
+struct pthread {
+  struct pthread *self;   // tp points here
+  void *(*start)(void *);
+  void *arg;
+  void *result;
+  char *stack;
+  volatile int tid;       // cleared by the kernel when the thread exits
+};
+
+typedef struct pthread *pthread_t;
+typedef struct pthread_attr pthread_attr_t;   // attributes are not supported
+
+typedef struct mutex pthread_mutex_t;   // see ulib.c
+typedef struct cond pthread_cond_t;
+
+#define PTHREAD_MUTEX_INITIALIZER { 0 }
+#define PTHREAD_COND_INITIALIZER  { 0, 0 }
+
+int pthread_create(pthread_t *thread, const pthread_attr_t *attr,
+                   void *(*start)(void *), void *arg);
+int pthread_join(pthread_t thread, void **result);
+void pthread_exit(void *result) __attribute__((noreturn));
+pthread_t pthread_self(void);
+
+int pthread_mutex_init(pthread_mutex_t *m, void *attr);
+int pthread_mutex_lock(pthread_mutex_t *m);
+int pthread_mutex_trylock(pthread_mutex_t *m);
+int pthread_mutex_unlock(pthread_mutex_t *m);
+
+int pthread_cond_init(pthread_cond_t *c, void *attr);
+int pthread_cond_wait(pthread_cond_t *c, pthread_mutex_t *m);
+int pthread_cond_signal(pthread_cond_t *c);
+int pthread_cond_broadcast(pthread_cond_t *c);
+
+#endif
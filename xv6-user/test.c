@@ -3,6 +3,14 @@
 #include "kernel/include/sysinfo.h"
 #include "xv6-user/user.h"
 
+static void
+printload(uint64 load)
+{
+    // loads[] are fixed point with FSHIFT fraction bits
+    uint64 frac = (load & (FIXED_1 - 1)) * 100 / FIXED_1;
+    printf("%d.%d%d", (int)(load >> FSHIFT), (int)(frac / 10), (int)(frac % 10));
+}
+
 int main()
 {
     struct sysinfo info;
@@ -11,6 +19,19 @@ int main()
     } else {
         printf("memory left: %d KB\n", info.freemem >> 10);
         printf("process amount: %d\n", info.nproc);
+        printf("uptime: %d s, load average: ", info.uptime);
+        for (int i = 0; i < 3; i++) {
+            printload(info.loads[i]);
+            printf(i < 2 ? ", " : "\n");
+        }
+        for (int i = 0; i < info.ncpu; i++) {
+            printf("cpu%d: user %d ms, sys %d ms, irq %d ms, idle %d ms\n", i,
+                   (int)(info.cpu[i].user / 1000), (int)(info.cpu[i].sys / 1000),
+                   (int)(info.cpu[i].irq / 1000), (int)(info.cpu[i].idle / 1000));
+        }
+        printf("bcache: %d buffers, %d hits, %d misses, %d evictions, %d read ahead\n",
+               (int)info.bcache.nbuf, (int)info.bcache.hit,
+               (int)info.bcache.miss, (int)info.bcache.evict, (int)info.bcache.ra);
     }
     exit(0);
 }
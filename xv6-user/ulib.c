@@ -1,6 +1,7 @@
 #include "kernel/include/types.h"
 #include "kernel/include/stat.h"
 #include "kernel/include/fcntl.h"
+#include "kernel/include/futex.h"
 #include "xv6-user/user.h"
 
 char*
@@ -150,3 +151,91 @@ memcpy(void *dst, const void *src, uint n)
 {
   return memmove(dst, src, n);
 }
+
+// Mutex and condition variable after Drepper, "Futexes Are
+// Tricky": the uncontended paths never enter the kernel.
+
+void
+mutex_init(struct mutex *m)
+{
+  m->state = 0;
+}
+
+int
+mutex_trylock(struct mutex *m)
+{
+  int c = 0;
+
+  return __atomic_compare_exchange_n(&m->state, &c, 1, 0,
+                                     __ATOMIC_ACQUIRE, __ATOMIC_RELAXED) ? 0 : -1;
+}
+
+void
+mutex_lock(struct mutex *m)
+{
+  int c = 0;
+
+  if(__atomic_compare_exchange_n(&m->state, &c, 1, 0,
+                                 __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+    return;
+  // announce a waiter, so that the holder's unlock wakes us.
+  if(c != 2)
+    c = __atomic_exchange_n(&m->state, 2, __ATOMIC_ACQUIRE);
+  while(c != 0){
+    futex(&m->state, FUTEX_WAIT | FUTEX_PRIVATE_FLAG, 2, 0, 0, 0);
+    c = __atomic_exchange_n(&m->state, 2, __ATOMIC_ACQUIRE);
+  }
+}
+
+void
+mutex_unlock(struct mutex *m)
+{
+  if(__atomic_fetch_sub(&m->state, 1, __ATOMIC_RELEASE) != 1){
+    m->state = 0;
+    futex(&m->state, FUTEX_WAKE | FUTEX_PRIVATE_FLAG, 1, 0, 0, 0);
+  }
+}
+
+void
+cond_init(struct cond *c)
+{
+  c->seq = 0;
+  c->m = 0;
+}
+
+void
+cond_wait(struct cond *c, struct mutex *m)
+{
+  int seq = c->seq;
+
+  c->m = m;
+  mutex_unlock(m);
+  futex(&c->seq, FUTEX_WAIT | FUTEX_PRIVATE_FLAG, seq, 0, 0, 0);
+  // others may have been requeued onto m behind us: take it
+  // as contended so that our unlock wakes them in turn.
+  while(__atomic_exchange_n(&m->state, 2, __ATOMIC_ACQUIRE) != 0)
+    futex(&m->state, FUTEX_WAIT | FUTEX_PRIVATE_FLAG, 2, 0, 0, 0);
+}
+
+void
+cond_signal(struct cond *c)
+{
+  __atomic_fetch_add(&c->seq, 1, __ATOMIC_RELEASE);
+  futex(&c->seq, FUTEX_WAKE | FUTEX_PRIVATE_FLAG, 1, 0, 0, 0);
+}
+
+void
+cond_broadcast(struct cond *c)
+{
+  struct mutex *m = c->m;
+
+  __atomic_fetch_add(&c->seq, 1, __ATOMIC_RELEASE);
+  if(m == 0){
+    futex(&c->seq, FUTEX_WAKE | FUTEX_PRIVATE_FLAG, 0x7fffffff, 0, 0, 0);
+    return;
+  }
+  // wake one; the rest would only pile up on m, so move them
+  // straight to its queue.
+  futex(&c->seq, FUTEX_REQUEUE | FUTEX_PRIVATE_FLAG, 1,
+        (void *)0x7fffffffL, &m->state, 0);
+}
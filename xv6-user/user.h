@@ -5,6 +5,9 @@
 struct stat;
 struct rtcdate;
 struct sysinfo;
+struct lockstat;
+struct tms;
+struct rusage;
 
 // system calls
 int fork(void);
@@ -32,8 +35,21 @@ int getcwd(char *buf);
 int remove(char *filename);
 int trace(int mask);
 int sysinfo(struct sysinfo *);
+int lockstat(struct lockstat *, int n, int reset);
 int rename(char *old, char *new);
 int shutdown(void); // call sbi_shutdown
+int sync(void);
+int fsync(int fd);
+int fdatasync(int fd);
+long times(struct tms *);
+int getrusage(int who, struct rusage *);
+int sched_yield(void);
+int gettid(void);
+int exit_group(int) __attribute__((noreturn));
+int set_tid_address(int *tidptr);
+int futex(volatile int *uaddr, int op, int val, void *timeout, volatile int *uaddr2, int val3);
+int sched_setaffinity(int pid, int len, uint64 *mask);
+int sched_getaffinity(int pid, int len, uint64 *mask);
 
 
 // ulib.c
@@ -53,3 +69,20 @@ void free(void*);
 int atoi(const char*);
 int memcmp(const void *, const void *, uint);
 void *memcpy(void *, const void *, uint);
+
+// ulib.c: sleeping locks on top of futex()
+struct mutex {
+  volatile int state;   // 0 unlocked, 1 locked, 2 locked with waiters
+};
+struct cond {
+  volatile int seq;     // bumped by every signal
+  struct mutex *m;      // the mutex of the last waiter, for broadcast
+};
+void mutex_init(struct mutex *);
+void mutex_lock(struct mutex *);
+int mutex_trylock(struct mutex *);
+void mutex_unlock(struct mutex *);
+void cond_init(struct cond *);
+void cond_wait(struct cond *, struct mutex *);
+void cond_signal(struct cond *);
+void cond_broadcast(struct cond *);
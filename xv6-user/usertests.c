@@ -6,6 +6,9 @@
 #include "kernel/include/syscall.h"
 #include "kernel/include/memlayout.h"
 #include "kernel/include/riscv.h"
+#include "xv6-user/pthread.h"
+#include "kernel/include/futex.h"
+#include "kernel/include/timer.h"
 
 //
 // Tests xv6 system calls.  usertests without arguments runs them all
@@ -1959,6 +1962,316 @@ forktest(char *s)
   }
 }
 
+// threads share memory and the pid, and are joined, not waited for.
+enum { NTHREADS = 4, NLOOPS = 1000 };
+static pthread_mutex_t threadlock = PTHREAD_MUTEX_INITIALIZER;
+static int threadcount;
+static int threadpid;
+
+static void *
+threadworker(void *arg)
+{
+  for(int i = 0; i < NLOOPS; i++){
+    pthread_mutex_lock(&threadlock);
+    threadcount++;
+    pthread_mutex_unlock(&threadlock);
+  }
+  if(getpid() != threadpid || gettid() == threadpid)
+    return (void *)0;
+  return arg;
+}
+
+void
+threads(char *s)
+{
+  pthread_t t[NTHREADS];
+  void *result;
+
+  threadpid = getpid();
+  for(int i = 0; i < NTHREADS; i++){
+    if(pthread_create(&t[i], 0, threadworker, (void *)(uint64)(i + 1)) < 0){
+      printf("%s: pthread_create failed\n", s);
+      exit(1);
+    }
+  }
+  for(int i = 0; i < NTHREADS; i++){
+    pthread_join(t[i], &result);
+    if((uint64)result != i + 1){
+      printf("%s: thread %d returned %p\n", s, i, result);
+      exit(1);
+    }
+  }
+  if(threadcount != NTHREADS * NLOOPS){
+    printf("%s: count %d, expected %d\n", s, threadcount, NTHREADS * NLOOPS);
+    exit(1);
+  }
+  if(wait(0) != -1){
+    printf("%s: wait returned a thread\n", s);
+    exit(1);
+  }
+}
+
+// a condition variable hands items from one thread to another,
+// and FUTEX_WAIT gives up on a word nobody wakes.
+static pthread_mutex_t condlock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t condready = PTHREAD_COND_INITIALIZER;
+static int condslot, condtaken;
+
+static void *
+condconsumer(void *arg)
+{
+  for(int i = 1; i <= NLOOPS; i++){
+    pthread_mutex_lock(&condlock);
+    while(condslot == 0)
+      pthread_cond_wait(&condready, &condlock);
+    if(condslot == i)
+      condtaken++;
+    condslot = 0;
+    pthread_cond_broadcast(&condready);
+    pthread_mutex_unlock(&condlock);
+  }
+  return 0;
+}
+
+void
+futexcond(char *s)
+{
+  pthread_t t;
+  volatile int word = 1;
+  struct timespec timeout = { 0, 10000 };
+
+  if(futex(&word, FUTEX_WAIT, 0, 0, 0, 0) != -1){
+    printf("%s: FUTEX_WAIT slept on a changed word\n", s);
+    exit(1);
+  }
+  if(futex(&word, FUTEX_WAIT, 1, &timeout, 0, 0) != -1){
+    printf("%s: FUTEX_WAIT did not time out\n", s);
+    exit(1);
+  }
+
+  if(pthread_create(&t, 0, condconsumer, 0) < 0){
+    printf("%s: pthread_create failed\n", s);
+    exit(1);
+  }
+  for(int i = 1; i <= NLOOPS; i++){
+    pthread_mutex_lock(&condlock);
+    while(condslot != 0)
+      pthread_cond_wait(&condready, &condlock);
+    condslot = i;
+    pthread_cond_signal(&condready);
+    pthread_mutex_unlock(&condlock);
+  }
+  pthread_join(t, 0);
+  if(condtaken != NLOOPS){
+    printf("%s: consumer took %d of %d\n", s, condtaken, NLOOPS);
+    exit(1);
+  }
+}
+
+// several processes keep values in FP registers across
+// yields; each must get its own registers back.
+void
+fpswitch(char *s)
+{
+  enum { NCHILD = 4, N = 2000 };
+  int pid, xstatus;
+
+  for(int i = 0; i < NCHILD; i++){
+    pid = fork();
+    if(pid < 0){
+      printf("%s: fork failed\n", s);
+      exit(1);
+    }
+    if(pid == 0){
+      volatile double step = i + 1;
+      double sum = 0;
+      for(int j = 0; j < N; j++){
+        sum += step;
+        if(j % 100 == 0)
+          sched_yield();
+      }
+      exit(sum == (double)N * (i + 1) ? 0 : 1);
+    }
+  }
+  for(int i = 0; i < NCHILD; i++){
+    wait(&xstatus);
+    if(xstatus != 0){
+      printf("%s: FP registers were clobbered\n", s);
+      exit(1);
+    }
+  }
+}
+
+// pin the child to each online hart in turn; the mask must
+// round-trip and be inherited across fork.
+void
+affinity(char *s)
+{
+  uint64 all, mask;
+  int pid, xstatus;
+
+  if(sched_getaffinity(0, sizeof(all), &all) != sizeof(all) || all == 0){
+    printf("%s: sched_getaffinity failed\n", s);
+    exit(1);
+  }
+  mask = 0;
+  if(sched_setaffinity(0, sizeof(mask), &mask) != -1){
+    printf("%s: empty mask accepted\n", s);
+    exit(1);
+  }
+  for(int i = 0; i < 64; i++){
+    if((all & (1UL << i)) == 0)
+      continue;
+    mask = 1UL << i;
+    if(sched_setaffinity(0, sizeof(mask), &mask) < 0){
+      printf("%s: sched_setaffinity hart %d failed\n", s, i);
+      exit(1);
+    }
+    pid = fork();
+    if(pid < 0){
+      printf("%s: fork failed\n", s);
+      exit(1);
+    }
+    if(pid == 0){
+      uint64 got = 0;
+      sched_yield();
+      sched_getaffinity(0, sizeof(got), &got);
+      exit(got == mask ? 0 : 1);
+    }
+    wait(&xstatus);
+    if(xstatus != 0){
+      printf("%s: child lost its mask for hart %d\n", s, i);
+      exit(1);
+    }
+  }
+  sched_setaffinity(0, sizeof(all), &all);
+}
+
+// small appends land in the buffer cache; fsync, fdatasync
+// and sync must write them back and the data must read back.
+void
+syncfile(char *s)
+{
+  enum { N = 64 };
+  char buf[16];
+  int fd, i;
+
+  fd = open("syncfile", O_CREATE|O_RDWR);
+  if(fd < 0){
+    printf("%s: create failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < N; i++){
+    memset(buf, 'a' + i % 26, sizeof(buf));
+    if(write(fd, buf, sizeof(buf)) != sizeof(buf)){
+      printf("%s: write failed\n", s);
+      exit(1);
+    }
+    if(i == N / 2 && fdatasync(fd) < 0){
+      printf("%s: fdatasync failed\n", s);
+      exit(1);
+    }
+  }
+  if(fsync(fd) < 0 || sync() < 0){
+    printf("%s: fsync failed\n", s);
+    exit(1);
+  }
+  close(fd);
+  if(fsync(fd) != -1){
+    printf("%s: fsync on a closed fd succeeded\n", s);
+    exit(1);
+  }
+
+  fd = open("syncfile", O_RDONLY);
+  for(i = 0; i < N; i++){
+    if(read(fd, buf, sizeof(buf)) != sizeof(buf) || buf[0] != 'a' + i % 26){
+      printf("%s: wrong data read back\n", s);
+      exit(1);
+    }
+  }
+  close(fd);
+  remove("syncfile");
+}
+
+// files and directories in the in-memory file system on /tmp
+void
+tmpfs(char *s)
+{
+  char buf[16];
+  struct stat st;
+  int fd, n;
+
+  fd = open("/tmp/tf", O_CREATE|O_RDWR);
+  if(fd < 0){
+    printf("%s: create failed\n", s);
+    exit(1);
+  }
+  if(write(fd, "hello", 5) != 5){
+    printf("%s: write failed\n", s);
+    exit(1);
+  }
+  close(fd);
+  fd = open("/tmp/tf", O_WRONLY|O_APPEND);
+  if(fd < 0 || write(fd, "world", 5) != 5){
+    printf("%s: append failed\n", s);
+    exit(1);
+  }
+  close(fd);
+  fd = open("/tmp/tf", O_RDONLY);
+  n = read(fd, buf, sizeof(buf));
+  close(fd);
+  if(n != 10 || memcmp(buf, "helloworld", 10) != 0){
+    printf("%s: wrong data read back\n", s);
+    exit(1);
+  }
+  fd = open("/tmp/tf", O_RDWR|O_TRUNC);
+  if(fd < 0 || read(fd, buf, sizeof(buf)) != 0){
+    printf("%s: O_TRUNC left data\n", s);
+    exit(1);
+  }
+  close(fd);
+
+  if(mkdir("/tmp/td") < 0){
+    printf("%s: mkdir failed\n", s);
+    exit(1);
+  }
+  if(rename("/tmp/tf", "/tmp/td/tf2") < 0){
+    printf("%s: rename failed\n", s);
+    exit(1);
+  }
+  if(open("/tmp/tf", O_RDONLY) >= 0){
+    printf("%s: renamed file still there\n", s);
+    exit(1);
+  }
+  fd = open("/tmp/td", O_RDONLY);
+  if(fd < 0 || readdir(fd, &st) != 1 || strcmp(st.name, "tf2") != 0 ||
+     readdir(fd, &st) != 0){
+    printf("%s: readdir failed\n", s);
+    exit(1);
+  }
+  close(fd);
+  if(remove("/tmp/td") == 0){
+    printf("%s: removed a non-empty directory\n", s);
+    exit(1);
+  }
+  if(rename("/tmp/td/tf2", "tmpfsfile") != -1){
+    printf("%s: rename across file systems succeeded\n", s);
+    exit(1);
+  }
+  if(chdir("/tmp/td") != -1){
+    printf("%s: chdir into /tmp succeeded\n", s);
+    exit(1);
+  }
+  if(remove("/tmp/td/tf2") < 0 || remove("/tmp/td") < 0){
+    printf("%s: remove failed\n", s);
+    exit(1);
+  }
+  if(open("/tmp/td", O_RDONLY) >= 0){
+    printf("%s: removed directory still there\n", s);
+    exit(1);
+  }
+}
+
 void
 sbrkbasic(char *s)
 {
@@ -2702,6 +3015,12 @@ main(int argc, char *argv[])
     {dirfile, "dirfile"},
     {iref, "iref"},
     {forktest, "forktest"},
+    {threads, "threads"},
+    {futexcond, "futexcond"},
+    {affinity, "affinity"},
+    {fpswitch, "fpswitch"},
+    {syncfile, "syncfile"},
+    {tmpfs, "tmpfs"},
               // {bigdir, "bigdir"}, // slow
     { 0, 0},
   };
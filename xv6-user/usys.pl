@@ -41,4 +41,17 @@ entry("remove");
 entry("trace");
 entry("sysinfo");
 entry("rename");
-entry("shutdown")
+entry("shutdown");
+entry("times");
+entry("getrusage");
+entry("sched_yield");
+entry("gettid");
+entry("exit_group");
+entry("set_tid_address");
+entry("futex");
+entry("sched_setaffinity");
+entry("sched_getaffinity");
+entry("lockstat");
+entry("sync");
+entry("fsync");
+entry("fdatasync")